@@ -5,285 +5,7450 @@
  * Displays a X BitMap (XBM) image on the screen.
  *
  * This example shows
- * - Reading XBM bitmap from file
+ * - Reading XBM bitmap from file, mapped into memory
+ * - Tokenizing the hex literals with SSE2/AVX2 instead of sscanf()
+ * - Reading X10 and PBM bitmaps, and gzip and zstd compressed XBM files
+ * - Parsing large bitmaps on multiple threads, or keeping them in tiles
+ * - Caching the decoded bitmap in a sidecar file
+ * - Showing the bitmap while it is read, also from stdin
+ * - Expanding only the visible section of the bitmap, row by row through a
+ *   lookup table
+ * - Drawing 1x2 or 2x4 pixels per cell with half blocks or braille patterns
+ * - Zooming out through a pyramid of downsampled bitmaps
+ * - Scrolling with the terminal's scrolling regions and insert/delete
+ *   character functions, coalescing queued arrow keys
+ * - Browsing files with a cache of decoded bitmaps, background loading and
+ *   a grid of thumbnails
+ * - Writing the bitmaps as text, XBM or PBM without a screen
+ * - Rotating, flipping, inverting and cropping the packed bitmap
+ * - Searching for a pattern bitmap with XOR and popcount
+ * - Reloading the shown file when it changes, watched with inotify
+ * - Counting the set pixels per row and column
+ * - Wiping freed buffers with a policy per class of buffer
  * - Using the ncurses pad structure
  * - Scrolling the bitmap when it does not fit in the display area
  *
  * Compile and run on Linux:
- * > gcc -Wall -Wextra -std=c99 -pedantic -o xbmview xbmview.c -lncurses
- * > ./xbmview [file.xbm]
+ * > gcc -Wall -Wextra -std=c99 -pedantic -o xbmview xbmview.c -lncursesw -pthread -lz
+ * Add -DUSE_ZSTD -lzstd to read .xbm.zst files, -mavx2 for the AVX2
+ * tokenizer and -mpopcnt for the popcnt instruction in the search.
+ * > ./xbmview [-a] [-c] [-g] [-r] [-s] [-t] [-B] [-T] [-b MiB] [-d format] [-j threads]
+ *   [-m mode] [-o dir] [-w policy] [-M MiB] [file.xbm | dir ... | -]
  *
- * If no filename is passed the program shows a test bitmap.
+ * If no filename is passed the program shows a test bitmap. If the filename is
+ * '-' the bitmap is read from stdin. Binary PBM files (.pbm), X10 bitmaps and
+ * compressed XBM files (.xbm.gz, .xbm.zst) are read as well.
+ * If several files or a directory are passed, 'n' and 'p' switch to the next
+ * and previous file and 'g' switches to a grid of thumbnails. 'r', 'u' and
+ * 'R' rotate the bitmap, 'h' and 'v' flip it, 'i' inverts it and 'c' crops
+ * it to the view. '/' searches for a pattern file, '>' and '<' move between
+ * the matches. 's' shows the density of the set pixels. The shown file is
+ * reloaded when it changes.
+ *
+ * Options:
+ * -a  accelerate the scrolling while an arrow key is held down
+ * -c  cache the decoded bitmap in file.xbm.xbmc, or under
+ *     $XDG_CACHE_HOME/xbmview, and map it while the file is unchanged
+ * -d  write the files to stdout instead of showing them, as "text",
+ *     "ansi", "xbm" or "pbm"
+ * -g  start with the grid of thumbnails
+ * -o  convert the files as with -d into the directory, on as many threads
+ *     as set with -j
+ * -r  read the file into a buffer instead of mapping it into memory
+ * -s  show the bitmap while it is read. This is always done for stdin.
+ * -t  print the timings of the loaders, tokenizers, threads and the other
+ *     stages for the file and exit
+ * -B  benchmark the parse, expansion and first render of the files, or of
+ *     a synthetic corpus if no file is passed
+ * -T  run the self checks on random data, print ok or FAILED for each and
+ *     exit with a failure status if one fails
+ * -b  budget of the bitmaps kept while browsing in MiB
+ * -j  number of threads that parse large bitmaps, defaults to the number
+ *     of processors
+ * -m  rendering mode: "cell", "half" or "braille", the last two need a
+ *     UTF-8 locale. The 'm' key switches between the modes.
+ * -w  wipe policy of freed buffers: "none", "zero" or "stream", or
+ *     "class=policy" for the "text", "bitmap" or "object" buffers only
+ * -M  memory budget for the decoded bitmap in MiB, larger bitmaps are kept
+ *     in tiles
  */
 #define _GNU_SOURCE
+#define _XOPEN_SOURCE_EXTENDED
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <locale.h>
+#include <langinfo.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <ncurses.h>
+#include <zlib.h>
+#if defined(USE_ZSTD)
+#include <zstd.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define MIN_WIDTH    1
 #define MIN_HEIGHT   1
-#define MAX_WIDTH    512
-#define MAX_HEIGHT   512
-#define MAX_FSIZE    (1*1024*1024)
+#define MAX_WIDTH    (1024*1024)
+#define MAX_HEIGHT   (1024*1024)
+#define MAX_READSIZE (256*1024*1024) /* limit for files that are read instead of mapped */
+#define MAX_POPULATE (64*1024*1024)  /* larger mappings are faulted in on demand */
+#define READ_CHUNK   (64*1024)   /* read size for files of unknown size, e.g. pipes */
+#define WRITE_CHUNK  (1024*1024) /* buffer of the XBM and PBM writers */
+#define MEM_BUDGET   64          /* default memory budget for decoded bitmaps in MiB */
+#define LIST_BUDGET  256         /* default budget of the bitmaps kept while browsing in MiB */
+#define PREFETCH     2           /* files loaded ahead in both directions while browsing */
+#define THUMB_COLS   16          /* cells of a thumbnail in the grid */
+#define THUMB_ROWS   8
+#define TILE_SIZE    (256*256/8) /* bytes of a tile, the size of 256x256 pixels */
+#define MAX_THREADS  64
+#define PARALLEL_MIN (1024*1024) /* smaller bits arrays are parsed on a single thread */
+#define STREAM_FPS   30          /* refresh rate while a bitmap is streamed in */
+#define PROGRESS_SLICE (4*1024*1024) /* text decoded between progress reports */
+#define FRAME_FPS    60          /* maximum refresh rate while scrolling */
+#define ACCEL_MS     250         /* hold time of an arrow key per speed step */
+#define MAX_ACCEL    8           /* maximum scroll speed factor */
+#define EXPAND_CHUNK 512         /* pixels put into the pad with a single call */
+#define MAX_ZOOM     20          /* zoom levels, 1:1 to 1:2^19 */
+#define TRANSPOSE_BAND 64        /* bytes of a row that are transposed in one pass */
+#if defined(__SSE2__)
+#define TRANSPOSE_ROWS 16        /* rows transposed at once, a SSE2 register of bytes */
+#else
+#define TRANSPOSE_ROWS 8         /* rows transposed at once, a 64 bit word */
+#endif
+#define HELD_ROWS    (TRANSPOSE_ROWS > 4 ? TRANSPOSE_ROWS : 4) /* row pointers in use at once, see xbm_row() */
+#define SEARCH_BITS  56          /* pattern pixels compared with one word */
+#define MAX_MATCHES  100000      /* matches kept by a search */
+#define CACHE_MAGIC  "XBMC"
+#define CACHE_VERSION 2
+#define XBM_HASH_INIT 14695981039346656037ULL /* FNV offset basis, start of the hashes */
+#define TIMING_RUNS  20          /* repetitions per loader in the timing mode */
+#define BENCH_BYTES  (256*1024*1024) /* text parsed per file by the benchmark */
+#define BENCH_MIN_RUNS 5         /* repetitions per phase of the benchmark */
+#define BENCH_MAX_RUNS 1000
+#define CHECK_RUNS   200         /* random cases of each self check */
+#define WIPE_STREAM_MIN (256*1024) /* smaller buffers are wiped with explicit_bzero() */
+
+#if defined(__AVX2__)
+#define HEX_BLOCK     32         /* bytes classified at once by the tokenizer */
+#define HEX_SIMD_NAME "avx2"
+#elif defined(__SSE2__)
+#define HEX_BLOCK     16
+#define HEX_SIMD_NAME "sse2"
+#else
+#define HEX_SIMD_NAME ""
+#endif
 
-/* Representation of XBM file in memory. */
+/* Representation of XBM file in memory. Bitmaps larger than the memory budget
+   have no data array, their rows are kept in tiles instead. Use xbm_row() to
+   access the rows of either kind of bitmap. If the bitmap was loaded from
+   the cache, data points into the mapping of the cache file. */
 struct xbm_dat
 {
 	int width;
 	int height;
 	unsigned char *data;
-	int len;
+	size_t len;
+	size_t stride;             /* bytes per row */
+	struct xbm_tiles *tiles;
+	void *map;                 /* mapping of the cache file or NULL */
+	size_t map_size;
+	struct xbm_dat *half;      /* next zoom level, built on demand */
+	struct xbm_stats *stats;   /* statistics of the set pixels, counted on demand */
+};
+
+/* Header of the cache file (.xbmc). The packed rows of the bitmap follow the
+   header. The cache is valid as long as the modification time and size of
+   the XBM file match. The checksum covers the fields before it, which
+   include the hash of the rows, a truncated file is detected by its size. */
+struct xbmc_header
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint64_t stride;
+	int64_t mtime_sec;         /* modification time of the XBM file */
+	int64_t mtime_nsec;
+	uint64_t size;             /* size of the XBM file */
+	uint64_t rows_hash;        /* hash of the packed rows, see hash_xbm_row() */
+	uint64_t checksum;
+};
+
+/* Source text of a XBM file. The text is either mapped read-only into memory
+   or, for pipes and other files that can't be mapped, read into a buffer. */
+struct xbm_src
+{
+	char *buf;
+	size_t size;   /* number of valid bytes in buf */
+	size_t cap;    /* allocated size of buf, 0 if the file is mapped */
+	bool mapped;
+	struct xbm_progress *progress;   /* reports the parse if not NULL */
+};
+
+/* Progress of a load on another thread. The loader reports how much of the
+   total it has decoded and gives up once cancel is set. The lock protects
+   the fields. */
+struct xbm_progress
+{
+	pthread_mutex_t lock;
+	size_t done;
+	size_t total;
+	bool cancel;
+};
+
+/* Tile store of a large bitmap. A tile holds a band of consecutive rows of
+   about TILE_SIZE bytes. The text of the XBM file stays mapped, and the offset
+   of the first literal of each tile is recorded when the file is loaded. Tiles
+   are decoded from the text when a row is accessed and the least recently
+   used tiles are evicted when the decoded tiles exceed the budget. */
+struct xbm_tiles
+{
+	struct xbm_src src;
+	size_t *offset;            /* text offset of the first literal of each tile */
+	unsigned char **data;      /* decoded rows of each tile, NULL if evicted */
+	unsigned long *used;       /* time of last access of each tile */
+	int rows;                  /* rows per tile */
+	int count;                 /* number of tiles */
+	bool packed;               /* the source holds the packed rows of a PBM file */
+	int words;                 /* 16 bit literals per row of a X10 bitmap, or 0 */
+	size_t budget;             /* maximum bytes of decoded tiles */
+	size_t resident;           /* bytes of decoded tiles */
+	unsigned long clock;
+};
+
+/* State of the hex literal tokenizer. It decodes the "0xNN" literals of the
+   bits array in buf, starting at pos, into out until the closing brace. If
+   out is NULL the literals are only validated and counted. A partial run
+   stops at the first literal beyond len instead of expecting the brace. An
+   open-ended run decodes a chunk of the array and ends at size instead. The
+   "0xNNNN" literals of a X10 bitmap, if words is set, are decoded into byte
+   pairs, the low byte first. Otherwise a literal is a byte. The last
+   literal of a row has a padding byte in its high byte if the row has an
+   odd number of bytes, which is dropped, see seek_hex_words(). */
+struct hex_tok
+{
+	const char *buf;
+	size_t size;          /* size of the text in buf */
+	size_t pos;           /* scan position, the closing brace on success */
+	unsigned char *out;
+	size_t len;           /* number of literals expected by the bitmap */
+	size_t count;         /* number of literals decoded so far */
+	bool partial;
+	bool open_end;
+	int words;            /* 16 bit literals per row of a X10 bitmap, 0 for 8 bit literals */
+	size_t stride;        /* bytes per row of out, with words */
+	int col;              /* literal of the row that is decoded next, with words */
+	size_t at;            /* offset in out of the next literal, with words */
+};
+
+/* Kinds of files by the suffix of their name. The compressed kinds hold the
+   text of a XBM file. */
+enum xbm_kind
+{
+	KIND_XBM,
+	KIND_PBM,
+	KIND_GZIP,
+	KIND_ZSTD,
+	KIND_COUNT
+};
+
+/* Incremental loader that reads the text in blocks and decodes the literals of
+   each block as it arrives, so the rows of the bitmap become available one
+   after another. A literal at the end of a block may be incomplete, so the
+   text after the last separator is carried over to the next block. The text
+   of a compressed file is decompressed block by block into buf, so only a
+   block of the compressed and of the decompressed text is held at a time. */
+struct xbm_stream
+{
+	int fd;
+	enum xbm_kind kind;
+	z_stream *gzip;       /* inflater of KIND_GZIP */
+#if defined(USE_ZSTD)
+	ZSTD_DStream *zstd;   /* decompressor of KIND_ZSTD */
+#endif
+	unsigned char *zbuf;  /* compressed text that is not decompressed yet */
+	size_t zsize;
+	size_t zpos;
+	bool zend;            /* the compressed data ended with the last block */
+	char *buf;            /* text that is not decoded yet */
+	size_t size;          /* number of bytes in buf */
+	size_t cap;           /* allocated size of buf */
+	size_t pos;           /* where decoding continues in buf */
+	struct xbm_dat *xbm;  /* NULL until the header has been read */
+	int words;            /* 16 bit literals per row of a X10 bitmap, or 0 */
+	size_t literals;      /* number of literals decoded so far */
+	size_t count;         /* number of bytes decoded so far */
+	bool done;            /* the closing brace has been decoded */
+	bool failed;
+	bool spill;           /* the bitmap is beyond the budget, see spill_xbm_stream() */
+};
+
+/* Chunk of the bits array that is parsed by one thread. */
+struct parse_chunk
+{
+	struct hex_tok tok;
+	size_t begin;         /* text offset where the chunk starts */
+	struct xbm_progress *progress;   /* reports the text decoded if not NULL */
+	pthread_t thread;
+	bool ok;
+};
+
+/* Result of decoding a single literal. */
+enum tok_result
+{
+	TOK_NEXT,
+	TOK_FULL,             /* stop of a partial run */
+	TOK_ERROR
+};
+
+/* Ways to get the file content into memory. */
+enum xbm_loader
+{
+	LOADER_MMAP,
+	LOADER_READ
+};
+
+/* Bitmap of a file in the browsing list. */
+struct xbm_slot
+{
+	struct xbm_dat *xbm;       /* NULL if not loaded */
+	size_t size;               /* bytes counted against the budget */
+	unsigned long used;        /* clock value of the last use */
+	bool loading;
+	bool failed;
+};
+
+/* List of files to browse. The bitmaps are kept in a LRU cache under a byte
+   budget. A thread loads the file switched to and the neighbours of the
+   shown file ahead, the lock protects the slots. The bitmap on the screen
+   stays until the file switched to is loaded and swapped in, neither is
+   unloaded. */
+struct xbm_list
+{
+	char **names;
+	struct xbm_slot *slots;
+	int count;
+	int cap;
+	int current;               /* index of the file switched to */
+	int shown;                 /* index of the bitmap on the screen, or -1 */
+	int busy;                  /* index of the file the thread loads, or -1 */
+	struct xbm_progress progress;   /* of the load of the thread */
+	int pipe[2];               /* the thread writes a byte when the current file is loaded */
+	enum xbm_loader loader;
+	size_t budget;
+	size_t resident;
+	unsigned long clock;
+	bool quit;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;       /* signals the prefetch thread */
+	pthread_t thread;
+	bool started;
+};
+
+/* State of a thumbnail in the grid. */
+enum thumb_state
+{
+	THUMB_NONE,
+	THUMB_BUSY,
+	THUMB_DONE,
+	THUMB_FAILED
+};
+
+/* Grid of thumbnails of the files in a list. A pool of threads decodes the
+   files and downsamples them to fit the thumbnail size of the braille mode,
+   the other modes show a smaller zoom level of it. Only the files from first
+   to before last are decoded, the grid moves this range along when it is
+   scrolled. */
+struct xbm_grid
+{
+	struct xbm_list *list;
+	struct xbm_dat **thumbs;
+	unsigned char *state;
+	int first;
+	int last;
+	int done;                  /* number of finished thumbnails */
+	int threads;
+	bool quit;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t thread[MAX_THREADS];
+};
+
+/* Files of a list that are converted by a pool of threads. */
+struct xbm_batch
+{
+	struct xbm_list *list;
+	const char *dir;
+	int next;                  /* index of the next file to convert */
+	int written;
+	int failed;
+	size_t bytes;
+	pthread_mutex_t lock;
+};
+
+/* Formats of the output without a screen. */
+enum dump_format
+{
+	DUMP_NONE,
+	DUMP_TEXT,
+	DUMP_ANSI,
+	DUMP_XBM,
+	DUMP_PBM
+};
+
+/* Kinds of synthetic bitmaps of the benchmark. */
+enum bench_kind
+{
+	BENCH_RANDOM,   /* random pixels */
+	BENCH_ZERO,     /* no pixel set */
+	BENCH_SPACES,   /* random pixels, literals separated by runs of whitespace */
+	BENCH_COUNT
+};
+
+/* Transforms of a bitmap. */
+enum xbm_xform
+{
+	XFORM_ROTATE_CW,
+	XFORM_ROTATE_180,
+	XFORM_ROTATE_CCW,
+	XFORM_FLIP_H,
+	XFORM_FLIP_V,
+	XFORM_INVERT,
+	XFORM_CROP,
+	XFORM_COUNT
+};
+
+/* Position of a pattern found in a bitmap and the number of its pixels that
+   differ. */
+struct xbm_match
+{
+	int x;
+	int y;
+	int diff;
+};
+
+/* Statistics of the set pixels of a bitmap. The bounding box is empty, with
+   right < left and bottom < top, if no pixel is set. */
+struct xbm_stats
+{
+	size_t count;              /* set pixels */
+	int *rows;                 /* set pixels of each row */
+	int *cols;                 /* set pixels of each column */
+	int left;                  /* bounding box of the set pixels */
+	int top;
+	int right;
+	int bottom;
+};
+
+/* Band of positions that one thread searches for the pattern. The rows that
+   the pattern covers are copied into a ring of rows that are padded by a
+   word, so a word can be read at any pixel of a row. */
+struct search_band
+{
+	struct xbm_dat *xbm;
+	const uint64_t *words;     /* pattern rows in chunks of SEARCH_BITS pixels */
+	const uint64_t *masks;     /* pixels of the pattern in each chunk */
+	int width;                 /* size of the pattern */
+	int height;
+	int chunks;                /* chunks per pattern row */
+	int threshold;             /* pixels that may differ */
+	int first;                 /* first row of positions */
+	int last;                  /* row after the last row of positions */
+	pthread_mutex_t *lock;     /* serializes xbm_row() for bitmaps in tiles */
+	struct xbm_match *matches;
+	size_t count;
+	size_t cap;
+	pthread_t thread;
+	bool ok;
+};
+
+/* Watch of a shown file. When the file is written or replaced, a thread
+   parses it again and reports through a pipe that the new bitmap is ready. */
+struct xbm_watch
+{
+	const char *filename;
+	char name[NAME_MAX + 1];   /* name of the file in the watched directory */
+	enum xbm_loader loader;
+	int fd;                    /* inotify descriptor of the directory */
+	int pipe[2];               /* the thread writes a byte when it is done */
+	pthread_t thread;
+	bool busy;                 /* a parse is running */
+	bool again;                /* the file changed again during the parse */
+	struct xbm_dat *fresh;     /* result of the running parse */
+	struct xbm_dat *xbm;       /* result of the last parse, NULL on errors */
+};
+
+/* Ways to draw the pixels into the pad. */
+enum pad_mode
+{
+	MODE_CELL,      /* one pixel per cell */
+	MODE_HALF,      /* 1x2 pixels per cell, half blocks */
+	MODE_BRAILLE,   /* 2x4 pixels per cell, braille patterns */
+	MODE_COUNT
+};
+
+/* Classes of buffers that free_mem() wipes with their own policy. A buffer
+   is in the class of what it holds: the bytes of a file, so the chunks of
+   both writers are text as well, the packed rows of pixels, or the state of
+   the program. The counts of the statistics are state like the structures,
+   they are arrays of ints of the size of a row or column, not pixels. */
+enum wipe_class
+{
+	WIPE_TEXT,      /* bytes of a file that is read or written */
+	WIPE_BITMAP,    /* packed rows of a bitmap, its tiles and zoom levels */
+	WIPE_OBJECT,    /* structures and the counts of the statistics */
+	WIPE_CLASSES
+};
+
+/* How free_mem() clears a buffer before freeing it. */
+enum wipe_policy
+{
+	WIPE_NONE,      /* freed as is */
+	WIPE_ZERO,      /* explicit_bzero(), which the compiler can't drop */
+	WIPE_STREAM,    /* non-temporal stores that bypass the cache, for large buffers */
+	WIPE_POLICIES
 };
 
 static bool init_ui();
+static bool open_xbm_stream(const char *, struct xbm_stream *);
+static bool step_xbm_stream(struct xbm_stream *, int);
+static ssize_t read_xbm_stream(struct xbm_stream *, char *, size_t);
+static void close_xbm_stream(struct xbm_stream *);
+static struct xbm_dat *load_xbm_stream(const char *, struct xbm_progress *);
+static struct xbm_dat *spill_xbm_stream(struct xbm_stream *, struct xbm_progress *);
+static bool xbm_file_kind(const char *, enum xbm_kind *, size_t *);
 static void deinit_ui();
-static struct xbm_dat *load_xbm_file(const char *);
+static struct xbm_dat *load_xbm_file(const char *, enum xbm_loader);
+static struct xbm_dat *decode_xbm_file(const char *, enum xbm_loader, struct xbm_progress *);
+static struct xbm_dat *load_xbm_cached(const char *, enum xbm_loader, struct xbm_progress *);
+static bool set_progress(struct xbm_progress *, size_t, size_t);
+static bool add_progress(struct xbm_progress *, size_t);
+static struct xbm_dat *load_xbm_cache(const char *, const struct stat *);
+static bool save_xbm_cache(const char *, const struct stat *, struct xbm_dat *);
+static bool xbm_cache_path(const char *, bool, char *, size_t);
+static uint64_t xbm_cache_checksum(const struct xbmc_header *);
+static uint64_t hash_xbm_row(uint64_t, const unsigned char *, size_t);
+static bool open_xbm_source(const char *, enum xbm_loader, struct xbm_src *);
+static bool map_xbm_source(int, size_t, struct xbm_src *);
+static bool read_xbm_source(int, struct xbm_src *);
+static void close_xbm_source(struct xbm_src *);
+static struct xbm_dat *parse_xbm_source(struct xbm_src *);
+static bool parse_xbm_header(const struct xbm_src *, struct xbm_dat *, size_t *, int *);
+static bool parse_pbm_header(const struct xbm_src *, struct xbm_dat *, size_t *);
+static bool scan_pbm_number(const struct xbm_src *, size_t *, int *);
+static void reverse_bits(const unsigned char *, unsigned char *, size_t);
+static bool scan_field(const char *, const char *, const char *, void *);
+static bool tokenize_hex(struct hex_tok *);
+static bool tokenize_hex_slices(struct hex_tok *, struct xbm_progress *);
+static bool tokenize_hex_scalar(struct hex_tok *);
+static enum tok_result tokenize_hex_literal(struct hex_tok *, size_t);
+static bool tokenize_hex_parallel(struct hex_tok *, int, struct xbm_progress *);
+static void seek_hex_words(struct hex_tok *, size_t);
+static bool run_parse_chunks(struct parse_chunk *, int);
+static void *parse_chunk_thread(void *);
+static bool init_xbm_tiles(struct xbm_dat *, struct xbm_src *, size_t, bool, int);
+static void free_xbm_tiles(struct xbm_dat *);
+static size_t xbm_tile_size(const struct xbm_dat *, int);
+static bool load_xbm_tile(struct xbm_dat *, int);
+static const unsigned char *xbm_row(struct xbm_dat *, int);
+static struct xbm_dat *zoom_xbm(struct xbm_dat *, int);
+static struct xbm_dat *halve_xbm(struct xbm_dat *);
+static unsigned int pair_counts(unsigned int);
+static bool transform_xbm(struct xbm_dat *, enum xbm_xform, int, int, int, int);
+static int xform_key(int);
+static void xform_point(enum xbm_xform, int, int, int, int, int *, int *);
+static struct xbm_dat *new_xbm(int, int);
+static void replace_xbm_data(struct xbm_dat *, struct xbm_dat *);
+static void flip_row(const unsigned char *, unsigned char *, int);
+static void crop_row(const unsigned char *, unsigned char *, int, int);
+static void invert_row(const unsigned char *, unsigned char *, int);
+static bool transpose_xbm(struct xbm_dat *, struct xbm_dat *, bool);
+static void transpose_block(const unsigned char **, size_t, size_t, struct xbm_dat *, int, bool);
+#if defined(__SSE2__)
+static void put_transposed(__m128i, size_t, struct xbm_dat *, int, bool);
+#endif
+static size_t search_xbm(struct xbm_dat *, struct xbm_dat *, int, int, struct xbm_match **);
+static void *search_band_thread(void *);
+static bool search_row(struct search_band *, const unsigned char **, int);
+static bool search_row_exact(struct search_band *, const unsigned char **, int);
+static bool add_match(struct search_band *, int, int, int);
+static uint64_t row_word(const unsigned char *, int);
+static struct xbm_stats *get_xbm_stats(struct xbm_dat *);
+static void add_column_sums(uint64_t *, size_t, int *, int);
+static void bound_xbm_stats(struct xbm_stats *, int, int);
+static bool xform_xbm_stats(struct xbm_stats *, enum xbm_xform, int, int);
+static void reverse_counts(int *, int);
+static void free_xbm_stats(struct xbm_stats **, int, int);
+static bool draw_xbm_stats(struct xbm_dat *, int, int, int, int, int, int, int);
+static bool time_loaders(const char *);
+static bool time_tokenizers(const char *);
+static bool time_threads(const char *);
+#if defined(__AVX2__) || defined(__SSE2__)
+static unsigned int hex_block_mask(const char *);
+#endif
+static double elapsed_ms(const struct timespec *);
 static struct xbm_dat *load_test_bitmap(struct xbm_dat *);
 static void unload_xbm_file(struct xbm_dat **);
-static bool render_xbm_file(const struct xbm_dat *);
-static void set_pad_data(WINDOW *, const unsigned char *, int , int );
-static void free_mem(char **, size_t);
+static void free_xbm_data(struct xbm_dat *);
+static int render_xbm_file(struct xbm_dat *, struct xbm_stream *, struct xbm_watch *, struct xbm_list *, const char *);
+static bool open_xbm_watch(const char *, enum xbm_loader, struct xbm_watch *);
+static void close_xbm_watch(struct xbm_watch *);
+static bool wait_xbm_watch(struct xbm_watch *);
+static bool key_queued();
+static void *watch_thread(void *);
+static int diff_xbm_rows(struct xbm_dat *, struct xbm_dat *, unsigned char *);
+static bool open_xbm_list(char **, int, enum xbm_loader, bool, struct xbm_list *);
+static bool add_xbm_name(struct xbm_list *, const char *, const char *);
+static int compare_names(const void *, const void *);
+static void close_xbm_list(struct xbm_list *);
+static struct xbm_dat *get_xbm_list_file(struct xbm_list *, int, bool *);
+static bool wait_xbm_list(struct xbm_list *, int);
+static void draw_xbm_progress(struct xbm_list *);
+static struct xbm_dat *await_xbm_list_file(struct xbm_list *, int);
+static void store_xbm_list_file(struct xbm_list *, int, struct xbm_dat *);
+static void resize_xbm_list_file(struct xbm_list *);
+static void evict_xbm_list_files(struct xbm_list *);
+static void *prefetch_thread(void *);
+static void browse_xbm_files(struct xbm_list *, bool);
+static bool open_xbm_grid(struct xbm_list *, struct xbm_grid *);
+static void close_xbm_grid(struct xbm_grid *);
+static void *thumb_thread(void *);
+static struct xbm_dat *thumb_xbm(struct xbm_dat *, int, int);
+static int show_xbm_grid(struct xbm_grid *, int *);
+static bool dump_xbm_files(struct xbm_list *);
+static bool batch_xbm_files(struct xbm_list *, const char *);
+static void *batch_thread(void *);
+static bool dump_xbm_file(struct xbm_dat *, const char *, FILE *, size_t *);
+static bool write_xbm_file(struct xbm_dat *, const char *, FILE *, size_t *);
+static bool write_pbm_file(struct xbm_dat *, FILE *, size_t *);
+static void xbm_identifier(const char *, char *, size_t);
+static void draw_xbm_grid(WINDOW *, struct xbm_grid *, int, int, int);
+static void set_pad_data(WINDOW *, struct xbm_dat *, int, int, int, int);
+static void set_pad_view(WINDOW *, struct xbm_dat *, int, int);
+static void put_pad_row(WINDOW *, int, int, const unsigned char *, int, int);
+static void put_pad_glyphs(WINDOW *, int, int, const unsigned char **, int, int, int);
+static void set_pad_cells(WINDOW *, struct xbm_dat *, int, int, int, int, int, int);
+static bool scroll_pad(WINDOW *, struct xbm_dat *, int, int, int, int);
+static bool can_shift_screen();
+static bool shift_screen(int, int, int, int);
+static WINDOW *new_view_pad(struct xbm_dat *, int, int);
+static int move_offset(int, int, int, int, int);
+static void init_pad_table();
+static void init_glyph_bits();
+static void row_glyphs(const unsigned char **, int, int, int, unsigned char *);
+static void set_pad_pixels(WINDOW *, struct xbm_dat *);
+static bool time_expansion(const char *);
+static bool time_zoom(const char *);
+static bool time_transforms(const char *);
+static bool time_writers(const char *);
+static bool time_search(const char *);
+static bool time_stats(const char *);
+static bool time_scroll(const char *);
+static bool run_benchmark(char **, int);
+static bool write_bench_file(const char *, enum bench_kind, int, int, size_t *);
+static uint64_t next_random(uint64_t *);
+static bool bench_xbm_file(const char *, const char *);
+static void print_bench_times(const char *, const char *, double *, int, double);
+static int compare_times(const void *, const void *);
+static void free_mem(char **, size_t, enum wipe_class);
+static void stream_zero(unsigned char *, size_t);
+static bool set_wipe_policy(const char *);
+static bool time_wipe(const char *);
+static bool run_checks();
+static bool print_check(const char *, int, int);
+static bool check_tokenizer();
+static bool scan_hex_text(const char *, size_t, unsigned char *, size_t);
+static bool check_cache(const char *);
+static bool check_transforms();
+static bool check_writers(const char *);
+static bool check_search();
+static bool check_stats();
+static bool same_xbm_stats(struct xbm_dat *, struct xbm_stats *);
+static bool check_x10(const char *);
+static bool check_zoom();
+static bool check_streams(const char *);
+static bool check_diff();
+static bool check_glyphs();
+static struct xbm_dat *xform_pixels(struct xbm_dat *, enum xbm_xform, int, int, int, int);
+static void random_xbm(struct xbm_dat *, uint64_t *);
+static bool same_xbm(struct xbm_dat *, struct xbm_dat *);
+static bool write_check_file(const char *, struct xbm_dat *);
+
+/* Memory budget for decoded bitmaps in bytes, set with -M. */
+static size_t mem_budget = (size_t) MEM_BUDGET * 1024 * 1024;
+
+/* Budget of the bitmaps kept while browsing in bytes, set with -b. */
+static size_t list_budget = (size_t) LIST_BUDGET * 1024 * 1024;
+
+/* Use the cache file, set with -c. */
+static bool use_cache = false;
+
+/* Format of the output without a screen, set with -d, and the directory
+   that the files are converted into, set with -o. */
+static enum dump_format dump_format = DUMP_NONE;
+static const char *dump_dir = NULL;
+
+/* Start browsing with the grid of thumbnails, set with -g. */
+static bool grid_view = false;
+
+/* Accelerate held arrow keys, set with -a. */
+static bool accelerate = false;
+
+/* Show the statistics of the set pixels, switched with the 's' key. */
+static bool show_stats = false;
+
+/* Wipe policy of each buffer class, set with -w. The text is a copy of the
+   file and the largest buffer, so it is not wiped. Bitmaps are streamed out
+   without evicting the cache, the small structures are just zeroed. */
+static enum wipe_policy wipe_policy[WIPE_CLASSES] = { WIPE_NONE, WIPE_STREAM, WIPE_ZERO };
+static const char *wipe_names[WIPE_POLICIES] = { "none", "zero", "stream" };
+static const char *wipe_classes[WIPE_CLASSES] = { "text", "bitmap", "object" };
+
+/* File descriptor the keys are read from, set by init_ui(). */
+static int key_fd = STDIN_FILENO;
+
+/* Number of threads that parse large bitmaps, set with -j. */
+static int parse_threads = 1;
+
+/* Rendering mode, set with -m and switched with the 'm' key. The modes other
+   than MODE_CELL are only available in a UTF-8 locale. */
+static enum pad_mode pad_mode = MODE_CELL;
+static bool utf8_locale = false;
+static const char *mode_names[MODE_COUNT] = { "cell", "half", "braille" };
+static const int mode_width[MODE_COUNT] = { 1, 1, 2 };    /* pixels per cell */
+static const int mode_height[MODE_COUNT] = { 1, 2, 4 };
+
+/* The 8 pad characters of each byte value, least significant bit first. Set up
+   by init_pad_table() once curses is initialized, as ACS_CKBOARD is not
+   known before. */
+static chtype pad_table[256][8];
+
+/* Lookup tables of the half block and braille modes, set up by
+   init_pad_table(). half_bits spreads the 8 bits of a byte to the even bits
+   of a 16 bit word, so that a pixel of the upper and the lower row form a 2
+   bit index into half_glyphs. braille_dots holds for each of the 4 rows of a
+   braille cell and each byte value the dots of the 4 cells that the byte
+   covers, one byte per cell. The dots of all rows ORed together select the
+   pattern in braille_glyphs. */
+static uint16_t half_bits[256];
+static uint32_t braille_dots[4][256];
+static cchar_t half_glyphs[4];
+static cchar_t braille_glyphs[256];
+
+/* Suffixes of the kinds of files. Without zstd the .xbm.zst files are not
+   recognized. */
+static const char *kind_suffixes[KIND_COUNT] = {
+	".xbm",
+	".pbm",
+	".xbm.gz",
+#if defined(USE_ZSTD)
+	".xbm.zst"
+#else
+	NULL
+#endif
+};
+
+/* Keys and names of the transforms. */
+static const int xform_keys[XFORM_COUNT] = { 'r', 'u', 'R', 'h', 'v', 'i', 'c' };
+static const char *xform_names[XFORM_COUNT] = {
+	"rotate 90", "rotate 180", "rotate 270", "flip h", "flip v", "invert", "crop"
+};
+
+/* Names of the kinds of synthetic bitmaps and their sizes in the benchmark.
+   The odd widths leave padding bits in the last byte of each row. */
+static const char *bench_names[BENCH_COUNT] = { "random", "zero", "spaces" };
+static const int bench_sizes[][2] = {
+	{ 8, 8 }, { 13, 11 }, { 257, 255 }, { 1001, 777 }, { 4099, 4093 }, { 20001, 4001 }
+};
+
+/* Each byte value with its bits in reverse order. */
+#define R2(n) n, n + 2 * 64, n + 1 * 64, n + 3 * 64
+#define R4(n) R2(n), R2(n + 2 * 16), R2(n + 1 * 16), R2(n + 3 * 16)
+#define R6(n) R4(n), R4(n + 2 * 4), R4(n + 1 * 4), R4(n + 3 * 4)
+static const unsigned char bit_reverse[256] = { R6(0), R6(2), R6(1), R6(3) };
+#undef R6
+#undef R4
+#undef R2
+
+/* Each byte value with its bits spread to the lowest bits of the 8 bytes of a
+   word, bit 0 to byte 0. */
+#define S2(n) n, n + 0x1ull, n + 0x100ull, n + 0x101ull
+#define S4(n) S2(n), S2(n + 0x10000ull), S2(n + 0x1000000ull), S2(n + 0x1010000ull)
+#define S6(n) S4(n), S4(n + 0x100000000ull), S4(n + 0x10000000000ull), S4(n + 0x10100000000ull)
+static const uint64_t bit_spread[256] = {
+	S6(0), S6(0x1000000000000ull), S6(0x100000000000000ull), S6(0x101000000000000ull)
+};
+#undef S6
+#undef S4
+#undef S2
+
+/* Hex digit lookup for the tokenizer. Bit 4 is set for valid digits, the lower
+   nibble holds the value of the digit. */
+static const unsigned char hex_digits[256] = {
+	['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+	['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+	['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c, ['d'] = 0x1d, ['e'] = 0x1e, ['f'] = 0x1f,
+	['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c, ['D'] = 0x1d, ['E'] = 0x1e, ['F'] = 0x1f
+};
 
 /* Program to load and display a XBM bitmap file. */
 int main(int argc, char **argv)
 {
-	struct xbm_dat xbm_test;
-	struct xbm_dat *xbm_user = NULL;
-	struct xbm_dat *xbm_ptr = NULL;
+	struct xbm_dat xbm_test;
+	struct xbm_dat *xbm_user = NULL;
+	struct xbm_dat *xbm_ptr = NULL;
+	struct xbm_stream stream;
+	struct xbm_list list;
+	struct xbm_watch watch;
+	enum xbm_loader loader = LOADER_MMAP;
+	bool timing = false;
+	bool benchmark = false;
+	bool checking = false;
+	bool streaming = false;
+	struct stat sb;
+	int opt;
+
+	parse_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	parse_threads = parse_threads < 1 ? 1 : parse_threads > MAX_THREADS ? MAX_THREADS : parse_threads;
+
+	memset(&stream, 0, sizeof(stream));
+	memset(&list, 0, sizeof(list));
+	setlocale(LC_ALL, "");
+	utf8_locale = !strcmp(nl_langinfo(CODESET), "UTF-8");
+
+	while ((opt = getopt(argc, argv, "acgrstBTb:d:j:m:o:w:M:")) != -1)
+	{
+		if (opt == 'a')
+			accelerate = true;
+		else if (opt == 'B')
+			benchmark = true;
+		else if (opt == 'b' && atoi(optarg) > 0)
+			list_budget = (size_t) atoi(optarg) * 1024 * 1024;
+		else if (opt == 'c')
+			use_cache = true;
+		else if (opt == 'd' && !strcmp(optarg, "text"))
+			dump_format = DUMP_TEXT;
+		else if (opt == 'd' && !strcmp(optarg, "ansi"))
+			dump_format = DUMP_ANSI;
+		else if (opt == 'd' && !strcmp(optarg, "xbm"))
+			dump_format = DUMP_XBM;
+		else if (opt == 'd' && !strcmp(optarg, "pbm"))
+			dump_format = DUMP_PBM;
+		else if (opt == 'g')
+			grid_view = true;
+		else if (opt == 'r')
+			loader = LOADER_READ;
+		else if (opt == 's')
+			streaming = true;
+		else if (opt == 't')
+			timing = true;
+		else if (opt == 'T')
+			checking = true;
+		else if (opt == 'j' && atoi(optarg) > 0 && atoi(optarg) <= MAX_THREADS)
+			parse_threads = atoi(optarg);
+		else if (opt == 'm' && !strcmp(optarg, mode_names[MODE_CELL]))
+			pad_mode = MODE_CELL;
+		else if (opt == 'm' && !strcmp(optarg, mode_names[MODE_HALF]))
+			pad_mode = MODE_HALF;
+		else if (opt == 'm' && !strcmp(optarg, mode_names[MODE_BRAILLE]))
+			pad_mode = MODE_BRAILLE;
+		else if (opt == 'o')
+			dump_dir = optarg;
+		else if (opt == 'w')
+		{
+			if (!set_wipe_policy(optarg))
+				goto usage;
+		}
+		else if (opt == 'M' && atoi(optarg) > 0)
+			mem_budget = (size_t) atoi(optarg) * 1024 * 1024;
+		else
+			goto usage;
+	}
+
+	/* The half block and braille modes are written in UTF-8 without a
+	   screen, the screen needs a UTF-8 locale for them. */
+	if (dump_dir != NULL && dump_format == DUMP_NONE)
+		dump_format = DUMP_TEXT;
+	if (pad_mode != MODE_CELL && !utf8_locale && dump_format == DUMP_NONE)
+		goto usage;
+
+	if (dump_format != DUMP_NONE)
+	{
+		bool ok;
+
+		if (optind == argc)
+			goto usage;
+		if (!open_xbm_list(argv + optind, argc - optind, loader, false, &list))
+			exit(EXIT_FAILURE);
+		init_glyph_bits();
+		ok = dump_dir != NULL ? batch_xbm_files(&list, dump_dir) : dump_xbm_files(&list);
+		close_xbm_list(&list);
+		exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	if (checking)
+		exit(run_checks() ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	if (benchmark)
+		exit(run_benchmark(argv + optind, argc - optind) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	if (timing)
+	{
+		if (optind + 1 != argc)
+			goto usage;
+		if (!time_loaders(argv[optind]))
+			exit(EXIT_FAILURE);
+
+		/* Pipes can only be read once. */
+		if (stat(argv[optind], &sb) == 0 && S_ISREG(sb.st_mode))
+			exit(   time_tokenizers(argv[optind])
+			     && time_threads(argv[optind])
+			     && time_expansion(argv[optind])
+			     && time_zoom(argv[optind])
+			     && time_transforms(argv[optind])
+			     && time_writers(argv[optind])
+			     && time_search(argv[optind])
+			     && time_stats(argv[optind])
+			     && time_wipe(argv[optind])
+			     && time_scroll(argv[optind]) ? EXIT_SUCCESS : EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (optind == argc)
+	{
+		if ((xbm_ptr = load_test_bitmap(&xbm_test)) == NULL)
+			exit(EXIT_FAILURE);
+	}
+	else if (optind + 1 == argc && (streaming || !strcmp(argv[optind], "-")))
+	{
+		/* The header is read before the screen is set up, the rows are
+		   read while the bitmap is shown. */
+		if (!open_xbm_stream(argv[optind], &stream))
+			exit(EXIT_FAILURE);
+
+		/* A bitmap beyond the memory budget is decoded into a file instead. */
+		xbm_user = stream.spill ? spill_xbm_stream(&stream, NULL) : stream.xbm;
+		if ((xbm_ptr = xbm_user) == NULL)
+			exit(EXIT_FAILURE);
+	}
+	else if (optind + 1 == argc && !grid_view && (stat(argv[optind], &sb) == -1 || !S_ISDIR(sb.st_mode)))
+	{
+		/* The file is loaded by the prefetch thread of a list of one once
+		   the screen is set up, so the progress is shown and 'q' cancels. */
+		if (access(argv[optind], R_OK) == -1)
+		{
+			fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (!open_xbm_list(argv + optind, 1, loader, true, &list))
+			exit(EXIT_FAILURE);
+	}
+	else
+	{
+		/* Several files or directories are browsed. */
+		if (!open_xbm_list(argv + optind, argc - optind, loader, true, &list))
+			exit(EXIT_FAILURE);
+
+		if (init_ui() == true)
+		{
+			mvaddstr(0, 0, "For large bitmaps, use the arrow keys to scroll in the direction you wish.\nKeys: 'n'/'p' next/previous file, 'g' grid, '-'/'+' zoom, 'm' mode, 's' stats, 'q' quit.");
+			refresh();
+			browse_xbm_files(&list, grid_view);
+		}
+		deinit_ui();
+		close_xbm_list(&list);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (init_ui() == true)
+	{
+		bool watching = false;
+
+		mvaddstr(0, 0, "Arrows scroll, '-'/'+' zoom, 'm' mode, '/' search, '<'/'>' previous/next match.\n'r'/'u'/'R' rotate, 'h'/'v' flip, 'i' inverts, 'c' crops to view, 's' stats, 'q' quits.");
+		refresh();
+		if (list.count == 1)
+			xbm_ptr = await_xbm_list_file(&list, 0);
+
+		/* A file is reloaded when it changes, not being able to watch it is not an error. */
+		watching = stream.xbm == NULL && xbm_ptr != NULL && xbm_ptr != &xbm_test && open_xbm_watch(argv[optind], loader, &watch);
+		if (xbm_ptr != NULL)
+			render_xbm_file(xbm_ptr, stream.xbm != NULL ? &stream : NULL, watching ? &watch : NULL, NULL, NULL);
+		if (watching)
+			close_xbm_watch(&watch);
+	}
+
+	deinit_ui();
+	if (stream.failed)
+		fprintf(stderr, "%s: invalid XBM data\n", argv[optind]);
+	close_xbm_stream(&stream);
+	if (list.count == 1 && list.slots[0].failed)
+	{
+		fprintf(stderr, "%s: can't load the XBM file\n", argv[optind]);
+		stream.failed = true;
+	}
+	if (list.count > 0)
+		close_xbm_list(&list);
+	if (xbm_user != NULL)
+		unload_xbm_file(&xbm_user);
+	else if (xbm_ptr == &xbm_test)
+		free_xbm_data(&xbm_test);
+	exit(stream.failed ? EXIT_FAILURE : EXIT_SUCCESS);
+
+usage:
+	fprintf(stderr,
+	"Yet another X BitMap (XBM) viewer.\n"
+	"Usage: %s [-a] [-c] [-g] [-r] [-s] [-t] [-B] [-T] [-b MiB] [-d format]\n"
+	"       [-j threads] [-m mode] [-o dir] [-w policy] [-M MiB]\n"
+	"       [file.xbm | dir ... | -]\n"
+	"  -a  accelerate the scrolling while an arrow key is held\n"
+	"  -c  cache the decoded bitmap in a .xbmc file\n"
+	"  -g  start with the grid of thumbnails\n"
+	"  -r  read the file instead of mapping it into memory\n"
+	"  -s  show the bitmap while it is read, '-' reads stdin\n"
+	"  -t  print the timings of the loaders, tokenizers, threads\n"
+	"      and the other stages for the file\n"
+	"  -B  benchmark parsing, expansion and the first render of the\n"
+	"      files, or of a synthetic corpus without files\n"
+	"  -T  run the self checks and print the result of each\n"
+	"  -b  budget of the bitmaps kept while browsing (default %d MiB)\n"
+	"  -d  write the files to stdout as text, ansi, xbm or pbm\n"
+	"  -j  number of threads that parse large bitmaps\n"
+	"  -m  rendering mode: cell, half or braille (UTF-8 only)\n"
+	"  -o  convert the files as with -d into the directory\n"
+	"  -w  wipe policy of freed buffers: none, zero or stream,\n"
+	"      or class=policy for the text, bitmap or object class\n"
+	"  -M  memory budget for the decoded bitmap (default %d MiB)\n", argv[0], LIST_BUDGET, MEM_BUDGET);
+	exit(EXIT_FAILURE);
+}
+
+/* Draws the XBM bitmap on the screen. The display area could be smaller than
+   the XBM bitmap. The user can move over the bitmap using the arrow keys.
+   The pad has the size of the display area and is filled with the visible
+   section whenever the offsets change, so the expanded characters never take
+   more memory than the display area, however large the bitmap is. The
+   offsets are in pixels of the shown zoom level, a cell covers more than one
+   pixel in the half block and braille modes. Only the tiles of the visible
+   rows are decoded. When the view moves sideways by a few cells, the content
+   of the pad is shifted and only the exposed cells are filled, see
+   scroll_pad().
+   Arrow keys that queue up while a key is held are summed up and drawn
+   with a single update, at most FRAME_FPS times a second, so the view stays
+   within a frame of the keyboard. While a bitmap is streamed in, the visible
+   rows are put into the pad as they arrive and the screen is refreshed
+   STREAM_FPS times a second. The keys are polled in between, so the user can
+   scroll and quit during loading. Zooming is possible once the bitmap is
+   complete. When browsing, title names the file and 'n', 'p' and 'g' end
+   the display too. If watch is not NULL, the file is parsed again when it
+   changes and only the rows that differ are put into the pad again, the
+   offsets are kept. Returns the key that ended the display, or ERR on errors. */
+static int render_xbm_file(struct xbm_dat *xbm, struct xbm_stream *stream, struct xbm_watch *watch, struct xbm_list *list, const char *title)
+{
+	const int x0 = COLS / 2 - COLS / 4;
+	const int y0 = LINES / 2 - LINES / 4;
+	const int x1   = x0 + COLS / 2;
+	const int y1   = y0 + LINES / 2;
+	const int width = x1 - x0 + 1;
+	const int height = y1 - y0 + 1;
+	const int step = 5;
+	int cw = mode_width[pad_mode];
+	int ch = mode_height[pad_mode];
+	struct xbm_dat *view = xbm;   /* shown zoom level */
+	int zoom = 0;
+	int x = 0;
+	int y = 0;
+	int view_x = -1;
+	int view_y = -1;
+	int rows = 0;
+	int key = 0;
+	int last_key = ERR;
+	WINDOW *pad = NULL;
+	struct timespec frame;
+	struct timespec held;         /* time the held arrow key was pressed */
+	struct timespec pressed;      /* time of the last arrow key */
+	struct xbm_match *matches = NULL;   /* result of the last search */
+	size_t match_count = 0;
+	size_t match = 0;             /* shown match */
+	int match_width = 0;          /* size of the searched pattern */
+	int match_height = 0;
+	int ret = 'q';
+	
+	/* Create a ncurses pad window. It holds the section of the bitmap that is displayed. */
+	if ((pad = new_view_pad(xbm, width, height)) == NULL)
+		return ERR;
+
+	if (title != NULL)
+	{
+		move(2, 0);
+		clrtobot();
+		mvprintw(3, 0, "%.*s", COLS - 1, title);
+		refresh();
+	}
+
+	nodelay(stdscr, (stream != NULL && !stream->done) || (list != NULL && list->current != list->shown));
+	clock_gettime(CLOCK_MONOTONIC, &frame);
+	held = pressed = frame;
+
+	/* Drawing loop */
+	while (true)
+	{
+		bool loading = stream != NULL && !stream->done && !stream->failed;
+		const bool pending = list != NULL && list->current != list->shown;
+
+		if (loading)
+		{
+			/* Wait at most a frame for the next block. */
+			if (!step_xbm_stream(stream, 1000 / STREAM_FPS))
+			{
+				mvaddstr(2, 0, "Error: invalid XBM data.");
+				refresh();
+			}
+			if (stream->done || stream->failed)
+			{
+				loading = false;
+				nodelay(stdscr, FALSE);
+			}
+		}
+
+		if (x != view_x || y != view_y)
+		{
+			if (view_x < 0 || !can_shift_screen() || !scroll_pad(pad, view, x, y, x - view_x, y - view_y))
+				set_pad_view(pad, view, x, y);
+			else
+				shift_screen(y0, x0, getmaxy(pad), (x - view_x) / cw);
+			view_x = x;
+			view_y = y;
+			if (show_stats && !loading)
+			{
+				draw_xbm_stats(xbm, zoom, x, y, x0, y0, width, height);
+				wnoutrefresh(stdscr);
+			}
+		}
+
+		/* Put the visible rows that were completed since the last frame into the pad. */
+		if (stream != NULL && rows < (int) (stream->count / xbm->stride))
+		{
+			set_pad_data(pad, xbm, x, y, rows, (int) (stream->count / xbm->stride));
+			rows = (int) (stream->count / xbm->stride);
+		}
+
+		/* Update the pad data on the screen, during loading once per frame. */
+		if (!loading || elapsed_ms(&frame) >= 1000.0 / STREAM_FPS)
+		{
+			if (prefresh(pad, 0, 0, y0, x0, y1, x1) == ERR)
+			{
+				ret = ERR;
+				break;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &frame);
+
+		}
+
+		/* A reloaded bitmap of the same size is compared row by row with the
+		   shown one, and only the rows that differ are expanded into the
+		   pad. The refresh then sends only the cells that changed. Otherwise
+		   the pad is created and filled anew, at the same offsets if they
+		   are still within the bitmap. */
+		if (!loading && !pending && watch != NULL && !key_queued() && !wait_xbm_watch(watch))
+		{
+			struct xbm_dat *fresh = watch->xbm;
+			unsigned char *changed = NULL;
+			int count = 0;
+			int row = y0;
+
+			watch->xbm = NULL;
+			if (fresh == NULL)
+			{
+				mvaddstr(2, 0, "Error: can't reload the XBM file.");
+				clrtoeol();
+				refresh();
+				continue;
+			}
+			if (   fresh->width == xbm->width && fresh->height == xbm->height && fresh->tiles == NULL && xbm->tiles == NULL
+			    && (changed = calloc((size_t) xbm->height, 1)) != NULL)
+				count = diff_xbm_rows(xbm, fresh, changed);
+			else
+				count = fresh->height;
+
+			free(matches);
+			matches = NULL;
+			match_count = 0;
+			replace_xbm_data(xbm, fresh);
+			if (list != NULL)
+				resize_xbm_list_file(list);
+			while ((view = zoom_xbm(xbm, zoom)) == NULL)
+				zoom--;
+
+			if (changed != NULL && zoom == 0)
+			{
+				int first = y;
+
+				/* Put the runs of changed rows of the section into the pad. */
+				for ( ; first < y + getmaxy(pad) * ch && first < xbm->height; first++)
+				{
+					int last = first;
+
+					if (!changed[first])
+						continue;
+					while (last < xbm->height && changed[last])
+						last++;
+					set_pad_data(pad, view, x, y, first, last);
+					first = last;
+				}
+			}
+			else if (changed != NULL)
+			{
+				set_pad_view(pad, view, x, y);
+			}
+			else
+			{
+				delwin(pad);
+				if ((pad = new_view_pad(view, width, height)) == NULL)
+				{
+					ret = ERR;
+					break;
+				}
+				for ( ; row <= y1; row++)
+					mvhline(row, x0, 0x20, width);
+				x = move_offset(x, 0, view->width, width * cw, cw);
+				y = move_offset(y, 0, view->height, height * ch, ch);
+				view_x = -1;
+			}
+			free(changed);
+
+			mvprintw(2, 0, "Reloaded: %d of %d rows changed", count, xbm->height);
+			clrtoeol();
+			if (show_stats)
+				draw_xbm_stats(xbm, zoom, x, y, x0, y0, width, height);
+			refresh();
+			continue;
+		}
+
+		/* Wait for user input, or poll it during loading. While the file
+		   switched to loads in the background, the progress is shown once
+		   per frame. As soon as the file is loaded the caller swaps it in,
+		   a key read meanwhile is left for the new bitmap. */
+		key = getch();
+		if (pending && wait_xbm_list(list, key == ERR ? 1000 / STREAM_FPS : 0))
+		{
+			if (key != ERR)
+				ungetch(key);
+			ret = 0;
+			break;
+		}
+		if (pending)
+		{
+			draw_xbm_progress(list);
+			refresh();
+		}
+		if (key == ERR)
+		{
+			if (loading || pending)
+				continue;
+			ret = ERR;
+			break;
+		}
+
+		/* Specifying the bitmap section that should be displayed in the pad window by
+		   calculating the start offsets. The arrow keys that are queued or
+		   arrive until the next frame is due are summed up. Keys that arrive
+		   within ACCEL_MS of the last one count as held, with -a their step
+		   grows by one for every ACCEL_MS the key is held. */
+		if (key == KEY_RIGHT || key == KEY_LEFT || key == KEY_DOWN || key == KEY_UP)
+		{
+			int dx = 0;
+			int dy = 0;
+
+			while (key == KEY_RIGHT || key == KEY_LEFT || key == KEY_DOWN || key == KEY_UP)
+			{
+				int speed = 1;
+				double wait;
+
+				if (key != last_key || elapsed_ms(&pressed) > ACCEL_MS)
+					clock_gettime(CLOCK_MONOTONIC, &held);
+				else if (accelerate)
+					speed = 1 + (int) (elapsed_ms(&held) / ACCEL_MS);
+				speed = speed < MAX_ACCEL ? speed : MAX_ACCEL;
+				clock_gettime(CLOCK_MONOTONIC, &pressed);
+				last_key = key;
+
+				dx += key == KEY_RIGHT ? speed : key == KEY_LEFT ? -speed : 0;
+				dy += key == KEY_DOWN ? speed : key == KEY_UP ? -speed : 0;
+
+				wait = 1000.0 / FRAME_FPS - elapsed_ms(&frame);
+				timeout(wait > 0.0 ? (int) wait : 0);
+				key = getch();
+			}
+			if (loading || pending)
+				nodelay(stdscr, TRUE);
+			else
+				timeout(-1);
+
+			x = move_offset(x, dx * step * cw, view->width, width * cw, cw);
+			y = move_offset(y, dy * step * ch, view->height, height * ch, ch);
+			if (key == ERR)
+				continue;
+		}
+
+		if (key == 'Q' || key == 'q')
+		{
+			break;
+		}
+		else if (title != NULL && (key == 'n' || key == 'p' || key == 'g' || key == KEY_NPAGE || key == KEY_PPAGE))
+		{
+			ret = key == KEY_NPAGE ? 'n' : key == KEY_PPAGE ? 'p' : key;
+			break;
+		}
+		else if (key == 's' && !loading)
+		{
+			/* Show or hide the statistics next to the display area. */
+			int row = y0;
+
+			show_stats = !show_stats;
+			if (show_stats && !draw_xbm_stats(xbm, zoom, x, y, x0, y0, width, height))
+			{
+				show_stats = false;
+				mvaddstr(2, 0, "Error: can't count the pixels.");
+				clrtoeol();
+			}
+			else if (!show_stats)
+			{
+				for ( ; row <= y1 + 2; row++)
+				{
+					if (row <= y1)
+						mvaddch(row, x1 + 1, 0x20);
+					else
+						mvhline(row, x0, 0x20, COLS - x0);
+				}
+			}
+			refresh();
+		}
+		else if ((key == '/' || ((key == '>' || key == '<') && match_count > 0)) && !loading)
+		{
+			/* Search for a pattern bitmap, or move to the next or previous
+			   match. The pattern file name may be followed by the number of
+			   pixels that may differ. The match is centred in the display
+			   area. */
+			double ms = -1.0;
+
+			if (key == '/')
+			{
+				struct xbm_dat *pattern = NULL;
+				struct timespec start;
+				char input[PATH_MAX];
+				char *space;
+				int threshold = 0;
+				bool ok;
+
+				mvaddstr(2, 0, "Pattern file [pixels that may differ]: ");
+				clrtoeol();
+				echo();
+				ok = getnstr(input, sizeof(input) - 1) != ERR;
+				noecho();
+				if ((space = strrchr(input, ' ')) != NULL && space[1] != '\0' && strspn(space + 1, "0123456789") == strlen(space + 1))
+				{
+					threshold = atoi(space + 1);
+					*space = '\0';
+				}
+
+				free(matches);
+				matches = NULL;
+				match_count = 0;
+				match = 0;
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				if (ok && (pattern = load_xbm_file(input, LOADER_MMAP)) != NULL)
+				{
+					match_count = search_xbm(xbm, pattern, threshold, parse_threads, &matches);
+					match_width = pattern->width;
+					match_height = pattern->height;
+					ms = elapsed_ms(&start);
+					unload_xbm_file(&pattern);
+				}
+				if (match_count == 0)
+				{
+					if (ms < 0.0)
+						mvaddstr(2, 0, "Error: can't load the pattern.");
+					else
+						mvprintw(2, 0, "No match, %.1f ms", ms);
+					clrtoeol();
+					refresh();
+					continue;
+				}
+			}
+			else
+			{
+				match = key == '>' ? (match + 1) % match_count : (match + match_count - 1) % match_count;
+			}
+
+			x = ((matches[match].x + match_width / 2) >> zoom) - width * cw / 2;
+			y = ((matches[match].y + match_height / 2) >> zoom) - height * ch / 2;
+			x = move_offset(x > 0 ? x / cw * cw : 0, 0, view->width, width * cw, cw);
+			y = move_offset(y > 0 ? y : 0, 0, view->height, height * ch, ch);
+
+			mvprintw(2, 0, "Match %zu of %zu%s at %d,%d, %d pixels differ", match + 1, match_count,
+			         match_count == MAX_MATCHES ? " or more" : "", matches[match].x, matches[match].y, matches[match].diff);
+			if (ms >= 0.0)
+				printw(", %.1f ms", ms);
+			clrtoeol();
+			refresh();
+		}
+		else if ((key == 'm' && utf8_locale) || ((key == '-' || key == '+' || key == '=' || xform_key(key) >= 0) && !loading))
+		{
+			/* Switch to the next mode or zoom level, or transform the
+			   bitmap. The pad changes its size, the area of the old pad is
+			   cleared. When zooming or transforming, the pixel in the
+			   middle of the display area stays in place. A transform
+			   replaces the data of the bitmap and drops its zoom levels,
+			   the shown level is built again from the result. */
+			const int op = xform_key(key);
+			int level = key == 'm' || op >= 0 ? zoom : key == '-' ? zoom + 1 : zoom - 1;
+			struct xbm_dat *next = NULL;
+			int row = y0;
+
+			if (op >= 0)
+			{
+				const int w = xbm->width;
+				const int h = xbm->height;
+				int cx = (x + width * cw / 2) << zoom;
+				int cy = (y + height * ch / 2) << zoom;
+				struct timespec start;
+
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				if (!transform_xbm(xbm, op, x << zoom, y << zoom, (width * cw) << zoom, (height * ch) << zoom))
+				{
+					mvaddstr(2, 0, "Error: can't transform the bitmap.");
+					clrtoeol();
+					refresh();
+					continue;
+				}
+				mvprintw(2, 0, "%s: %.1f ms", xform_names[op], elapsed_ms(&start));
+				clrtoeol();
+				if (list != NULL)
+					resize_xbm_list_file(list);
+
+				/* The matches of the last search are at other positions now. */
+				free(matches);
+				matches = NULL;
+				match_count = 0;
+
+				xform_point(op, w, h, x << zoom, y << zoom, &cx, &cy);
+				while ((next = zoom_xbm(xbm, level)) == NULL)
+					level--;
+				x = (cx >> level) - width * cw / 2;
+				y = (cy >> level) - height * ch / 2;
+			}
+			else if ((next = level >= 0 ? zoom_xbm(xbm, level) : NULL) == NULL)
+			{
+				continue;
+			}
+
+			if (key == 'm')
+			{
+				pad_mode = (pad_mode + 1) % MODE_COUNT;
+			}
+			else if (op >= 0)
+			{
+				/* The offsets are set above. */
+			}
+			else if (level > zoom)
+			{
+				x = (x + width * cw / 2) / 2 - width * cw / 2;
+				y = (y + height * ch / 2) / 2 - height * ch / 2;
+			}
+			else
+			{
+				x = (x + width * cw / 2) * 2 - width * cw / 2;
+				y = (y + height * ch / 2) * 2 - height * ch / 2;
+			}
+			zoom = level;
+			view = next;
+			cw = mode_width[pad_mode];
+			ch = mode_height[pad_mode];
+
+			delwin(pad);
+			if ((pad = new_view_pad(view, width, height)) == NULL)
+			{
+				ret = ERR;
+				break;
+			}
+			for ( ; row <= y1; row++)
+				mvhline(row, x0, 0x20, width);
+			if (op < 0)
+			{
+				mvprintw(2, 0, "Zoom 1:%d", 1 << zoom);
+				clrtoeol();
+			}
+			refresh();
+
+			x = move_offset(x > 0 ? x / cw * cw : 0, 0, view->width, width * cw, cw);
+			y = move_offset(y > 0 ? y : 0, 0, view->height, height * ch, ch);
+			view_x = -1;
+		}
+	}
+	
+	if (pad != NULL)
+	{
+		delwin(pad);
+		pad = NULL;
+	}
+	free(matches);
+
+	return ret;
+}
+
+/* Watches the directory of the file for the file being written or replaced,
+   which catches editors and tools that write a new file and rename it. */
+static bool open_xbm_watch(const char *filename, enum xbm_loader loader, struct xbm_watch *watch)
+{
+	const char *slash = strrchr(filename, '/');
+	char dir[PATH_MAX];
+
+	memset(watch, 0, sizeof(*watch));
+	watch->filename = filename;
+	watch->loader = loader;
+	watch->pipe[0] = watch->pipe[1] = -1;
+
+	if (slash == NULL)
+		strcpy(dir, ".");
+	else if (snprintf(dir, sizeof(dir), "%.*s", slash == filename ? 1 : (int) (slash - filename), filename) >= (int) sizeof(dir))
+		return false;
+	if (snprintf(watch->name, sizeof(watch->name), "%s", slash != NULL ? slash + 1 : filename) >= (int) sizeof(watch->name))
+		return false;
+
+	if ((watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+		return false;
+	if (inotify_add_watch(watch->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1 || pipe(watch->pipe) == -1)
+	{
+		close_xbm_watch(watch);
+		return false;
+	}
+	return true;
+}
+
+/* Waits for a running parse and closes the watch. */
+static void close_xbm_watch(struct xbm_watch *watch)
+{
+	if (watch->busy)
+	{
+		pthread_join(watch->thread, NULL);
+		unload_xbm_file(&watch->fresh);
+	}
+	unload_xbm_file(&watch->xbm);
+	if (watch->fd != -1)
+		close(watch->fd);
+	if (watch->pipe[0] != -1)
+		close(watch->pipe[0]);
+	if (watch->pipe[1] != -1)
+		close(watch->pipe[1]);
+	watch->fd = watch->pipe[0] = watch->pipe[1] = -1;
+}
+
+/* Waits for a key while watching the file. A change of the file starts a
+   thread that parses it again. If the file changes again during the parse,
+   the result is dropped and the file is parsed once more, so only the last
+   version is shown. Returns true when a key can be read, or false when a
+   parse is done and watch->xbm holds the bitmap, NULL on errors. */
+static bool wait_xbm_watch(struct xbm_watch *watch)
+{
+	while (true)
+	{
+		struct pollfd fds[3];
+		union
+		{
+			struct inotify_event event;
+			char buf[4096];
+		} events;
+		bool changed = false;
+		ssize_t len;
+
+		fds[0].fd = key_fd;
+		fds[1].fd = watch->fd;
+		fds[2].fd = watch->pipe[0];
+		fds[0].events = fds[1].events = fds[2].events = POLLIN;
+		if (poll(fds, 3, -1) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return true;
+		}
+
+		if (fds[2].revents & POLLIN)
+		{
+			char byte;
+
+			if (read(watch->pipe[0], &byte, 1) == 1)
+			{
+				pthread_join(watch->thread, NULL);
+				watch->busy = false;
+				if (!watch->again)
+				{
+					watch->xbm = watch->fresh;
+					watch->fresh = NULL;
+					return false;
+				}
+				unload_xbm_file(&watch->fresh);
+				watch->again = false;
+				changed = true;
+			}
+		}
+
+		while ((len = read(watch->fd, events.buf, sizeof(events.buf))) > 0)
+		{
+			ssize_t i = 0;
+
+			while (i < len)
+			{
+				const struct inotify_event *event = (const struct inotify_event *) (events.buf + i);
+
+				changed = changed || (event->len > 0 && !strcmp(event->name, watch->name));
+				i += (ssize_t) (sizeof(struct inotify_event) + event->len);
+			}
+		}
+
+		if (changed && watch->busy)
+			watch->again = true;
+		else if (changed)
+			watch->busy = pthread_create(&watch->thread, NULL, watch_thread, watch) == 0;
+
+		if (fds[0].revents)
+			return true;
+	}
+}
+
+/* Returns true if ncurses holds a key that poll() on the terminal doesn't
+   see, because it was pushed back with ungetch() or read ahead with an
+   escape sequence. The key stays queued for the next getch(). */
+static bool key_queued()
+{
+	int key;
+
+	nodelay(stdscr, TRUE);
+	key = getch();
+	nodelay(stdscr, FALSE);
+	if (key == ERR)
+		return false;
+	ungetch(key);
+	return true;
+}
+
+/* Thread function that parses the watched file. */
+static void *watch_thread(void *arg)
+{
+	struct xbm_watch *watch = arg;
+
+	watch->fresh = load_xbm_cached(watch->filename, watch->loader, NULL);
+	return write(watch->pipe[1], "", 1) == 1 ? watch : NULL;
+}
+
+/* Compares the rows of two bitmaps of the same size and sets changed[y] for
+   each row y that differs. Returns the number of changed rows. */
+static int diff_xbm_rows(struct xbm_dat *xbm, struct xbm_dat *other, unsigned char *changed)
+{
+	int count = 0;
+	int y = 0;
+
+	for ( ; y < xbm->height; y++)
+	{
+		changed[y] = memcmp(xbm_row(xbm, y), xbm_row(other, y), xbm->stride) != 0;
+		count += changed[y];
+	}
+	return count;
+}
+
+/* Moves the offset pos by delta pixels. The section of size pixels that starts
+   at the offset stays within the length of the bitmap, but may end in the
+   middle of the last cell of cell pixels. */
+static int move_offset(int pos, int delta, int length, int size, int cell)
+{
+	const int max = length > size ? (length - size + cell - 1) / cell * cell : 0;
+
+	pos += delta;
+	return pos < 0 ? 0 : pos > max ? max : pos;
+}
+
+/* Creates a pad for the display area of width x height cells, or smaller if
+   the bitmap fits into fewer cells in the current mode. */
+static WINDOW *new_view_pad(struct xbm_dat *xbm, int width, int height)
+{
+	const int cols = (xbm->width + mode_width[pad_mode] - 1) / mode_width[pad_mode];
+	const int rows = (xbm->height + mode_height[pad_mode] - 1) / mode_height[pad_mode];
+
+	return newpad(rows < height ? rows : height, cols < width ? cols : width);
+}
+
+/* Fill the padding window with the XBM object data. The pad rows that show the
+   bitmap rows from first to before last in the section starting at x, y are
+   put into the pad. */
+static void set_pad_data(WINDOW *pad, struct xbm_dat *xbm, int x, int y, int first, int last)
+{
+	const int ch = mode_height[pad_mode];
+
+	set_pad_cells(pad, xbm, x, y, first > y ? (first - y) / ch : 0, (last - y + ch - 1) / ch, 0, getmaxx(pad));
+}
+
+/* Fill the pad rows from row to before last and the columns from col to before
+   col + cols with the section of the bitmap that starts at x, y. The rows are
+   fetched with xbm_row() so that only the tiles of the section are decoded. */
+static void set_pad_cells(WINDOW *pad, struct xbm_dat *xbm, int x, int y, int row, int last, int col, int cols)
+{
+	const int cw = mode_width[pad_mode];
+	const int ch = mode_height[pad_mode];
+
+	if (last > getmaxy(pad))
+		last = getmaxy(pad);
+
+	for ( ; row < last; row++)
+	{
+		const unsigned char *bits[4] = { NULL, NULL, NULL, NULL };
+		int i = 0;
+
+		for ( ; i < ch && y + row * ch + i < xbm->height; i++)
+			bits[i] = xbm_row(xbm, y + row * ch + i);
+
+		if (pad_mode != MODE_CELL)
+			put_pad_glyphs(pad, row, col, bits, x + col * cw, cols, xbm->width);
+		else if (bits[0] != NULL)
+			put_pad_row(pad, row, col, bits[0], x + col, cols);
+		else
+			mvwhline(pad, row, col, 0x20, cols);
+	}
+}
+
+/* Moves the content of the pad from the section at x - dx, y to the section
+   at x, y by deleting or inserting characters at the start of each row, and
+   fills only the cells that were exposed. shift_screen() moves the screen
+   the same way, as ncurses doesn't detect horizontal moves. Vertical moves
+   are left to ncurses, which finds the moved lines by their hashes and
+   scrolls the screen itself, so filling the whole pad sends no more bytes.
+   Returns false if the move is not horizontal by a whole number of cells or
+   leaves nothing of the pad in place, the pad has to be filled then. */
+static bool scroll_pad(WINDOW *pad, struct xbm_dat *xbm, int x, int y, int dx, int dy)
+{
+	const int cw = mode_width[pad_mode];
+	const int width = getmaxx(pad);
+	const int height = getmaxy(pad);
+	const int n = dx / cw;
+	int row = 0;
+
+	if (dx == 0 || dy != 0 || dx % cw != 0 || abs(n) >= width)
+		return false;
+
+	for ( ; row < height; row++)
+	{
+		int i = 0;
+
+		wmove(pad, row, 0);
+		for ( ; i < abs(n); i++)
+		{
+			if (n > 0)
+				wdelch(pad);
+			else
+				winsch(pad, 0x20);
+		}
+	}
+	if (n > 0)
+		set_pad_cells(pad, xbm, x, y, 0, height, width - n, n);
+	else
+		set_pad_cells(pad, xbm, x, y, 0, height, 0, -n);
+	return true;
+}
+
+/* Fill the pad with the section of the bitmap that starts at x, y. */
+static void set_pad_view(WINDOW *pad, struct xbm_dat *xbm, int x, int y)
+{
+	set_pad_data(pad, xbm, x, y, y, y + getmaxy(pad) * mode_height[pad_mode]);
+}
+
+/* Returns true if shift_screen() can move the display area on this
+   terminal. It needs the delete and insert character functions with a
+   count, and they have to shift the whole line like ncurses shifts curscr:
+   no delete or insert mode to enter first, no nulls that differ from
+   blanks and no magic cookies that take up cells. Terminals with left and
+   right margins shift only up to the right margin, so they need a way to
+   clear the margins, which shift_screen() does first. */
+static bool can_shift_screen()
+{
+	static const char *const needed[] = { "dch", "ich" };
+	static const char *const margins[] = { "smgl", "smglr", "smglp" };
+	const char *cap = tigetstr("smdc");
+	size_t i = 0;
+
+	for ( ; i < sizeof(needed) / sizeof(needed[0]); i++)
+	{
+		const char *cap = tigetstr(needed[i]);
+
+		if (cap == NULL || cap == (char *) -1)
+			return false;
+	}
+	if (cap != NULL && cap != (char *) -1 && *cap != '\0')
+		return false;
+	for (i = 0; i < sizeof(margins) / sizeof(margins[0]); i++)
+	{
+		cap = tigetstr(margins[i]);
+		if (cap != NULL && cap != (char *) -1 && *cap != '\0')
+		{
+			cap = tigetstr("mgc");
+			if (cap == NULL || cap == (char *) -1)
+				return false;
+		}
+	}
+	return tigetflag("in") <= 0 && tigetnum("xmc") <= 0;
+}
+
+/* Shifts the screen rows from y0 to before y0 + height by n columns from
+   column x0 on, to the left if n is positive, with the delete or insert
+   character function of the terminal. curscr, the screen as ncurses knows
+   it, is changed the same way, so the next update only sends the columns
+   that were exposed. ncurses itself doesn't detect horizontal moves and
+   would resend the whole display area. Returns false if the terminal can't
+   shift lines that way, see can_shift_screen(). */
+static bool shift_screen(int y0, int x0, int height, int n)
+{
+	char *cap = tigetstr(n > 0 ? "dch" : "ich");
+	char *clear = tigetstr("mgc");
+	int row = y0;
+
+	if (!can_shift_screen())
+		return false;
+	if (clear != NULL && clear != (char *) -1)
+		putp(clear);
+
+	/* putp() goes through the output buffer of the screen like mvcur() and
+	   the updates of ncurses, so the sequences reach the terminal in order.
+	   mvcur() tells ncurses where the cursor is. Each row of curscr is then
+	   shifted like the terminal shifts it, over the full width of the line,
+	   so curscr still matches the terminal and the next update compares the
+	   pad with what is really shown. */
+	for ( ; row < y0 + height; row++)
+	{
+		int i = 0;
+
+		mvcur(getcury(curscr), getcurx(curscr), row, x0);
+		wmove(curscr, row, x0);
+		putp(tparm(cap, abs(n)));
+		for ( ; i < abs(n); i++)
+		{
+			if (n > 0)
+				wdelch(curscr);
+			else
+				winsch(curscr, 0x20);
+		}
+	}
+	fflush(stdout);
+	return true;
+}
+
+/* Puts the pixels x to x + width - 1 of a row of packed bits into the pad at
+   row y, starting in column col. Each byte is expanded to 8 characters with a
+   single copy from pad_table. The characters are collected in a line that
+   is put into the pad with one call, instead of moving the cursor and adding
+   a character for every pixel. */
+static void put_pad_row(WINDOW *pad, int y, int col, const unsigned char *bits, int x, int width)
+{
+	chtype line[EXPAND_CHUNK + 8];
+
+	while (width > 0)
+	{
+		const int skip = x & 7;
+		const int n = width < EXPAND_CHUNK ? width : EXPAND_CHUNK;
+		const unsigned char *p = bits + (x >> 3);
+		int i = 0;
+
+		for ( ; i < skip + n; i += 8)
+			memcpy(line + i, pad_table[*p++], sizeof(pad_table[0]));
+		mvwaddchnstr(pad, y, col, line + skip, n);
+
+		x += n;
+		col += n;
+		width -= n;
+	}
+}
+
+/* Puts a row of width cells of the half block or braille mode into the pad at
+   row y, starting in column col. The cells show the pixels from x on of the
+   2 or 4 bitmap rows in bits, a NULL row is blank. x is a multiple of the
+   cell width. The glyphs are looked up by the codes from row_glyphs(). */
+static void put_pad_glyphs(WINDOW *pad, int y, int col, const unsigned char **bits, int x, int width, int xbm_width)
+{
+	const int cw = mode_width[pad_mode];
+	unsigned char codes[EXPAND_CHUNK];
+	cchar_t line[EXPAND_CHUNK];
+	int done = 0;
+
+	while (done < width)
+	{
+		const int n = width - done < EXPAND_CHUNK ? width - done : EXPAND_CHUNK;
+		int i = 0;
+
+		row_glyphs(bits, x + done * cw, n, xbm_width, codes);
+		if (pad_mode == MODE_HALF)
+			for ( ; i < n; i++)
+				line[i] = half_glyphs[codes[i]];
+		else
+			for ( ; i < n; i++)
+				line[i] = braille_glyphs[codes[i]];
+		mvwadd_wchnstr(pad, y, col + done, line, n);
+		done += n;
+	}
+}
+
+/* Computes the codes of width cells of the current mode that show the pixels
+   from x on of the rows in bits, a NULL row is blank. x is a multiple of the
+   cell width. The code of a cell is its pixel in the cell mode, the index
+   into half_glyphs in the half block mode and the dots of the pattern in the
+   braille mode. Each byte of the rows is turned into the codes of its 8, 8
+   or 4 cells with one lookup per row, the pixels beyond the bitmap width are
+   masked out. */
+static void row_glyphs(const unsigned char **bits, int x, int width, int xbm_width, unsigned char *codes)
+{
+	static const unsigned char zero = 0;
+	const int cw = mode_width[pad_mode];
+	const int rows = mode_height[pad_mode];
+	const int last = (xbm_width - 1) >> 3;
+	const unsigned char tail = (xbm_width & 7) ? (1 << (xbm_width & 7)) - 1 : 0xff;
+	int n = 0;
+
+	while (n < width)
+	{
+		const int byte = (x + n * cw) >> 3;
+		const unsigned char mask = byte == last ? tail : 0xff;
+		const unsigned char *p[4];
+		int cell = ((x + n * cw) & 7) / cw;
+		int i = 0;
+
+		for ( ; i < rows; i++)
+			p[i] = bits[i] != NULL && byte <= last ? bits[i] + byte : &zero;
+
+		if (pad_mode == MODE_CELL)
+		{
+			const unsigned int v = *p[0] & mask;
+			for ( ; cell < 8 && n < width; cell++)
+				codes[n++] = (v >> cell) & 1;
+		}
+		else if (pad_mode == MODE_HALF)
+		{
+			const unsigned int v = half_bits[*p[0] & mask] | half_bits[*p[1] & mask] << 1;
+			for ( ; cell < 8 && n < width; cell++)
+				codes[n++] = (v >> (2 * cell)) & 3;
+		}
+		else
+		{
+			const uint32_t v = braille_dots[0][*p[0] & mask] | braille_dots[1][*p[1] & mask]
+			                 | braille_dots[2][*p[2] & mask] | braille_dots[3][*p[3] & mask];
+			for ( ; cell < 4 && n < width; cell++)
+				codes[n++] = (v >> (8 * cell)) & 0xff;
+		}
+	}
+}
+
+/* Sets up the pad characters of each byte value, and the tables of the half
+   block and braille modes. */
+static void init_pad_table()
+{
+	static const wchar_t halves[4] = { 0x20, 0x2580, 0x2584, 0x2588 };
+	int byte = 0;
+
+	init_glyph_bits();
+	for ( ; byte < 256; byte++)
+	{
+		wchar_t glyph[2] = { 0x2800 + byte, 0 };
+		int i = 0;
+
+		for ( ; i < 8; i++)
+			pad_table[byte][i] = (byte & (1 << i)) ? ACS_CKBOARD : 0x20;
+		setcchar(&braille_glyphs[byte], glyph, A_NORMAL, 0, NULL);
+	}
+
+	for (byte = 0; byte < 4; byte++)
+	{
+		wchar_t glyph[2] = { halves[byte], 0 };
+		setcchar(&half_glyphs[byte], glyph, A_NORMAL, 0, NULL);
+	}
+}
+
+/* Sets up half_bits and braille_dots. They don't depend on curses, so the
+   output without a screen uses them too. */
+static void init_glyph_bits()
+{
+	/* Dots of the left and right pixel of each row of a braille cell. */
+	static const unsigned char dots[4][2] = { { 0x01, 0x08 }, { 0x02, 0x10 }, { 0x04, 0x20 }, { 0x40, 0x80 } };
+	int byte = 0;
+
+	for ( ; byte < 256; byte++)
+	{
+		int i = 0;
+
+		half_bits[byte] = 0;
+		for ( ; i < 4; i++)
+			braille_dots[i][byte] = 0;
+		for (i = 0; i < 8; i++)
+		{
+			int row = 0;
+
+			if (byte & (1 << i))
+			{
+				half_bits[byte] |= 1 << (2 * i);
+				for ( ; row < 4; row++)
+					braille_dots[row][byte] |= (uint32_t) dots[row][i & 1] << (8 * (i >> 1));
+			}
+		}
+	}
+}
+
+/* Fill the pad pixel by pixel. This is how the pad was filled before the rows
+   were expanded with pad_table, it is kept as reference for the timing mode. */
+static void set_pad_pixels(WINDOW *pad, struct xbm_dat *xbm)
+{
+	const int width = getmaxx(pad);
+	const int height = getmaxy(pad);
+	int y = 0;
+
+	for ( ; y < height; y++)
+	{
+		const unsigned char *bits = xbm_row(xbm, y);
+		int x = 0;
+
+		do
+		{
+			int i = 0;
+			for ( ; i < 8 && x < width; i++, x++)
+				mvwaddch(pad, y, x, (*bits & (1 << i)) ? ACS_CKBOARD : 0x20);
+			bits++;
+		} while (x < width);
+	}
+}
+
+/* Opens a XBM file, or stdin if filename is "-", for streaming and reads until
+   the header is complete. The bitmap object is allocated with all rows blank,
+   step_xbm_stream() fills them in. Files ending in .xbm.gz or .xbm.zst are
+   decompressed on the fly. A bitmap beyond the memory budget is not
+   allocated, spill is set instead. */
+static bool open_xbm_stream(const char *filename, struct xbm_stream *st)
+{
+	memset(st, 0, sizeof(*st));
+
+	if (!strcmp(filename, "-"))
+		st->fd = STDIN_FILENO;
+	else if (   !xbm_file_kind(filename, &st->kind, NULL)
+	         || st->kind == KIND_PBM
+	         || (st->fd = open(filename, O_RDONLY)) == -1)
+		return false;
+
+	if (st->kind == KIND_GZIP)
+	{
+		/* 32 lets zlib detect a gzip or a zlib header. */
+		if (   (st->gzip = calloc(sizeof(z_stream), 1)) == NULL
+		    || inflateInit2(st->gzip, 15 + 32) != Z_OK)
+		{
+			free(st->gzip);
+			st->gzip = NULL;
+			close_xbm_stream(st);
+			return false;
+		}
+	}
+#if defined(USE_ZSTD)
+	else if (st->kind == KIND_ZSTD && (st->zstd = ZSTD_createDStream()) == NULL)
+	{
+		close_xbm_stream(st);
+		return false;
+	}
+#endif
+	if (st->kind != KIND_XBM && (st->zbuf = malloc(READ_CHUNK)) == NULL)
+	{
+		close_xbm_stream(st);
+		return false;
+	}
+
+	while (!st->spill && (st->xbm == NULL || st->xbm->data == NULL))
+	{
+		if (!step_xbm_stream(st, -1))
+		{
+			close_xbm_stream(st);
+			unload_xbm_file(&st->xbm);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Reads the next block of text and decodes the complete literals in it. Waits
+   at most timeout milliseconds for data, -1 waits forever. The header is
+   parsed as soon as the opening brace of the array has arrived. Returns
+   false if the text is not a valid XBM bitmap. */
+static bool step_xbm_stream(struct xbm_stream *st, int timeout)
+{
+	struct pollfd pfd;
+	struct hex_tok tok;
+	size_t end;
+	ssize_t n;
+
+	if (st->done || st->failed)
+		return !st->failed;
+
+	/* Compressed text that is already read needs no wait. */
+	pfd.fd = st->fd;
+	pfd.events = POLLIN;
+	if (st->zpos == st->zsize && poll(&pfd, 1, timeout) == 0)
+		return true;
+
+	if (st->cap - st->size < READ_CHUNK)
+	{
+		size_t cap = st->cap > 0 ? 2 * st->cap : 2 * READ_CHUNK;
+		char *buf;
+
+		/* Only the header or a run of garbage can grow the buffer that much. */
+		if (cap > MAX_READSIZE || (buf = realloc(st->buf, cap)) == NULL)
+			goto out_err;
+		st->buf = buf;
+		st->cap = cap;
+	}
+
+	if ((n = read_xbm_stream(st, st->buf + st->size, READ_CHUNK)) == -1)
+	{
+		if (errno == EINTR || errno == EAGAIN)
+			return true;
+		goto out_err;
+	}
+	st->size += (size_t) n;
+
+	if (st->xbm == NULL)
+	{
+		struct xbm_src src;
+		struct xbm_dat *xbm;
+
+		if (n > 0 && memchr(st->buf, '{', st->size) == NULL)
+			return true;
+
+		memset(&src, 0, sizeof(src));
+		src.buf = st->buf;
+		src.size = st->size;
+		if ((xbm = st->xbm = calloc(sizeof(struct xbm_dat), 1)) == NULL || !parse_xbm_header(&src, xbm, &st->pos, &st->words))
+			goto out_err;
+		xbm->stride = (size_t) (xbm->width + 7) / 8;
+		xbm->len = (size_t) xbm->height * xbm->stride;
+		if (xbm->len > mem_budget)
+		{
+			/* The rows are decoded by spill_xbm_stream(). */
+			st->spill = true;
+			return true;
+		}
+		if ((xbm->data = calloc(xbm->len, 1)) == NULL)
+			goto out_err;
+	}
+
+	/* Decode up to the last separator, the rest might be an incomplete literal. */
+	end = st->size;
+	if (n > 0)
+		while (end > st->pos && (hex_digits[(unsigned char) st->buf[end - 1]] || st->buf[end - 1] == 'x' || st->buf[end - 1] == 'X'))
+			end--;
+
+	memset(&tok, 0, sizeof(tok));
+	tok.buf = st->buf;
+	tok.size = end;
+	tok.pos = st->pos;
+	tok.out = st->xbm->data;
+	tok.len = st->words ? (size_t) st->xbm->height * st->words : st->xbm->len;
+	tok.count = st->literals;
+	tok.open_end = n > 0;
+	tok.words = st->words;
+	tok.stride = st->xbm->stride;
+	if (tok.words)
+		seek_hex_words(&tok, tok.count);
+	if (!tokenize_hex(&tok))
+		goto out_err;
+
+	st->literals = tok.count;
+	st->count = tok.words ? tok.at : tok.count;
+	if (tok.pos < end && st->buf[tok.pos] == '}')
+	{
+		st->done = true;
+		return true;
+	}
+
+	memmove(st->buf, st->buf + end, st->size - end);
+	st->size -= end;
+	st->pos = 0;
+	return true;
+
+out_err:
+	st->failed = true;
+	return false;
+}
+
+/* Reads up to size bytes of text into buf, decompressing the file if it is
+   compressed. Returns the number of bytes, 0 at the end of the text or -1 with
+   errno set. A compressed file that ends before its data does, or has garbage
+   after it, fails with EINVAL. Concatenated gzip members are read as one. */
+static ssize_t read_xbm_stream(struct xbm_stream *st, char *buf, size_t size)
+{
+	if (st->kind == KIND_XBM)
+		return read(st->fd, buf, size);
+
+	while (true)
+	{
+		size_t out = 0;
+
+		if (st->zpos == st->zsize)
+		{
+			ssize_t n;
+
+			if ((n = read(st->fd, st->zbuf, READ_CHUNK)) == -1)
+				return -1;
+			if (n == 0)
+			{
+				if (st->zend)
+					return 0;
+				errno = EINVAL;
+				return -1;
+			}
+			st->zsize = (size_t) n;
+			st->zpos = 0;
+		}
+
+		if (st->kind == KIND_GZIP)
+		{
+			const size_t from = st->zpos;
+			int ret;
+
+			st->gzip->next_in = st->zbuf + st->zpos;
+			st->gzip->avail_in = (uInt) (st->zsize - st->zpos);
+			st->gzip->next_out = (unsigned char *) buf;
+			st->gzip->avail_out = (uInt) size;
+			ret = inflate(st->gzip, Z_NO_FLUSH);
+			st->zpos = st->zsize - st->gzip->avail_in;
+			out = size - st->gzip->avail_out;
+			if (ret == Z_STREAM_END)
+			{
+				st->zend = true;
+				ret = inflateReset(st->gzip);
+			}
+			else if (st->zpos > from)
+				st->zend = false;
+			if (ret != Z_OK && ret != Z_BUF_ERROR)
+			{
+				errno = EINVAL;
+				return -1;
+			}
+		}
+#if defined(USE_ZSTD)
+		else
+		{
+			ZSTD_inBuffer in;
+			ZSTD_outBuffer to;
+			size_t ret;
+
+			in.src = st->zbuf;
+			in.size = st->zsize;
+			in.pos = st->zpos;
+			to.dst = buf;
+			to.size = size;
+			to.pos = 0;
+			ret = ZSTD_decompressStream(st->zstd, &to, &in);
+			if (ZSTD_isError(ret))
+			{
+				errno = EINVAL;
+				return -1;
+			}
+			st->zpos = in.pos;
+			out = to.pos;
+			st->zend = ret == 0;
+		}
+#endif
+		if (out > 0)
+			return (ssize_t) out;
+	}
+}
+
+/* Closes the stream. The bitmap object is not freed, it belongs to the caller
+   once the header has been read. */
+static void close_xbm_stream(struct xbm_stream *st)
+{
+	if (st->fd > STDIN_FILENO)
+		close(st->fd);
+	if (st->gzip != NULL)
+		inflateEnd(st->gzip);
+	free(st->gzip);
+#if defined(USE_ZSTD)
+	ZSTD_freeDStream(st->zstd);
+	st->zstd = NULL;
+#endif
+	free_mem((char **) &st->zbuf, READ_CHUNK, WIPE_TEXT);
+	free_mem(&st->buf, st->cap, WIPE_TEXT);
+	st->fd = -1;
+	st->gzip = NULL;
+	st->size = st->cap = 0;
+	st->zsize = st->zpos = 0;
+}
+
+/* Loads a compressed XBM file, or stdin if filename is "-", through a stream,
+   so the decompressed text is never held as a whole. The decoded bytes of
+   the bitmap are reported to progress after each block. */
+static struct xbm_dat *load_xbm_stream(const char *filename, struct xbm_progress *progress)
+{
+	struct xbm_stream st;
+	struct xbm_dat *xbm = NULL;
+
+	if (!open_xbm_stream(filename, &st))
+		return NULL;
+	if (st.spill)
+	{
+		xbm = spill_xbm_stream(&st, progress);
+		close_xbm_stream(&st);
+		return xbm;
+	}
+	while (!st.done && step_xbm_stream(&st, -1) && set_progress(progress, st.count, st.xbm->len))
+		;
+	close_xbm_stream(&st);
+	if (st.done)
+		xbm = st.xbm;
+	else
+		unload_xbm_file(&st.xbm);
+	return xbm;
+}
+
+/* Decodes a stream whose bitmap is beyond the memory budget into an unlinked
+   temporary file instead of memory. The file holds the packed rows like a
+   cache file, so it takes an eighth of the pixels rather than the text. It
+   is mapped shared while the rows are decoded, then privately like a cache
+   file, and the kernel writes back and drops the pages that are not in use.
+   The stream gives up its bitmap, the decoded bytes are reported to progress. */
+static struct xbm_dat *spill_xbm_stream(struct xbm_stream *st, struct xbm_progress *progress)
+{
+	struct xbm_dat *xbm = st->xbm;
+	void *addr = MAP_FAILED;
+	FILE *tmp;
+
+	st->xbm = NULL;
+	if (   (tmp = tmpfile()) == NULL
+	    || ftruncate(fileno(tmp), (off_t) xbm->len) == -1
+	    || (addr = mmap(NULL, xbm->len, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(tmp), 0)) == MAP_FAILED)
+		goto out;
+
+	st->xbm = xbm;
+	xbm->data = addr;
+	while (!st->done && step_xbm_stream(st, -1) && set_progress(progress, st->count, xbm->len))
+		;
+	st->xbm = NULL;
+	xbm->data = NULL;
+	munmap(addr, xbm->len);
+	addr = st->done ? mmap(NULL, xbm->len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(tmp), 0) : MAP_FAILED;
+
+out:
+	if (tmp != NULL)
+		fclose(tmp);
+	if (addr == MAP_FAILED)
+	{
+		unload_xbm_file(&xbm);
+		return NULL;
+	}
+	xbm->map = addr;
+	xbm->map_size = xbm->len;
+	xbm->data = addr;
+	return xbm;
+}
+
+/* Returns the kind of the file by the suffix of its name and the length of
+   the suffix, false if the name has none of the known suffixes. */
+static bool xbm_file_kind(const char *name, enum xbm_kind *kind, size_t *suffix)
+{
+	const size_t len = strlen(name);
+	int i = 0;
+
+	for ( ; i < KIND_COUNT; i++)
+	{
+		const char *ext = kind_suffixes[i];
+
+		if (ext != NULL && len > strlen(ext) && !strcasecmp(name + len - strlen(ext), ext))
+		{
+			if (kind != NULL)
+				*kind = (enum xbm_kind) i;
+			if (suffix != NULL)
+				*suffix = strlen(ext);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Collects the files to browse. Directories are replaced by their bitmap files
+   in name order. If prefetch is true, the prefetch thread is started once the
+   list is complete. */
+static bool open_xbm_list(char **args, int count, enum xbm_loader loader, bool prefetch, struct xbm_list *list)
+{
+	int i = 0;
+
+	memset(list, 0, sizeof(*list));
+	list->loader = loader;
+	list->budget = list_budget;
+	list->shown = list->busy = -1;
+	list->pipe[0] = list->pipe[1] = -1;
+	pthread_mutex_init(&list->lock, NULL);
+	pthread_cond_init(&list->wake, NULL);
+	pthread_mutex_init(&list->progress.lock, NULL);
+
+	for ( ; i < count; i++)
+	{
+		struct stat sb;
+		struct dirent *entry;
+		DIR *dir;
+		int first = list->count;
+
+		if (stat(args[i], &sb) == -1 || !S_ISDIR(sb.st_mode))
+		{
+			if (!add_xbm_name(list, NULL, args[i]))
+				goto out_err;
+			continue;
+		}
+
+		if ((dir = opendir(args[i])) == NULL)
+		{
+			fprintf(stderr, "%s: %s\n", args[i], strerror(errno));
+			goto out_err;
+		}
+		while ((entry = readdir(dir)) != NULL)
+		{
+			if (   xbm_file_kind(entry->d_name, NULL, NULL)
+			    && !add_xbm_name(list, args[i], entry->d_name))
+			{
+				closedir(dir);
+				goto out_err;
+			}
+		}
+		closedir(dir);
+		qsort(list->names + first, list->count - first, sizeof(char *), compare_names);
+	}
+
+	if (list->count == 0)
+	{
+		fprintf(stderr, "No XBM files found.\n");
+		goto out_err;
+	}
+	if ((list->slots = calloc(list->count, sizeof(struct xbm_slot))) == NULL)
+		goto out_err;
+
+	/* Without the pipe the files are loaded on the UI thread. */
+	list->started =    prefetch && pipe2(list->pipe, O_NONBLOCK | O_CLOEXEC) == 0
+	                && pthread_create(&list->thread, NULL, prefetch_thread, list) == 0;
+	return true;
+
+out_err:
+	close_xbm_list(list);
+	return false;
+}
+
+/* Appends the file name, joined to the directory name if dir is not NULL. */
+static bool add_xbm_name(struct xbm_list *list, const char *dir, const char *name)
+{
+	char *path = NULL;
+
+	if (list->count == list->cap)
+	{
+		const int cap = list->cap > 0 ? list->cap * 2 : 64;
+		char **names = realloc(list->names, cap * sizeof(char *));
+
+		if (names == NULL)
+			return false;
+		list->names = names;
+		list->cap = cap;
+	}
+
+	if (dir == NULL)
+		path = strdup(name);
+	else if ((path = malloc(strlen(dir) + strlen(name) + 2)) != NULL)
+		sprintf(path, "%s%s%s", dir, dir[strlen(dir) - 1] == '/' ? "" : "/", name);
+	if (path == NULL)
+		return false;
+
+	list->names[list->count++] = path;
+	return true;
+}
+
+/* qsort() callback that orders file names. */
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Stops the prefetch thread and frees the bitmaps and names of the list. */
+static void close_xbm_list(struct xbm_list *list)
+{
+	int i = 0;
+
+	if (list->started)
+	{
+		pthread_mutex_lock(&list->lock);
+		list->quit = true;
+		pthread_cond_signal(&list->wake);
+		pthread_mutex_unlock(&list->lock);
+		pthread_mutex_lock(&list->progress.lock);
+		list->progress.cancel = true;
+		pthread_mutex_unlock(&list->progress.lock);
+		pthread_join(list->thread, NULL);
+	}
+	if (list->pipe[0] != -1)
+		close(list->pipe[0]);
+	if (list->pipe[1] != -1)
+		close(list->pipe[1]);
+
+	for ( ; i < list->count; i++)
+	{
+		if (list->slots != NULL)
+			unload_xbm_file(&list->slots[i].xbm);
+		free(list->names[i]);
+	}
+	free(list->slots);
+	free(list->names);
+	pthread_cond_destroy(&list->wake);
+	pthread_mutex_destroy(&list->lock);
+	pthread_mutex_destroy(&list->progress.lock);
+	memset(list, 0, sizeof(*list));
+}
+
+/* Switches to the file at index and returns its bitmap, which becomes the
+   shown one, or NULL if the file can't be loaded. If the file is not loaded
+   yet, the prefetch thread loads it before the neighbours and pending is set
+   instead, the bitmap on the screen stays until the file is loaded. A load
+   of another file is cancelled for it. Without the prefetch thread the file
+   is loaded right away. */
+static struct xbm_dat *get_xbm_list_file(struct xbm_list *list, int index, bool *pending)
+{
+	struct xbm_slot *slot = &list->slots[index];
+	struct xbm_dat *xbm = NULL;
+
+	pthread_mutex_lock(&list->lock);
+	list->current = index;
+	list->clock++;
+	pthread_cond_signal(&list->wake);
+
+	*pending = list->started && slot->xbm == NULL && !slot->failed;
+	if (*pending && list->busy != -1 && list->busy != index)
+	{
+		pthread_mutex_lock(&list->progress.lock);
+		list->progress.cancel = true;
+		pthread_mutex_unlock(&list->progress.lock);
+	}
+	else if (!list->started && slot->xbm == NULL && !slot->failed)
+	{
+		slot->loading = true;
+		pthread_mutex_unlock(&list->lock);
+		xbm = load_xbm_cached(list->names[index], list->loader, NULL);
+		pthread_mutex_lock(&list->lock);
+		store_xbm_list_file(list, index, xbm);
+	}
+	if (slot->xbm != NULL)
+	{
+		slot->used = list->clock;
+		list->shown = index;
+	}
+	xbm = slot->xbm;
+	pthread_mutex_unlock(&list->lock);
+	return xbm;
+}
+
+/* Waits at most timeout milliseconds for a key or for the prefetch thread to
+   finish the load of the current file. Returns true if the current file is
+   loaded or failed to load. */
+static bool wait_xbm_list(struct xbm_list *list, int timeout)
+{
+	struct pollfd fds[2];
+	char bytes[64];
+	bool done;
+
+	fds[0].fd = key_fd;
+	fds[1].fd = list->pipe[0];
+	fds[0].events = fds[1].events = POLLIN;
+	poll(fds, 2, timeout);
+	while (read(list->pipe[0], bytes, sizeof(bytes)) > 0)
+		;
+
+	pthread_mutex_lock(&list->lock);
+	done = list->slots[list->current].xbm != NULL || list->slots[list->current].failed;
+	pthread_mutex_unlock(&list->lock);
+	return done;
+}
+
+/* Shows the name of the file that is loading and how much of it is decoded
+   in the status line. */
+static void draw_xbm_progress(struct xbm_list *list)
+{
+	size_t done;
+	size_t total;
+
+	pthread_mutex_lock(&list->progress.lock);
+	done = list->progress.done;
+	total = list->progress.total;
+	pthread_mutex_unlock(&list->progress.lock);
+
+	if (total > 0)
+		mvprintw(2, 0, "Loading [%d/%d] %.*s %3d%%", list->current + 1, list->count, COLS - 32, list->names[list->current], (int) (done * 100 / total));
+	else
+		mvprintw(2, 0, "Loading [%d/%d] %.*s", list->current + 1, list->count, COLS - 32, list->names[list->current]);
+	clrtoeol();
+}
+
+/* Has the prefetch thread load the file at index and shows the progress
+   until it is loaded. Returns the bitmap, which stays in the list, or NULL
+   if the file can't be loaded or 'q' was pressed. Closing the list cancels
+   a load that is still running then. */
+static struct xbm_dat *await_xbm_list_file(struct xbm_list *list, int index)
+{
+	struct xbm_dat *xbm;
+	bool pending;
+	int key;
+
+	xbm = get_xbm_list_file(list, index, &pending);
+	nodelay(stdscr, TRUE);
+	while (pending && (key = getch()) != 'q' && key != 'Q')
+	{
+		if (key == ERR && wait_xbm_list(list, 1000 / STREAM_FPS))
+		{
+			xbm = get_xbm_list_file(list, index, &pending);
+			continue;
+		}
+		draw_xbm_progress(list);
+		refresh();
+	}
+	nodelay(stdscr, FALSE);
+	move(2, 0);
+	clrtoeol();
+	return xbm;
+}
+
+/* Puts a loaded bitmap into its slot and unloads the least recently used
+   bitmaps until the list is within its budget again. Tiled bitmaps count
+   with the memory budget of their tiles. The lock must be held. */
+static void store_xbm_list_file(struct xbm_list *list, int index, struct xbm_dat *xbm)
+{
+	struct xbm_slot *slot = &list->slots[index];
+
+	slot->loading = false;
+	slot->failed = xbm == NULL;
+	slot->xbm = xbm;
+	slot->used = list->clock;
+	slot->size = xbm == NULL ? 0 : xbm->tiles != NULL && xbm->len > mem_budget ? mem_budget : xbm->len;
+	list->resident += slot->size;
+	evict_xbm_list_files(list);
+}
+
+/* Counts the bitmap on the screen anew after a transform or a reload
+   replaced its data, and unloads other bitmaps if it grew beyond the
+   budget. */
+static void resize_xbm_list_file(struct xbm_list *list)
+{
+	struct xbm_slot *slot;
+
+	pthread_mutex_lock(&list->lock);
+	slot = &list->slots[list->shown];
+	list->resident -= slot->size;
+	slot->size = slot->xbm->tiles != NULL && slot->xbm->len > mem_budget ? mem_budget : slot->xbm->len;
+	list->resident += slot->size;
+	evict_xbm_list_files(list);
+	pthread_mutex_unlock(&list->lock);
+}
+
+/* Unloads the least recently used bitmaps until the list is within its
+   budget. The bitmap on the screen and the current one are kept, the ones
+   being loaded have no bitmap yet. The lock must be held. */
+static void evict_xbm_list_files(struct xbm_list *list)
+{
+	while (list->resident > list->budget)
+	{
+		struct xbm_slot *lru = NULL;
+		int i = 0;
+
+		for ( ; i < list->count; i++)
+		{
+			struct xbm_slot *s = &list->slots[i];
+
+			if (s->xbm != NULL && i != list->current && i != list->shown && (lru == NULL || s->used < lru->used))
+				lru = s;
+		}
+		if (lru == NULL)
+			break;
+		unload_xbm_file(&lru->xbm);
+		list->resident -= lru->size;
+		lru->size = 0;
+	}
+}
+
+/* Loads the file switched to, then the PREFETCH files before and after it
+   in the background, the nearest first, so that flipping through the list
+   finds them in memory. Each file is tried once for every change of the
+   current file, a file that doesn't fit into the budget isn't loaded over
+   and over. The load reports its progress for the indicator of the UI, and
+   a byte in the pipe tells the UI that the current file is loaded. A
+   cancelled load leaves the file unloaded. The thread sleeps until the
+   current file changes. */
+static void *prefetch_thread(void *arg)
+{
+	struct xbm_list *list = arg;
+	unsigned long round = 0;
+	int step = 0;
+
+	pthread_mutex_lock(&list->lock);
+	while (!list->quit)
+	{
+		struct xbm_dat *xbm;
+		bool cancel;
+		int index;
+
+		if (round != list->clock)
+		{
+			round = list->clock;
+			step = 0;
+		}
+		if (step > 2 * PREFETCH || step > list->count - 1)
+		{
+			pthread_cond_wait(&list->wake, &list->lock);
+			continue;
+		}
+
+		/* Steps 0, 1, 2, 3, 4 are the files at 0, +1, -1, +2, -2. */
+		index = list->current + (step == 0 ? 0 : step % 2 ? step / 2 + 1 : -(step / 2));
+		index = ((index % list->count) + list->count) % list->count;
+		step++;
+		if (list->slots[index].xbm != NULL || list->slots[index].loading || list->slots[index].failed)
+			continue;
+
+		list->slots[index].loading = true;
+		list->busy = index;
+		pthread_mutex_lock(&list->progress.lock);
+		list->progress.done = list->progress.total = 0;
+		list->progress.cancel = list->quit;
+		pthread_mutex_unlock(&list->progress.lock);
+		pthread_mutex_unlock(&list->lock);
+
+		xbm = load_xbm_cached(list->names[index], list->loader, &list->progress);
+
+		pthread_mutex_lock(&list->lock);
+		pthread_mutex_lock(&list->progress.lock);
+		cancel = list->progress.cancel;
+		pthread_mutex_unlock(&list->progress.lock);
+		list->busy = -1;
+		if (xbm == NULL && cancel)
+		{
+			list->slots[index].loading = false;
+			continue;
+		}
+		store_xbm_list_file(list, index, xbm);
+
+		/* A full pipe has a byte for the UI already. */
+		if (index == list->current && write(list->pipe[1], "", 1) != 1)
+			continue;
+	}
+	pthread_mutex_unlock(&list->lock);
+	return NULL;
+}
+
+/* Shows the files of the list one after the other, 'n' and 'p' move to the
+   next and previous file with wrap-around. A file that can't be loaded is
+   reported in place of its bitmap. While the file switched to loads in the
+   background, the previous bitmap stays on the screen and can be scrolled,
+   and is swapped for the new one when it is loaded. 'g' switches to the
+   grid of thumbnails and back, starting with the grid if grid is true. The
+   grid is set up when it is first shown and keeps its thumbnails until the
+   end. */
+static void browse_xbm_files(struct xbm_list *list, bool grid)
+{
+	char title[PATH_MAX + 64];
+	struct xbm_grid thumbs;
+	bool have_thumbs = false;
+	bool pending = false;
+	int index = 0;
+	int shown = 0;
+	int key = 0;
+
+	while (key != 'q' && key != ERR)
+	{
+		struct xbm_dat *xbm;
+
+		if (grid)
+		{
+			if (!have_thumbs && !(have_thumbs = open_xbm_grid(list, &thumbs)))
+				break;
+			key = show_xbm_grid(&thumbs, &index);
+			grid = key != 'g';
+			continue;
+		}
+
+		xbm = get_xbm_list_file(list, index, &pending);
+		if (pending && list->shown != -1)
+		{
+			/* The shown bitmap can't be unloaded until the swap. */
+			shown = list->shown;
+			xbm = list->slots[shown].xbm;
+		}
+		else
+		{
+			shown = index;
+		}
+
+		if (pending && xbm == NULL)
+		{
+			/* Nothing is shown yet, only the progress. */
+			move(2, 0);
+			clrtobot();
+			nodelay(stdscr, TRUE);
+			while ((key = getch()) != 'q' && key != 'Q' && key != 'n' && key != 'p' && key != 'g' && key != KEY_NPAGE && key != KEY_PPAGE)
+			{
+				if (key == ERR && wait_xbm_list(list, 1000 / STREAM_FPS))
+					break;
+				draw_xbm_progress(list);
+				refresh();
+			}
+			nodelay(stdscr, FALSE);
+			key = key == 'Q' ? 'q' : key == KEY_NPAGE ? 'n' : key == KEY_PPAGE ? 'p' : key == ERR ? 0 : key;
+		}
+		else if (xbm != NULL)
+		{
+			struct xbm_watch watch;
+			const bool watching = open_xbm_watch(list->names[shown], list->loader, &watch);
+
+			snprintf(title, sizeof(title), "[%d/%d] %s (%dx%d)", shown + 1, list->count, list->names[shown], xbm->width, xbm->height);
+			key = render_xbm_file(xbm, NULL, watching ? &watch : NULL, list, title);
+			if (watching)
+				close_xbm_watch(&watch);
+		}
+		else
+		{
+			move(2, 0);
+			clrtobot();
+			mvprintw(3, 0, "[%d/%d] %.*s", index + 1, list->count, COLS - 16, list->names[index]);
+			mvaddstr(4, 0, "Error: can't load the XBM file.");
+			refresh();
+			while ((key = getch()) != 'q' && key != 'Q' && key != 'n' && key != 'p' && key != 'g' && key != KEY_NPAGE && key != KEY_PPAGE && key != ERR)
+				;
+			key = key == 'Q' ? 'q' : key == KEY_NPAGE ? 'n' : key == KEY_PPAGE ? 'p' : key;
+		}
+
+		if (key == 'n')
+			index = (index + 1) % list->count;
+		else if (key == 'p')
+			index = (index + list->count - 1) % list->count;
+		else if (key == 'g')
+			grid = true;
+	}
+	if (have_thumbs)
+		close_xbm_grid(&thumbs);
+}
+
+/* Starts the threads that make the thumbnails of the files in the list. */
+static bool open_xbm_grid(struct xbm_list *list, struct xbm_grid *grid)
+{
+	memset(grid, 0, sizeof(*grid));
+	grid->list = list;
+	if (   (grid->thumbs = calloc(list->count, sizeof(struct xbm_dat *))) == NULL
+	    || (grid->state = calloc(list->count, 1)) == NULL)
+	{
+		free(grid->thumbs);
+		return false;
+	}
+	pthread_mutex_init(&grid->lock, NULL);
+	pthread_cond_init(&grid->wake, NULL);
+
+	for ( ; grid->threads < parse_threads; grid->threads++)
+	{
+		if (pthread_create(&grid->thread[grid->threads], NULL, thumb_thread, grid) != 0)
+			break;
+	}
+	if (grid->threads == 0)
+	{
+		close_xbm_grid(grid);
+		return false;
+	}
+	return true;
+}
+
+/* Stops the threads and frees the thumbnails. */
+static void close_xbm_grid(struct xbm_grid *grid)
+{
+	int i = 0;
+
+	pthread_mutex_lock(&grid->lock);
+	grid->quit = true;
+	pthread_cond_broadcast(&grid->wake);
+	pthread_mutex_unlock(&grid->lock);
+	for ( ; i < grid->threads; i++)
+		pthread_join(grid->thread[i], NULL);
+
+	for (i = 0; i < grid->list->count; i++)
+		unload_xbm_file(&grid->thumbs[i]);
+	free(grid->thumbs);
+	free(grid->state);
+	pthread_cond_destroy(&grid->wake);
+	pthread_mutex_destroy(&grid->lock);
+	memset(grid, 0, sizeof(*grid));
+}
+
+/* Makes the thumbnails of the wanted files, the one with the lowest index
+   first, which is the top left of the visible part of the grid. The threads
+   sleep until the grid is scrolled to files without a thumbnail. */
+static void *thumb_thread(void *arg)
+{
+	struct xbm_grid *grid = arg;
+
+	pthread_mutex_lock(&grid->lock);
+	while (!grid->quit)
+	{
+		struct xbm_dat *xbm;
+		int index = grid->first;
+
+		while (index < grid->last && grid->state[index] != THUMB_NONE)
+			index++;
+		if (index >= grid->last)
+		{
+			pthread_cond_wait(&grid->wake, &grid->lock);
+			continue;
+		}
+
+		grid->state[index] = THUMB_BUSY;
+		pthread_mutex_unlock(&grid->lock);
+		if ((xbm = load_xbm_cached(grid->list->names[index], grid->list->loader, NULL)) != NULL)
+			xbm = thumb_xbm(xbm, 2 * THUMB_COLS, 4 * THUMB_ROWS);
+		pthread_mutex_lock(&grid->lock);
+
+		grid->thumbs[index] = xbm;
+		grid->state[index] = xbm != NULL ? THUMB_DONE : THUMB_FAILED;
+		grid->done++;
+	}
+	pthread_mutex_unlock(&grid->lock);
+	return NULL;
+}
+
+/* Halves the bitmap with halve_xbm() until it fits into width x height
+   pixels. The bitmap and the intermediate levels are freed, only the last
+   level is returned, or NULL if a level can't be made. */
+static struct xbm_dat *thumb_xbm(struct xbm_dat *xbm, int width, int height)
+{
+	while (xbm != NULL && (xbm->width > width || xbm->height > height))
+	{
+		struct xbm_dat *half = halve_xbm(xbm);
+
+		unload_xbm_file(&xbm);
+		xbm = half;
+	}
+	return xbm;
+}
+
+/* Shows the grid of thumbnails, starting with the file at *index selected.
+   The arrow keys and PageUp/PageDown move the selection, the grid scrolls by
+   whole rows of thumbnails to keep it visible. The thumbnails of the visible
+   rows and of one screen below are wanted from the threads, the screen is
+   refreshed STREAM_FPS times a second while visible ones are missing. Returns
+   'g' to show the selected file, 'q' to quit, or ERR on errors. *index is set
+   to the selected file. */
+static int show_xbm_grid(struct xbm_grid *grid, int *index)
+{
+	const int count = grid->list->count;
+	const int y0 = 4;
+	const int per_row = COLS / (THUMB_COLS + 1) > 0 ? COLS / (THUMB_COLS + 1) : 1;
+	const int rows = (LINES - y0) / (THUMB_ROWS + 1);
+	int selected = *index;
+	int top = -1;
+	int shown = -1;
+	int done = -1;
+	int key = 0;
+	WINDOW *pad = NULL;
+
+	if (rows < 1 || (pad = newpad(LINES - y0, COLS)) == NULL)
+		return ERR;
+
+	move(2, 0);
+	clrtobot();
+	refresh();
+
+	while (true)
+	{
+		bool missing = false;
+		int i;
+
+		/* Scroll to the row of the selected file. */
+		if (top < 0 || selected / per_row < top)
+			top = selected / per_row;
+		else if (selected / per_row >= top + rows)
+			top = selected / per_row - rows + 1;
+
+		pthread_mutex_lock(&grid->lock);
+		if (grid->first != top * per_row || grid->last == 0)
+		{
+			grid->first = top * per_row;
+			grid->last = (top + 2 * rows) * per_row < count ? (top + 2 * rows) * per_row : count;
+			pthread_cond_broadcast(&grid->wake);
+		}
+		for (i = grid->first; i < (top + rows) * per_row && i < count; i++)
+			missing = missing || grid->state[i] == THUMB_NONE || grid->state[i] == THUMB_BUSY;
+		if (grid->done != done || selected != shown)
+		{
+			done = grid->done;
+			shown = selected;
+			draw_xbm_grid(pad, grid, top * per_row, rows * per_row, selected);
+		}
+		pthread_mutex_unlock(&grid->lock);
+
+		mvprintw(3, 0, "[%d/%d] %.*s", selected + 1, count, COLS - 16, grid->list->names[selected]);
+		clrtoeol();
+		refresh();
+		if (prefresh(pad, 0, 0, y0, 0, LINES - 1, COLS - 1) == ERR)
+		{
+			key = ERR;
+			break;
+		}
+
+		timeout(missing ? 1000 / STREAM_FPS : -1);
+		if ((key = getch()) == ERR)
+		{
+			if (missing)
+				continue;
+			break;
+		}
+
+		if (key == KEY_RIGHT && selected + 1 < count)
+			selected++;
+		else if (key == KEY_LEFT && selected > 0)
+			selected--;
+		else if (key == KEY_DOWN || key == KEY_NPAGE)
+			selected += key == KEY_DOWN ? per_row : per_row * rows;
+		else if (key == KEY_UP || key == KEY_PPAGE)
+			selected -= key == KEY_UP ? per_row : per_row * rows;
+		else if (key == 'm' && utf8_locale)
+		{
+			pad_mode = (pad_mode + 1) % MODE_COUNT;
+			shown = -1;
+		}
+		else if (key == 'Q' || key == 'q')
+			break;
+		else if (key == 'g' || key == '\r' || key == '\n' || key == KEY_ENTER)
+		{
+			key = 'g';
+			break;
+		}
+		selected = selected < 0 ? 0 : selected >= count ? count - 1 : selected;
+	}
+	timeout(-1);
+	delwin(pad);
+	*index = selected;
+	return key == 'Q' ? 'q' : key;
+}
+
+/* Draws count thumbnails from the file at first on into the pad, with the
+   file name below each. The thumbnail is drawn at the zoom level that fits
+   into THUMB_COLS x THUMB_ROWS cells in the current mode, into a sub pad so
+   that set_pad_view() clips it. The lock must be held. */
+static void draw_xbm_grid(WINDOW *pad, struct xbm_grid *grid, int first, int count, int selected)
+{
+	const int per_row = getmaxx(pad) / (THUMB_COLS + 1) > 0 ? getmaxx(pad) / (THUMB_COLS + 1) : 1;
+	const int cw = mode_width[pad_mode];
+	const int ch = mode_height[pad_mode];
+	int i = 0;
+
+	werase(pad);
+	for ( ; i < count && first + i < grid->list->count; i++)
+	{
+		const int index = first + i;
+		const int row = i / per_row * (THUMB_ROWS + 1);
+		const int col = i % per_row * (THUMB_COLS + 1);
+		const char *name = strrchr(grid->list->names[index], '/');
+		struct xbm_dat *xbm = grid->thumbs[index];
+		WINDOW *sub;
+
+		while (xbm != NULL && (xbm->width > THUMB_COLS * cw || xbm->height > THUMB_ROWS * ch))
+			xbm = zoom_xbm(xbm, 1);
+
+		if (grid->state[index] == THUMB_FAILED)
+			mvwaddstr(pad, row, col, "(error)");
+		else if (xbm == NULL)
+			mvwaddstr(pad, row, col, "...");
+		else if ((sub = subpad(pad, (xbm->height + ch - 1) / ch, (xbm->width + cw - 1) / cw, row, col)) != NULL)
+		{
+			set_pad_view(sub, xbm, 0, 0);
+			delwin(sub);
+		}
+
+		if (index == selected)
+			wattron(pad, A_REVERSE);
+		mvwaddnstr(pad, row + THUMB_ROWS, col, name != NULL ? name + 1 : grid->list->names[index], THUMB_COLS);
+		wattroff(pad, A_REVERSE);
+	}
+}
+
+/* Writes the files of the list to stdout one after the other. "-" reads
+   stdin, the bitmap is named stdin then. */
+static bool dump_xbm_files(struct xbm_list *list)
+{
+	bool ret = true;
+	int i = 0;
+
+	for ( ; i < list->count; i++)
+	{
+		struct xbm_dat *xbm = load_xbm_cached(list->names[i], list->loader, NULL);
+		size_t bytes = 0;
+
+		if (xbm == NULL)
+		{
+			fprintf(stderr, "%s: can't load the XBM file\n", list->names[i]);
+			ret = false;
+			continue;
+		}
+		ret = dump_xbm_file(xbm, strcmp(list->names[i], "-") ? list->names[i] : "stdin", stdout, &bytes) && ret;
+		unload_xbm_file(&xbm);
+	}
+	return fflush(stdout) == 0 && ret;
+}
+
+/* Converts the files of the list on parse_threads threads into text, XBM or
+   PBM files in dir, named like the input file with the suffix .txt, .xbm or
+   .pbm. Prints the number of files per second and the bytes written. */
+static bool batch_xbm_files(struct xbm_list *list, const char *dir)
+{
+	pthread_t threads[MAX_THREADS];
+	struct xbm_batch batch;
+	struct timespec start;
+	double ms;
+	int count = 0;
+	int i = 0;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.list = list;
+	batch.dir = dir;
+	pthread_mutex_init(&batch.lock, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for ( ; count < parse_threads && count < list->count; count++)
+	{
+		if (pthread_create(&threads[count], NULL, batch_thread, &batch) != 0)
+			break;
+	}
+	if (count == 0)
+		batch_thread(&batch);
+	for ( ; i < count; i++)
+		pthread_join(threads[i], NULL);
+	ms = elapsed_ms(&start);
+	pthread_mutex_destroy(&batch.lock);
+
+	printf("%d files, %d failed, %.1f ms, %.1f files/s, %zu bytes written\n",
+	       batch.written, batch.failed, ms, ms > 0.0 ? batch.written * 1000.0 / ms : 0.0, batch.bytes);
+	return batch.failed == 0;
+}
+
+/* Converts the next file of the batch until all are taken. */
+static void *batch_thread(void *arg)
+{
+	struct xbm_batch *batch = arg;
+	char path[PATH_MAX];
+
+	while (true)
+	{
+		const char *suffix = dump_format == DUMP_XBM ? "xbm" : dump_format == DUMP_PBM ? "pbm" : "txt";
+		struct xbm_dat *xbm = NULL;
+		FILE *out = NULL;
+		const char *name;
+		const char *dot;
+		size_t bytes = 0;
+		size_t ext;
+		bool ok = false;
+		int index;
+
+		pthread_mutex_lock(&batch->lock);
+		index = batch->next < batch->list->count ? batch->next++ : -1;
+		pthread_mutex_unlock(&batch->lock);
+		if (index < 0)
+			break;
+
+		name = strrchr(batch->list->names[index], '/');
+		name = name != NULL ? name + 1 : !strcmp(batch->list->names[index], "-") ? "stdin" : batch->list->names[index];
+		dot = xbm_file_kind(name, NULL, &ext) ? name + strlen(name) - ext : strrchr(name, '.');
+		if (   (xbm = load_xbm_cached(batch->list->names[index], batch->list->loader, NULL)) != NULL
+		    && snprintf(path, sizeof(path), "%s/%.*s.%s", batch->dir, (int) (dot != NULL ? (size_t) (dot - name) : strlen(name)), name, suffix) < (int) sizeof(path)
+		    && (out = fopen(path, "w")) != NULL)
+		{
+			setvbuf(out, NULL, _IOFBF, READ_CHUNK);
+			ok = dump_xbm_file(xbm, name, out, &bytes);
+			ok = fclose(out) == 0 && ok;
+		}
+		if (!ok)
+			fprintf(stderr, "%s: conversion failed\n", batch->list->names[index]);
+		unload_xbm_file(&xbm);
+
+		pthread_mutex_lock(&batch->lock);
+		batch->written += ok;
+		batch->failed += !ok;
+		batch->bytes += bytes;
+		pthread_mutex_unlock(&batch->lock);
+	}
+	return NULL;
+}
+
+/* Writes the bitmap as text in the current mode, one line per row of cells.
+   The cells are mapped from the rows with row_glyphs() like in the pad. The
+   cell mode writes '#' for a set pixel, or with DUMP_ANSI the checkerboard
+   of the DEC special graphics set that the viewer shows. The half block and
+   braille modes write the glyphs in UTF-8. DUMP_XBM and DUMP_PBM write the
+   bitmap as a XBM file named after name or as a binary PBM file instead. The
+   number of bytes written is added to bytes. */
+static bool dump_xbm_file(struct xbm_dat *xbm, const char *name, FILE *out, size_t *bytes)
+{
+	static const char *halves[4] = { " ", "\xe2\x96\x80", "\xe2\x96\x84", "\xe2\x96\x88" };
+	const int cw = mode_width[pad_mode];
+	const int ch = mode_height[pad_mode];
+	const int cols = (xbm->width + cw - 1) / cw;
+	const bool ansi = dump_format == DUMP_ANSI && pad_mode == MODE_CELL;
+	const char set = ansi ? 'a' : '#';
+	unsigned char codes[EXPAND_CHUNK];
+	char line[3 * EXPAND_CHUNK];
+	int y = 0;
+
+	if (dump_format == DUMP_XBM)
+		return write_xbm_file(xbm, name, out, bytes);
+	if (dump_format == DUMP_PBM)
+		return write_pbm_file(xbm, out, bytes);
+
+	for ( ; y < xbm->height; y += ch)
+	{
+		const unsigned char *bits[4] = { NULL, NULL, NULL, NULL };
+		int col = 0;
+		int i = 0;
+
+		for ( ; i < ch && y + i < xbm->height; i++)
+			bits[i] = xbm_row(xbm, y + i);
+
+		if (ansi)
+			*bytes += fwrite("\033(0", 1, 3, out);
+		for ( ; col < cols; col += EXPAND_CHUNK)
+		{
+			const int n = cols - col < EXPAND_CHUNK ? cols - col : EXPAND_CHUNK;
+			size_t len = 0;
+
+			row_glyphs(bits, col * cw, n, xbm->width, codes);
+			if (pad_mode == MODE_CELL)
+			{
+				for (i = 0; i < n; i++)
+					line[len++] = codes[i] ? set : ' ';
+			}
+			else if (pad_mode == MODE_HALF)
+			{
+				for (i = 0; i < n; i++)
+				{
+					const size_t l = codes[i] ? 3 : 1;
+					memcpy(line + len, halves[codes[i]], l);
+					len += l;
+				}
+			}
+			else
+			{
+				for (i = 0; i < n; i++)
+				{
+					line[len++] = (char) 0xe2;
+					line[len++] = (char) (0xa0 | (codes[i] >> 6));
+					line[len++] = (char) (0x80 | (codes[i] & 0x3f));
+				}
+			}
+			*bytes += fwrite(line, 1, len, out);
+		}
+		if (ansi)
+			*bytes += fwrite("\033(B", 1, 3, out);
+		*bytes += fwrite("\n", 1, 1, out);
+	}
+	return !ferror(out);
+}
+
+/* Writes the bitmap as a XBM file with the layout of XWriteBitmapFile(), 12
+   literals per line. The literals are copied from a table of the 256 byte
+   values formatted as "0xNN, " into a buffer of WRITE_CHUNK bytes that is
+   written out whole. The unused bits at the end of each row are cleared.
+   The names of the defines and the array are made from name. */
+static bool write_xbm_file(struct xbm_dat *xbm, const char *name, FILE *out, size_t *bytes)
+{
+	const char *hex = "0123456789abcdef";
+	const unsigned char tail = (xbm->width & 7) ? (1 << (xbm->width & 7)) - 1 : 0xff;
+	char literals[256][6];
+	char id[64];
+	char *buf = NULL;
+	size_t len = 0;
+	size_t count = 0;
+	int y = 0;
+	int i = 0;
+
+	for ( ; i < 256; i++)
+	{
+		literals[i][0] = '0';
+		literals[i][1] = 'x';
+		literals[i][2] = hex[i >> 4];
+		literals[i][3] = hex[i & 15];
+		literals[i][4] = ',';
+		literals[i][5] = ' ';
+	}
+
+	if ((buf = malloc(WRITE_CHUNK)) == NULL)
+		return false;
+
+	xbm_identifier(name, id, sizeof(id));
+	len = (size_t) sprintf(buf, "#define %s_width %d\n#define %s_height %d\nstatic unsigned char %s_bits[] = {",
+	                       id, xbm->width, id, xbm->height, id);
+
+	for ( ; y < xbm->height; y++)
+	{
+		const unsigned char *row = xbm_row(xbm, y);
+		size_t x = 0;
+
+		if (row == NULL)
+		{
+			free_mem(&buf, WRITE_CHUNK, WIPE_TEXT);
+			return false;
+		}
+		for ( ; x < xbm->stride; x++, count++)
+		{
+			/* Room for a line break, a literal and the byte that the
+			   closing brace adds after the last one. */
+			if (len + 11 > WRITE_CHUNK)
+			{
+				*bytes += fwrite(buf, 1, len, out);
+				len = 0;
+			}
+			if (count % 12 == 0)
+			{
+				memcpy(buf + len, "\n   ", 4);
+				len += 4;
+			}
+			memcpy(buf + len, literals[x + 1 < xbm->stride ? row[x] : row[x] & tail], 6);
+			len += 6;
+		}
+	}
+
+	/* The last literal is followed by the closing brace instead of ", ". */
+	memcpy(buf + len - 2, "};\n", 3);
+	*bytes += fwrite(buf, 1, len + 1, out);
+	free_mem(&buf, WRITE_CHUNK, WIPE_TEXT);
+	return !ferror(out);
+}
+
+/* Writes the bitmap as a binary PBM file. The rows are bit-reversed into a
+   buffer of WRITE_CHUNK bytes that is written out whole, the unused bits at
+   the end of each row are cleared. */
+static bool write_pbm_file(struct xbm_dat *xbm, FILE *out, size_t *bytes)
+{
+	const unsigned char tail = (xbm->width & 7) ? 0xff << (8 - (xbm->width & 7)) : 0xff;
+	char *buf = NULL;
+	size_t len = 0;
+	int y = 0;
+
+	if ((buf = malloc(WRITE_CHUNK)) == NULL)
+		return false;
+
+	len = (size_t) sprintf(buf, "P4\n%d %d\n", xbm->width, xbm->height);
+	for ( ; y < xbm->height; y++)
+	{
+		const unsigned char *row = xbm_row(xbm, y);
+
+		if (row == NULL)
+		{
+			free_mem(&buf, WRITE_CHUNK, WIPE_TEXT);
+			return false;
+		}
+		if (len + xbm->stride > WRITE_CHUNK)
+		{
+			*bytes += fwrite(buf, 1, len, out);
+			len = 0;
+		}
+		reverse_bits(row, (unsigned char *) buf + len, xbm->stride);
+		len += xbm->stride;
+		buf[len - 1] &= tail;
+	}
+
+	*bytes += fwrite(buf, 1, len, out);
+	free_mem(&buf, WRITE_CHUNK, WIPE_TEXT);
+	return !ferror(out);
+}
+
+/* Makes a C identifier of at most size - 1 characters from the file name
+   without directory and suffix, .xbm.gz counting as one, for the names in a XBM file. */
+static void xbm_identifier(const char *name, char *id, size_t size)
+{
+	const char *base = strrchr(name, '/');
+	const char *dot = NULL;
+	size_t suffix;
+	size_t i = 0;
+
+	base = base != NULL ? base + 1 : name;
+	dot = xbm_file_kind(base, NULL, &suffix) ? base + strlen(base) - suffix : strrchr(base, '.');
+	if (isdigit((unsigned char) *base) || *base == '\0' || dot == base)
+		id[i++] = '_';
+	for ( ; i + 1 < size && *base != '\0' && base != dot; base++)
+		id[i++] = isalnum((unsigned char) *base) ? *base : '_';
+	id[i] = '\0';
+}
+
+/* Reads a XBM bitmap file and returns an object containing it's data and attributes. */
+static struct xbm_dat* load_xbm_file(const char *filename, enum xbm_loader loader)
+{
+	return decode_xbm_file(filename, loader, NULL);
+}
+
+/* Reads a XBM bitmap file like load_xbm_file() and reports the progress of
+   the decode if progress is not NULL. Compressed files are decompressed and
+   decoded block by block, like stdin, which is named "-". */
+static struct xbm_dat* decode_xbm_file(const char *filename, enum xbm_loader loader, struct xbm_progress *progress)
+{
+	struct xbm_src src;
+	struct xbm_dat *xbm = NULL;
+	enum xbm_kind kind;
+
+	if (   filename != NULL
+	    && (!strcmp(filename, "-") || (xbm_file_kind(filename, &kind, NULL) && (kind == KIND_GZIP || kind == KIND_ZSTD))))
+		return load_xbm_stream(filename, progress);
+	if (open_xbm_source(filename, loader, &src))
+	{
+		src.progress = progress;
+		xbm = parse_xbm_source(&src);
+		close_xbm_source(&src);
+	}
+	return xbm;
+}
+
+/* Reports that done of total units are decoded. Returns false if the load is
+   cancelled. Without progress the load always goes on. */
+static bool set_progress(struct xbm_progress *progress, size_t done, size_t total)
+{
+	bool cancel;
+
+	if (progress == NULL)
+		return true;
+	pthread_mutex_lock(&progress->lock);
+	progress->done = done;
+	progress->total = total;
+	cancel = progress->cancel;
+	pthread_mutex_unlock(&progress->lock);
+	return !cancel;
+}
+
+/* Adds done units to the ones decoded, for loads that run on several
+   threads. Returns false if the load is cancelled. */
+static bool add_progress(struct xbm_progress *progress, size_t done)
+{
+	bool cancel;
+
+	if (progress == NULL)
+		return true;
+	pthread_mutex_lock(&progress->lock);
+	progress->done += done;
+	cancel = progress->cancel;
+	pthread_mutex_unlock(&progress->lock);
+	return !cancel;
+}
+
+/* Loads the bitmap from the cache file if it is enabled and still valid.
+   Otherwise the XBM file is parsed and the cache is written for the next
+   time. Failing to write the cache is not an error. The parse is reported
+   to progress if it is not NULL. */
+static struct xbm_dat* load_xbm_cached(const char *filename, enum xbm_loader loader, struct xbm_progress *progress)
+{
+	struct xbm_dat *xbm = NULL;
+	struct stat sb;
+
+	if (!use_cache || stat(filename, &sb) == -1 || !S_ISREG(sb.st_mode))
+		return decode_xbm_file(filename, loader, progress);
+
+	if ((xbm = load_xbm_cache(filename, &sb)) == NULL && (xbm = decode_xbm_file(filename, loader, progress)) != NULL)
+		save_xbm_cache(filename, &sb, xbm);
+	return xbm;
+}
+
+/* Maps a valid cache file of the XBM file. The mapping is private and
+   writable, changes to the bitmap stay in memory. The rows are hashed once
+   before the mapping is trusted, so a cache file that was damaged after it
+   was written is parsed again instead of being shown. */
+static struct xbm_dat* load_xbm_cache(const char *filename, const struct stat *sb)
+{
+	struct xbmc_header hdr;
+	struct xbm_dat *xbm = NULL;
+	char path[PATH_MAX];
+	int where = 0;
+
+	for ( ; where < 2 && xbm == NULL; where++)
+	{
+		struct stat cb;
+		uint64_t hash;
+		uint64_t y;
+		void *addr;
+		size_t len;
+		int fd;
+
+		if (!xbm_cache_path(filename, where == 0, path, sizeof(path)) || (fd = open(path, O_RDONLY)) == -1)
+			continue;
+
+		if (   fstat(fd, &cb) == -1
+		    || pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr)
+		    || memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic))
+		    || hdr.version != CACHE_VERSION
+		    || hdr.checksum != xbm_cache_checksum(&hdr)
+		    || hdr.mtime_sec != (int64_t) sb->st_mtim.tv_sec
+		    || hdr.mtime_nsec != (int64_t) sb->st_mtim.tv_nsec
+		    || hdr.size != (uint64_t) sb->st_size
+		    || hdr.width < MIN_WIDTH || hdr.width > MAX_WIDTH
+		    || hdr.height < MIN_HEIGHT || hdr.height > MAX_HEIGHT
+		    || hdr.stride != (hdr.width + 7) / 8
+		    || (uint64_t) cb.st_size != sizeof(hdr) + hdr.height * hdr.stride
+		    || (xbm = calloc(sizeof(struct xbm_dat), 1)) == NULL)
+		{
+			close(fd);
+			continue;
+		}
+
+		len = sizeof(hdr) + hdr.height * hdr.stride;
+		addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | (len <= MAX_POPULATE ? MAP_POPULATE : 0), fd, 0);
+		close(fd);
+		if (addr == MAP_FAILED)
+		{
+			free_mem((char **) &xbm, sizeof(*xbm), WIPE_OBJECT);
+			continue;
+		}
+
+		hash = XBM_HASH_INIT;
+		for (y = 0; y < hdr.height; y++)
+			hash = hash_xbm_row(hash, (unsigned char *) addr + sizeof(hdr) + y * hdr.stride, hdr.stride);
+		if (hash != hdr.rows_hash)
+		{
+			munmap(addr, len);
+			free_mem((char **) &xbm, sizeof(*xbm), WIPE_OBJECT);
+			continue;
+		}
+
+		xbm->width = (int) hdr.width;
+		xbm->height = (int) hdr.height;
+		xbm->stride = hdr.stride;
+		xbm->len = hdr.height * hdr.stride;
+		xbm->map = addr;
+		xbm->map_size = len;
+		xbm->data = (unsigned char *) addr + sizeof(hdr);
+	}
+	return xbm;
+}
+
+/* Writes the cache file next to the XBM file, or under the cache directory if
+   that fails. The file is written under a temporary name and renamed, so a
+   concurrent reader never sees a partial cache file. The rows of bitmaps in
+   tiles are written tile by tile. The rows are hashed while they are
+   written and the header is written again with the hash at the end. */
+static bool save_xbm_cache(const char *filename, const struct stat *sb, struct xbm_dat *xbm)
+{
+	struct xbmc_header hdr;
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + 32];
+	int where = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CACHE_VERSION;
+	hdr.width = (uint32_t) xbm->width;
+	hdr.height = (uint32_t) xbm->height;
+	hdr.stride = xbm->stride;
+	hdr.mtime_sec = (int64_t) sb->st_mtim.tv_sec;
+	hdr.mtime_nsec = (int64_t) sb->st_mtim.tv_nsec;
+	hdr.size = (uint64_t) sb->st_size;
+
+	for ( ; where < 2; where++)
+	{
+		FILE *fp = NULL;
+		bool ok = true;
+		int y = 0;
+
+		if (   !xbm_cache_path(filename, where == 0, path, sizeof(path))
+		    || snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long) getpid()) >= (int) sizeof(tmp)
+		    || (fp = fopen(tmp, "wb")) == NULL)
+			continue;
+
+		hdr.rows_hash = XBM_HASH_INIT;
+		ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+		for ( ; ok && y < xbm->height; y++)
+		{
+			const unsigned char *row = xbm_row(xbm, y);
+
+			ok = row != NULL && fwrite(row, 1, xbm->stride, fp) == xbm->stride;
+			if (ok)
+				hdr.rows_hash = hash_xbm_row(hdr.rows_hash, row, xbm->stride);
+		}
+		hdr.checksum = xbm_cache_checksum(&hdr);
+		ok = ok && fseek(fp, 0L, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+
+		if (fclose(fp) == 0 && ok && rename(tmp, path) == 0)
+			return true;
+		unlink(tmp);
+	}
+	return false;
+}
+
+/* Builds the path of the cache file. Next to the XBM file, the cache appends
+   .xbmc to the whole name, so foo.xbm, foo.pbm and foo.xbm.gz have their own
+   cache. In the cache directory, $XDG_CACHE_HOME/xbmview or ~/.cache/xbmview,
+   the name is the absolute path of the XBM file with each '/' replaced by
+   '%'. The cache directory is created if necessary. */
+static bool xbm_cache_path(const char *filename, bool next_to_file, char *path, size_t size)
+{
+	const char *base = getenv("XDG_CACHE_HOME");
+	char dir[PATH_MAX];
+	char real[PATH_MAX];
+	char *p;
+	int n;
+
+	if (next_to_file)
+		return snprintf(path, size, "%s.xbmc", filename) < (int) size;
+
+	if (realpath(filename, real) == NULL)
+		return false;
+	for (p = real; (p = strchr(p, '/')) != NULL; p++)
+		*p = '%';
+
+	if (base != NULL && base[0] == '/')
+		n = snprintf(dir, sizeof(dir), "%s", base);
+	else if ((base = getenv("HOME")) != NULL)
+		n = snprintf(dir, sizeof(dir), "%s/.cache", base);
+	else
+		return false;
+
+	if (n >= (int) sizeof(dir))
+		return false;
+	mkdir(dir, 0700);
+	if ((n = snprintf(path, size, "%s/xbmview", dir)) >= (int) size || (mkdir(path, 0700) == -1 && errno != EEXIST))
+		return false;
+
+	return snprintf(path + n, size - (size_t) n, "/%s.xbmc", real) < (int) (size - (size_t) n);
+}
+
+/* FNV-1a hash over the cache header fields in front of the checksum. */
+static uint64_t xbm_cache_checksum(const struct xbmc_header *hdr)
+{
+	const unsigned char *p = (const unsigned char *) hdr;
+	const unsigned char *end = (const unsigned char *) &hdr->checksum;
+	uint64_t hash = XBM_HASH_INIT;
+
+	for ( ; p < end; p++)
+		hash = (hash ^ *p) * 1099511628211ULL;
+	return hash;
+}
+
+/* Adds a row of n bytes to the hash of the rows before it. The bytes are
+   taken 8 at a time, each word is mixed in like FNV-1a does with a byte
+   and the high half is folded down, so every bit of the word affects the
+   hash. The bytes of a partial word follow one by one. */
+static uint64_t hash_xbm_row(uint64_t hash, const unsigned char *row, size_t n)
+{
+	size_t i = 0;
+
+	for ( ; i + 8 <= n; i += 8)
+	{
+		uint64_t word;
+
+		memcpy(&word, row + i, sizeof(word));
+		hash = (hash ^ word) * 1099511628211ULL;
+		hash ^= hash >> 32;
+	}
+	for ( ; i < n; i++)
+		hash = (hash ^ row[i]) * 1099511628211ULL;
+	return hash;
+}
+
+/* Makes the text of the XBM or PBM file accessible in memory. Regular files are mapped
+   unless the read loader is requested. Pipes and other files that can't be
+   mapped always fall back to reading the file into a buffer. */
+static bool open_xbm_source(const char *filename, enum xbm_loader loader, struct xbm_src *src)
+{
+	struct stat sb;
+	enum xbm_kind kind;
+	int fd = -1;
+	bool ret = false;
+
+	memset(src, 0, sizeof(*src));
+
+	if (   filename == NULL
+	    || !xbm_file_kind(filename, &kind, NULL)
+		|| (kind != KIND_XBM && kind != KIND_PBM)
+		|| (fd = open(filename, O_RDONLY)) == -1
+		|| fstat(fd, &sb) == -1
+		|| S_ISDIR(sb.st_mode))
+	{
+		goto out;
+	}
+
+	if (S_ISREG(sb.st_mode))
+	{
+		if (sb.st_size <= 0 || (loader == LOADER_READ && sb.st_size > MAX_READSIZE))
+			goto out;
+		if (loader == LOADER_MMAP && map_xbm_source(fd, (size_t) sb.st_size, src))
+		{
+			ret = true;
+			goto out;
+		}
+	}
+
+	ret = read_xbm_source(fd, src);
+
+out:
+	if (fd != -1)
+		close(fd);
+	return ret;
+}
+
+/* Maps the file read-only into memory. The pages are populated up front and
+   the kernel is told that the parser walks through them sequentially. Huge
+   files are not populated, their pages are faulted in while parsing. */
+static bool map_xbm_source(int fd, size_t size, struct xbm_src *src)
+{
+	void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE | (size <= MAX_POPULATE ? MAP_POPULATE : 0), fd, 0);
+
+	if (addr == MAP_FAILED)
+		return false;
+
+	madvise(addr, size, MADV_SEQUENTIAL);
+	src->buf = addr;
+	src->size = size;
+	src->cap = 0;
+	src->mapped = true;
+	return true;
+}
+
+/* Reads the file into a buffer until end of file. The size is not known in
+   advance when reading from a pipe, so the buffer doubles as needed. */
+static bool read_xbm_source(int fd, struct xbm_src *src)
+{
+	ssize_t n = 0;
+
+	do
+	{
+		src->size += (size_t) n;
+		if (src->size > MAX_READSIZE)
+			goto out_err;
+		if (src->cap - src->size < READ_CHUNK)
+		{
+			size_t cap = src->cap > 0 ? 2 * src->cap : READ_CHUNK;
+			char *buf = calloc(cap, 1);
+
+			if (buf == NULL)
+				goto out_err;
+			if (src->buf != NULL)
+			{
+				memcpy(buf, src->buf, src->size);
+				free_mem(&src->buf, src->cap, WIPE_TEXT);
+			}
+			src->buf = buf;
+			src->cap = cap;
+		}
+	} while ((n = read(fd, src->buf + src->size, src->cap - src->size)) > 0);
+
+	if (n == -1 || src->size == 0)
+		goto out_err;
+	return true;
+
+out_err:
+	close_xbm_source(src);
+	return false;
+}
+
+/* Releases the file text. */
+static void close_xbm_source(struct xbm_src *src)
+{
+	if (src->mapped)
+		munmap(src->buf, src->size);
+	else if (src->buf != NULL)
+		free_mem(&src->buf, src->cap, WIPE_TEXT);
+	memset(src, 0, sizeof(*src));
+}
+
+/* Parses the text of a XBM file. The text is not null-terminated when it is
+   mapped, so the parser never reads beyond src->size. A binary PBM file, which
+   starts with "P4", holds the packed rows with the most significant bit first,
+   they only need the bits of each byte reversed. Bitmaps larger than the
+   memory budget are put into a tile store, which takes over the source. */
+static struct xbm_dat* parse_xbm_source(struct xbm_src *src)
+{
+	struct xbm_dat *xbm = NULL;
+	struct hex_tok tok;
+	const bool pbm = src->size >= 2 && !memcmp(src->buf, "P4", 2);
+
+	if ((xbm = calloc(sizeof(struct xbm_dat), 1)) == NULL)
+		goto out_err;
+
+	memset(&tok, 0, sizeof(tok));
+	if (pbm ? !parse_pbm_header(src, xbm, &tok.pos) : !parse_xbm_header(src, xbm, &tok.pos, &tok.words))
+		goto out_err;
+
+	/* Calculate the number of bytes that are necessary to store this XBM data. */
+	xbm->stride = (size_t) (xbm->width + 7) / 8;
+	xbm->len = (size_t) xbm->height * xbm->stride;
+	if (pbm && src->size - tok.pos < xbm->len)
+		goto out_err;
+
+	if (xbm->len > mem_budget)
+	{
+		if (!init_xbm_tiles(xbm, src, tok.pos, pbm, tok.words))
+			goto out_err;
+		return xbm;
+	}
+
+	if ((xbm->data = malloc(xbm->len)) == NULL)
+		goto out_err;
+
+	if (pbm)
+	{
+		reverse_bits((const unsigned char *) src->buf + tok.pos, xbm->data, xbm->len);
+		return xbm;
+	}
+
+	/* Convert the C array holding the bitmap data to raw byte values. */
+	tok.buf = src->buf;
+	tok.size = src->size;
+	tok.out = xbm->data;
+	tok.len = tok.words ? (size_t) xbm->height * tok.words : xbm->len;
+	tok.stride = xbm->stride;
+	if (parse_threads > 1 && src->size - tok.pos >= PARALLEL_MIN)
+	{
+		if (!tokenize_hex_parallel(&tok, parse_threads, src->progress))
+			goto out_err;
+	}
+	else if (src->progress != NULL)
+	{
+		if (!set_progress(src->progress, 0, src->size - tok.pos) || !tokenize_hex_slices(&tok, src->progress))
+			goto out_err;
+	}
+	else if (!tokenize_hex(&tok))
+		goto out_err;
+	
+	/* Success. Return XBM object. */
+	return xbm;
+
+out_err:
+	/* Error handling. */
+	if (xbm)
+		unload_xbm_file(&xbm);
+	return NULL;
+}
+
+/* Searches the width and height attributes of the bitmap. On success pos is
+   the offset of the bits array declaration, and words the number of 16 bit
+   literals per row if the array is declared as short, as X10 bitmaps are,
+   or 0. */
+static bool parse_xbm_header(const struct xbm_src *src, struct xbm_dat *xbm, size_t *pos, int *words)
+{
+	const char *fbuf = src->buf;
+	const char *end = src->buf + src->size;
+	size_t i = 0;
+	size_t n = src->size;
+	const char *type;
+	size_t decl;
+
+	for (i = 0; i < n; i++)
+	{
+		if ((   fbuf[i] == 'w' && i + 5 < n && !strncmp(&fbuf[i], "width", 5)
+		     && !scan_field(&fbuf[i + 5], end, "%d", &xbm->width)) ||
+			(   fbuf[i] == 'h' && i + 6 < n && !strncmp(&fbuf[i], "height", 6)
+			 && !scan_field(&fbuf[i + 6], end, "%d", &xbm->height)))
+		{
+			return false;
+		}
+		else if (fbuf[i] == 'b' && i + 4 < n && !strncmp(&fbuf[i], "bits", 4))
+			break;
+	}
+
+	if (i == n || xbm->width < MIN_WIDTH || xbm->width > MAX_WIDTH || xbm->height < MIN_HEIGHT || xbm->height > MAX_HEIGHT)
+		return false;
+
+	/* The type is in the declaration before the name. */
+	for (decl = i; decl > 0 && fbuf[decl - 1] != '\n' && fbuf[decl - 1] != ';'; decl--)
+		;
+	type = memmem(fbuf + decl, i - decl, "short", 5);
+	*words =    type != NULL && isspace((unsigned char) type[5]) && (type == fbuf + decl || isspace((unsigned char) type[-1]))
+	         ? (xbm->width + 15) / 16 : 0;
+	*pos = i;
+	return true;
+}
+
+/* Reads the width and height from the header of a binary PBM file: the magic
+   "P4" and two decimal numbers, separated by whitespace and comments that
+   start with '#' and run to the end of the line. A single whitespace character
+   ends the header. On success pos is the offset of the packed rows. */
+static bool parse_pbm_header(const struct xbm_src *src, struct xbm_dat *xbm, size_t *pos)
+{
+	size_t i = 2;
+
+	if (   !scan_pbm_number(src, &i, &xbm->width) || !scan_pbm_number(src, &i, &xbm->height)
+	    || i == src->size || !isspace((unsigned char) src->buf[i]))
+		return false;
+
+	if (xbm->width < MIN_WIDTH || xbm->width > MAX_WIDTH || xbm->height < MIN_HEIGHT || xbm->height > MAX_HEIGHT)
+		return false;
+
+	*pos = i + 1;
+	return true;
+}
+
+/* Skips whitespace and comments from *pos on and reads the decimal number
+   that follows. *pos is moved behind the number. */
+static bool scan_pbm_number(const struct xbm_src *src, size_t *pos, int *val)
+{
+	size_t i = *pos;
+	int digits = 0;
+
+	while (i < src->size && (isspace((unsigned char) src->buf[i]) || src->buf[i] == '#'))
+	{
+		if (src->buf[i] == '#')
+			while (i < src->size && src->buf[i] != '\n')
+				i++;
+		else
+			i++;
+	}
+
+	for (*val = 0; i < src->size && isdigit((unsigned char) src->buf[i]) && digits < 8; i++, digits++)
+		*val = *val * 10 + (src->buf[i] - '0');
+
+	*pos = i;
+	return digits > 0;
+}
+
+/* Reverses the order of the bits in each of the n bytes from src into dst,
+   which converts between the least significant bit first rows of XBM and the
+   most significant bit first rows of PBM. With SSE2 16 bytes are done at
+   once by swapping the neighbouring bits, bit pairs and nibbles with shifts
+   and masks. The rest goes through the bit_reverse table. */
+static void reverse_bits(const unsigned char *src, unsigned char *dst, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	const __m128i m1 = _mm_set1_epi8(0x55);
+	const __m128i m2 = _mm_set1_epi8(0x33);
+	const __m128i m4 = _mm_set1_epi8(0x0f);
+
+	for ( ; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+
+		v = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 1), m1), _mm_slli_epi16(_mm_and_si128(v, m1), 1));
+		v = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 2), m2), _mm_slli_epi16(_mm_and_si128(v, m2), 2));
+		v = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 4), m4), _mm_slli_epi16(_mm_and_si128(v, m4), 4));
+		_mm_storeu_si128((__m128i *) (dst + i), v);
+	}
+#endif
+	for ( ; i < n; i++)
+		dst[i] = bit_reverse[src[i]];
+}
+
+/* sscanf() wrapper for text that is not null-terminated. A few characters
+   starting at p are copied into a terminated buffer before scanning. */
+static bool scan_field(const char *p, const char *end, const char *fmt, void *val)
+{
+	char field[32];
+	size_t n = (size_t) (end - p) < sizeof(field) - 1 ? (size_t) (end - p) : sizeof(field) - 1;
+
+	memcpy(field, p, n);
+	field[n] = '\0';
+	return sscanf(field, fmt, val) == 1;
+}
+
+/* Decodes the hex literals of the bits array up to the closing brace. The SIMD
+   path compares a whole block of text at once against 'x' and '}' and only
+   looks at the positions of the candidates. Separators and digits, which make
+   up most of the text, are skipped block-wise. The remainder of the text that
+   does not fill a block is handled by the scalar tokenizer. */
+static bool tokenize_hex(struct hex_tok *tok)
+{
+#if defined(__AVX2__) || defined(__SSE2__)
+	while (tok->pos + HEX_BLOCK <= tok->size)
+	{
+		unsigned int mask = hex_block_mask(tok->buf + tok->pos);
+
+		while (mask != 0)
+		{
+			size_t i = tok->pos + (size_t) __builtin_ctz(mask);
+
+			mask &= mask - 1;
+			if (tok->buf[i] == '}')
+			{
+				tok->pos = i;
+				return tok->count == tok->len;
+			}
+			if (tok->buf[i] == 'x' || tok->buf[i] == 'X')
+			{
+				enum tok_result res = tokenize_hex_literal(tok, i);
+
+				if (res != TOK_NEXT)
+				{
+					tok->pos = i;
+					return res == TOK_FULL;
+				}
+			}
+		}
+		tok->pos += HEX_BLOCK;
+	}
+#endif
+	return tokenize_hex_scalar(tok);
+}
+
+/* Decodes the bits array, or the chunk of it, in slices of PROGRESS_SLICE
+   bytes of text and adds the text decoded to progress after each slice. A
+   slice ends at a separator, so no literal is cut in two. Fails if the load
+   is cancelled. */
+static bool tokenize_hex_slices(struct hex_tok *tok, struct xbm_progress *progress)
+{
+	const size_t size = tok->size;
+	const bool open_end = tok->open_end;
+
+	while (true)
+	{
+		const size_t start = tok->pos;
+		size_t end = size - tok->pos > PROGRESS_SLICE ? tok->pos + PROGRESS_SLICE : size;
+
+		while (end < size && end > tok->pos && (hex_digits[(unsigned char) tok->buf[end - 1]] || tok->buf[end - 1] == 'x' || tok->buf[end - 1] == 'X'))
+			end--;
+		if (end == tok->pos)
+			end = size;
+
+		tok->size = end;
+		tok->open_end = end < size || open_end;
+		if (!tokenize_hex(tok) || !add_progress(progress, tok->pos - start))
+			return false;
+		/* The closing brace stops the tokenizer before the end of the slice. */
+		if (end == size || tok->pos < end)
+			return true;
+	}
+}
+
+/* Decodes the hex literals byte by byte. */
+static bool tokenize_hex_scalar(struct hex_tok *tok)
+{
+	for ( ; tok->pos < tok->size; tok->pos++)
+	{
+		char c = tok->buf[tok->pos];
+
+		if (c == '}')
+			return tok->count == tok->len;
+		if (c == 'x' || c == 'X')
+		{
+			enum tok_result res = tokenize_hex_literal(tok, tok->pos);
+
+			if (res != TOK_NEXT)
+				return res == TOK_FULL;
+		}
+	}
+	return tok->open_end;
+}
+
+/* Decodes the literal whose 'x' is at position x, if it is preceded by a '0'.
+   Fails for literals without digits, values larger than 0xff, or 0xffff
+   with words, and for more literals than the bitmap needs. Leading zeros
+   are accepted. */
+static enum tok_result tokenize_hex_literal(struct hex_tok *tok, size_t x)
+{
+	const unsigned int max = tok->words ? 0xffff : 0xff;
+	unsigned int val = 0;
+	size_t i = x + 1;
+
+	if (x == 0 || tok->buf[x - 1] != '0')
+		return TOK_NEXT;
+	if (tok->count == tok->len)
+		return tok->partial ? TOK_FULL : TOK_ERROR;
+
+	for ( ; i < tok->size && (hex_digits[(unsigned char) tok->buf[i]] & 0x10); i++)
+	{
+		val = val << 4 | (hex_digits[(unsigned char) tok->buf[i]] & 0x0f);
+		if (val > max)
+			return TOK_ERROR;
+	}
+	if (i == x + 1)
+		return TOK_ERROR;
+
+	if (tok->words == 0)
+	{
+		if (tok->out != NULL)
+			tok->out[tok->count] = (unsigned char) val;
+	}
+	else
+	{
+		const bool pad = tok->col + 1 == tok->words && (tok->stride & 1);
+
+		if (tok->out != NULL)
+		{
+			tok->out[tok->at] = (unsigned char) (val & 0xff);
+			if (!pad)
+				tok->out[tok->at + 1] = (unsigned char) (val >> 8);
+		}
+		tok->at += pad ? 1 : 2;
+		tok->col = tok->col + 1 < tok->words ? tok->col + 1 : 0;
+	}
+	tok->count++;
+	return TOK_NEXT;
+}
+
+/* Moves a tokenizer of 16 bit literals to literal n of the bits array, the
+   next literal is decoded to its place in the row. */
+static void seek_hex_words(struct hex_tok *tok, size_t n)
+{
+	tok->col = (int) (n % (size_t) tok->words);
+	tok->at = n / (size_t) tok->words * tok->stride + 2 * (size_t) tok->col;
+}
+
+/* Decodes the bits array on multiple threads. The text up to the closing brace
+   is split into chunks at commas, so no literal is cut in two. A first pass
+   counts the literals of each chunk. The running total of the counts gives
+   the offset in out where each chunk is decoded to by the second pass. Both
+   passes run the chunks in parallel. The validation matches the sequential
+   tokenizer: every literal is checked, and the total must match len. With
+   progress, the threads decode in slices and report the text of both
+   passes, and stop once the load is cancelled. */
+static bool tokenize_hex_parallel(struct hex_tok *tok, int threads, struct xbm_progress *progress)
+{
+	const char *brace = memchr(tok->buf + tok->pos, '}', tok->size - tok->pos);
+	struct parse_chunk chunks[MAX_THREADS];
+	size_t end;
+	size_t begin = tok->pos;
+	size_t offset = 0;
+	int i = 0;
+
+	if (brace == NULL)
+		return false;
+	end = (size_t) (brace - tok->buf);
+	if (!set_progress(progress, 0, 2 * (end - tok->pos)))
+		return false;
+
+	memset(chunks, 0, sizeof(chunks));
+	for ( ; i < threads; i++)
+	{
+		size_t stop = i + 1 < threads ? tok->pos + (end - tok->pos) / threads * (i + 1) : end;
+		const char *comma = stop > begin ? memchr(tok->buf + stop, ',', end - stop) : NULL;
+
+		stop = comma != NULL ? (size_t) (comma - tok->buf) + 1 : i + 1 < threads ? begin : end;
+		chunks[i].begin = begin;
+		chunks[i].progress = progress;
+		chunks[i].tok.buf = tok->buf;
+		chunks[i].tok.size = stop;
+		chunks[i].tok.pos = begin;
+		chunks[i].tok.len = tok->len;
+		chunks[i].tok.open_end = true;
+		chunks[i].tok.words = tok->words;
+		chunks[i].tok.stride = tok->stride;
+		begin = stop;
+	}
+
+	/* First pass, count the literals of each chunk. */
+	if (!run_parse_chunks(chunks, threads))
+		return false;
+
+	for (i = 0; i < threads; i++)
+	{
+		chunks[i].tok.out = tok->words ? tok->out : tok->out + offset;
+		if (tok->words)
+			seek_hex_words(&chunks[i].tok, offset);
+		chunks[i].tok.len = chunks[i].tok.count;
+		chunks[i].tok.count = 0;
+		chunks[i].tok.pos = chunks[i].begin;
+		offset += chunks[i].tok.len;
+		if (offset > tok->len)
+			return false;
+	}
+	if (offset != tok->len)
+		return false;
+
+	/* Second pass, decode each chunk at its offset. */
+	if (!run_parse_chunks(chunks, threads))
+		return false;
+
+	tok->pos = end;
+	tok->count = offset;
+	return true;
+}
+
+/* Runs the tokenizer on each chunk, the first chunk on the calling thread.
+   A chunk is run on the calling thread as well if no thread can be created. */
+static bool run_parse_chunks(struct parse_chunk *chunks, int count)
+{
+	bool ok = true;
+	int i = 1;
+
+	for ( ; i < count; i++)
+	{
+		if (pthread_create(&chunks[i].thread, NULL, parse_chunk_thread, &chunks[i]) != 0)
+		{
+			chunks[i].thread = pthread_self();
+			parse_chunk_thread(&chunks[i]);
+		}
+	}
+
+	parse_chunk_thread(&chunks[0]);
+	ok = chunks[0].ok;
+	for (i = 1; i < count; i++)
+	{
+		if (!pthread_equal(chunks[i].thread, pthread_self()))
+			pthread_join(chunks[i].thread, NULL);
+		ok = ok && chunks[i].ok;
+	}
+	return ok;
+}
+
+/* Thread function that tokenizes a chunk. */
+static void *parse_chunk_thread(void *arg)
+{
+	struct parse_chunk *chunk = arg;
+
+	chunk->ok = chunk->progress != NULL ? tokenize_hex_slices(&chunk->tok, chunk->progress) : tokenize_hex(&chunk->tok);
+	return NULL;
+}
+
+#if defined(__AVX2__)
+/* Bit mask of the positions in the 32 byte block at p that may hold an 'x',
+   'X' or '}'. Setting bit 5 folds 'X' onto 'x'. It also folds ']' onto '}',
+   so the caller checks the candidates again. */
+static unsigned int hex_block_mask(const char *p)
+{
+	const __m256i v = _mm256_or_si256(_mm256_loadu_si256((const __m256i *) p), _mm256_set1_epi8(0x20));
+	return (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(
+		_mm256_cmpeq_epi8(v, _mm256_set1_epi8('x')),
+		_mm256_cmpeq_epi8(v, _mm256_set1_epi8('}'))));
+}
+#elif defined(__SSE2__)
+/* Bit mask of the positions in the 16 byte block at p that may hold an 'x',
+   'X' or '}'. Setting bit 5 folds 'X' onto 'x'. It also folds ']' onto '}',
+   so the caller checks the candidates again. */
+static unsigned int hex_block_mask(const char *p)
+{
+	const __m128i v = _mm_or_si128(_mm_loadu_si128((const __m128i *) p), _mm_set1_epi8(0x20));
+	return (unsigned int) _mm_movemask_epi8(_mm_or_si128(
+		_mm_cmpeq_epi8(v, _mm_set1_epi8('x')),
+		_mm_cmpeq_epi8(v, _mm_set1_epi8('}'))));
+}
+#endif
+
+/* Sets up the tile store of a large bitmap. A counting pass over the whole bits
+   array validates it like a full decode does and records where the literals of
+   each tile start. The store takes over the source text. As the tiles are
+   decoded from it later on, the pages of a mapped file are released behind
+   the pass and faulted in again when needed. The rows of a PBM file, if
+   packed is set, are at fixed offsets and need no pass. words is set for
+   the 16 bit literals of a X10 bitmap, see struct hex_tok. The pass reports
+   its progress every PROGRESS_SLICE bytes of text and stops if the load is
+   cancelled. */
+static bool init_xbm_tiles(struct xbm_dat *xbm, struct xbm_src *src, size_t pos, bool packed, int words)
+{
+	const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	struct xbm_tiles *tiles = NULL;
+	struct hex_tok tok;
+	size_t released = 0;
+	size_t reported = pos;
+	int i = 0;
+
+	if ((tiles = calloc(sizeof(struct xbm_tiles), 1)) == NULL)
+		return false;
+	xbm->tiles = tiles;
+
+	tiles->rows = xbm->stride < TILE_SIZE ? (int) (TILE_SIZE / xbm->stride) : 1;
+	tiles->rows = tiles->rows < xbm->height ? tiles->rows : xbm->height;
+	tiles->count = (xbm->height + tiles->rows - 1) / tiles->rows;
+	if (   (tiles->offset = calloc((size_t) tiles->count, sizeof(*tiles->offset))) == NULL
+	    || (tiles->data = calloc((size_t) tiles->count, sizeof(*tiles->data))) == NULL
+	    || (tiles->used = calloc((size_t) tiles->count, sizeof(*tiles->used))) == NULL)
+		return false;
+
+	/* Keep at least a tile for each row pointer in use at once, the rows
+	   might all be in different tiles. */
+	tiles->budget = mem_budget > HELD_ROWS * tiles->rows * xbm->stride ? mem_budget : HELD_ROWS * tiles->rows * xbm->stride;
+	tiles->packed = packed;
+	tiles->words = words;
+
+	memset(&tok, 0, sizeof(tok));
+	tok.buf = src->buf;
+	tok.size = src->size;
+	tok.pos = pos;
+	tok.words = words;
+	tok.stride = xbm->stride;
+	for ( ; packed && i < tiles->count; i++)
+		tiles->offset[i] = pos + (size_t) i * tiles->rows * xbm->stride;
+	for ( ; i < tiles->count; i++)
+	{
+		tiles->offset[i] = tok.pos;
+		tok.count = 0;
+		tok.len = (size_t) (i + 1 < tiles->count ? tiles->rows : xbm->height - i * tiles->rows) * (words ? (size_t) words : xbm->stride);
+		tok.partial = i + 1 < tiles->count;
+		if (!tokenize_hex(&tok))
+			return false;
+		if (tok.pos - reported >= PROGRESS_SLICE)
+		{
+			if (!set_progress(src->progress, tok.pos - pos, src->size - pos))
+				return false;
+			reported = tok.pos;
+		}
+		if (src->mapped && tok.pos / page * page - released >= MAX_POPULATE)
+		{
+			madvise(src->buf + released, tok.pos / page * page - released, MADV_DONTNEED);
+			released = tok.pos / page * page;
+		}
+	}
+
+	if (src->mapped)
+		madvise(src->buf + released, src->size - released, MADV_DONTNEED);
+	tiles->src = *src;
+	memset(src, 0, sizeof(*src));
+	return true;
+}
+
+/* Releases the tile store of the bitmap and the source text. */
+static void free_xbm_tiles(struct xbm_dat *xbm)
+{
+	struct xbm_tiles *tiles = xbm->tiles;
+	int i = 0;
+
+	if (tiles == NULL)
+		return;
+
+	for ( ; tiles->data != NULL && i < tiles->count; i++)
+		free_mem((char **) &tiles->data[i], xbm_tile_size(xbm, i), WIPE_BITMAP);
+	free(tiles->data);
+	free(tiles->offset);
+	free(tiles->used);
+	close_xbm_source(&tiles->src);
+	free_mem((char **) &xbm->tiles, sizeof(*tiles), WIPE_OBJECT);
+}
+
+/* Returns the bytes of the decoded rows of a tile, the last tile may have
+   fewer rows. */
+static size_t xbm_tile_size(const struct xbm_dat *xbm, int index)
+{
+	const struct xbm_tiles *tiles = xbm->tiles;
+
+	return (size_t) (index + 1 < tiles->count ? tiles->rows : xbm->height - index * tiles->rows) * xbm->stride;
+}
+
+/* Decodes a tile from the source text. Least recently used tiles are evicted
+   first if the tile does not fit into the budget. The whole pages of text of
+   a mapped file are released again after decoding. */
+static bool load_xbm_tile(struct xbm_dat *xbm, int index)
+{
+	struct xbm_tiles *tiles = xbm->tiles;
+	const int rows = index + 1 < tiles->count ? tiles->rows : xbm->height - index * tiles->rows;
+	const size_t size = xbm_tile_size(xbm, index);
+	struct hex_tok tok;
+
+	while (tiles->resident + size > tiles->budget)
+	{
+		int lru = -1;
+		int i = 0;
+
+		for ( ; i < tiles->count; i++)
+			if (tiles->data[i] != NULL && (lru == -1 || tiles->used[i] < tiles->used[lru]))
+				lru = i;
+		if (lru == -1)
+			break;
+		tiles->resident -= xbm_tile_size(xbm, lru);
+		free_mem((char **) &tiles->data[lru], xbm_tile_size(xbm, lru), WIPE_BITMAP);
+	}
+
+	if ((tiles->data[index] = malloc(size)) == NULL)
+		return false;
+
+	memset(&tok, 0, sizeof(tok));
+	tok.buf = tiles->src.buf;
+	tok.size = tiles->src.size;
+	tok.pos = tiles->offset[index];
+	tok.out = tiles->data[index];
+	tok.len = tiles->words ? (size_t) rows * tiles->words : size;
+	tok.partial = index + 1 < tiles->count;
+	tok.words = tiles->words;
+	tok.stride = xbm->stride;
+	if (tiles->packed)
+	{
+		/* The size of the file was checked when it was loaded. */
+		reverse_bits((const unsigned char *) tok.buf + tok.pos, tok.out, size);
+		tok.pos += size;
+	}
+	else if (!tokenize_hex(&tok))
+	{
+		/* The file was changed on disk since it was loaded. */
+		free_mem((char **) &tiles->data[index], size, WIPE_BITMAP);
+		return false;
+	}
+
+	if (tiles->src.mapped)
+	{
+		const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+		const size_t start = (tiles->offset[index] + page - 1) / page * page;
+		const size_t end = tok.pos / page * page;
+
+		if (end > start)
+			madvise(tiles->src.buf + start, end - start, MADV_DONTNEED);
+	}
+
+	tiles->resident += size;
+	return true;
+}
+
+/* Returns the packed bits of row y. For bitmaps in tiles, the pointer is valid
+   until rows of HELD_ROWS other tiles are requested, as the tile budget
+   keeps at least that many tiles; callers hold at most the 4 rows of a
+   braille cell or the rows of a transpose block at once. NULL if the tile
+   can't be decoded. */
+static const unsigned char *xbm_row(struct xbm_dat *xbm, int y)
+{
+	struct xbm_tiles *tiles = xbm->tiles;
+	int index;
+
+	if (tiles == NULL)
+		return xbm->data + (size_t) y * xbm->stride;
+
+	index = y / tiles->rows;
+	if (tiles->data[index] == NULL && !load_xbm_tile(xbm, index))
+		return NULL;
+	tiles->used[index] = ++tiles->clock;
+	return tiles->data[index] + (size_t) (y % tiles->rows) * xbm->stride;
+}
+
+/* Returns the zoom level of the bitmap. Level 0 is the bitmap itself, each
+   further level has half the width and height of the level before. Missing
+   levels are built from the level before, so only level 1 reads the full
+   bitmap, and are kept until the bitmap is unloaded. Returns NULL beyond the
+   last level, which is a single pixel or MAX_ZOOM - 1, or if a level can't be
+   allocated. */
+static struct xbm_dat *zoom_xbm(struct xbm_dat *xbm, int level)
+{
+	if (level >= MAX_ZOOM)
+		return NULL;
+
+	for ( ; level > 0; level--)
+	{
+		if (xbm->width == 1 && xbm->height == 1)
+			return NULL;
+		if (xbm->half == NULL && (xbm->half = halve_xbm(xbm)) == NULL)
+			return NULL;
+		xbm = xbm->half;
+	}
+	return xbm;
+}
+
+/* Downsamples the bitmap by 2 in both directions. A pixel is set if 3 or 4 of
+   the 2x2 pixels it replaces are set. If 2 are set, it is set in a
+   checkerboard pattern, so that 50% grey stays grey. The pixel counts of the
+   4 blocks of 2 bytes of two rows are summed up at once in 4 bit fields, and
+   adding the threshold to each field leaves the result in its top bit. */
+static struct xbm_dat *halve_xbm(struct xbm_dat *src)
+{
+	const unsigned char tail = (src->width & 7) ? (1 << (src->width & 7)) - 1 : 0xff;
+	struct xbm_dat *xbm = NULL;
+	int y = 0;
+
+	if ((xbm = calloc(sizeof(struct xbm_dat), 1)) == NULL)
+		return NULL;
+
+	xbm->width = (src->width + 1) / 2;
+	xbm->height = (src->height + 1) / 2;
+	xbm->stride = (size_t) (xbm->width + 7) / 8;
+	xbm->len = xbm->stride * xbm->height;
+	if ((xbm->data = malloc(xbm->len)) == NULL)
+	{
+		free_mem((char **) &xbm, sizeof(*xbm), WIPE_OBJECT);
+		return NULL;
+	}
+
+	for ( ; y < xbm->height; y++)
+	{
+		static const unsigned char zero = 0;
+		const unsigned char *r0 = xbm_row(src, 2 * y);
+		const unsigned char *r1 = 2 * y + 1 < src->height ? xbm_row(src, 2 * y + 1) : NULL;
+		const unsigned int threshold = (y & 1) ? 0x6565 : 0x5656;
+		unsigned char *out = xbm->data + (size_t) y * xbm->stride;
+		size_t i = 0;
+
+		for ( ; i < xbm->stride; i++)
+		{
+			unsigned char byte = 0;
+			int half = 0;
+
+			for ( ; half < 2; half++)
+			{
+				const size_t j = 2 * i + half;
+				const unsigned char mask = j + 1 == src->stride ? tail : j < src->stride ? 0xff : 0;
+				const unsigned char *p0 = r0 != NULL && mask ? r0 + j : &zero;
+				const unsigned char *p1 = r1 != NULL && mask ? r1 + j : &zero;
+				const unsigned int m = (pair_counts(*p0 & mask) + pair_counts(*p1 & mask) + threshold) & 0x8888;
+
+				byte |= (((m >> 3) & 1) | ((m >> 6) & 2) | ((m >> 9) & 4) | ((m >> 12) & 8)) << (4 * half);
+			}
+			*out++ = byte;
+		}
+	}
+	return xbm;
+}
+
+/* Counts the set bits of each of the 4 bit pairs of a byte, and returns the
+   counts in 4 bit fields. */
+static unsigned int pair_counts(unsigned int byte)
+{
+	const unsigned int pairs = (byte & 0x55) + ((byte >> 1) & 0x55);
+
+	return (pairs & 0x03) | ((pairs & 0x0c) << 2) | ((pairs & 0x30) << 4) | ((pairs & 0xc0) << 6);
+}
+
+/* Applies the transform to the bitmap. The result is written into a new
+   packed bitmap, reading the rows with xbm_row() so that tiled bitmaps work
+   too, and then replaces the data of xbm, which keeps its address. The zoom
+   levels are dropped. x, y, width and height are the section that XFORM_CROP
+   keeps, they are clipped to the bitmap. Returns false if the result doesn't
+   fit into the memory budget or a row can't be read. */
+static bool transform_xbm(struct xbm_dat *xbm, enum xbm_xform op, int x, int y, int width, int height)
+{
+	const bool turn = op == XFORM_ROTATE_CW || op == XFORM_ROTATE_CCW;
+	struct xbm_dat *out = NULL;
+	struct xbm_stats *stats = NULL;
+	int row = 0;
+
+	if (op == XFORM_CROP)
+	{
+		x = x < 0 ? 0 : x;
+		y = y < 0 ? 0 : y;
+		width = x + width > xbm->width ? xbm->width - x : width;
+		height = y + height > xbm->height ? xbm->height - y : height;
+		if (width < MIN_WIDTH || height < MIN_HEIGHT)
+			return false;
+	}
+	else
+	{
+		width = turn ? xbm->height : xbm->width;
+		height = turn ? xbm->width : xbm->height;
+	}
+
+	if (   (xbm->tiles != NULL && (size_t) height * ((width + 7) / 8) > mem_budget)
+	    || (out = new_xbm(width, height)) == NULL)
+		return false;
+
+	if (turn)
+	{
+		if (!transpose_xbm(xbm, out, op == XFORM_ROTATE_CW))
+			goto out_err;
+	}
+	else
+	{
+		for ( ; row < out->height; row++)
+		{
+			const int from = op == XFORM_FLIP_V || op == XFORM_ROTATE_180 ? xbm->height - 1 - row : op == XFORM_CROP ? y + row : row;
+			const unsigned char *src = xbm_row(xbm, from);
+			unsigned char *dst = out->data + (size_t) row * out->stride;
+
+			if (src == NULL)
+				goto out_err;
+			if (op == XFORM_FLIP_H || op == XFORM_ROTATE_180)
+				flip_row(src, dst, out->width);
+			else if (op == XFORM_CROP)
+				crop_row(src, dst, x, out->width);
+			else if (op == XFORM_INVERT)
+				invert_row(src, dst, out->width);
+			else
+				memcpy(dst, src, out->stride);
+		}
+	}
+
+	/* The statistics are carried over, see xform_xbm_stats(). */
+	stats = xbm->stats;
+	xbm->stats = NULL;
+	if (stats != NULL && !xform_xbm_stats(stats, op, xbm->width, xbm->height))
+		free_xbm_stats(&stats, xbm->width, xbm->height);
+	replace_xbm_data(xbm, out);
+	xbm->stats = stats;
+	return true;
+
+out_err:
+	unload_xbm_file(&out);
+	return false;
+}
+
+/* Returns the transform bound to the key, or -1. */
+static int xform_key(int key)
+{
+	int op = 0;
+
+	for ( ; op < XFORM_COUNT; op++)
+		if (xform_keys[op] == key)
+			return op;
+	return -1;
+}
+
+/* Moves the pixel at *px, *py of a w x h bitmap to where the transform puts
+   it. x, y is the corner of the section that XFORM_CROP keeps. */
+static void xform_point(enum xbm_xform op, int w, int h, int x, int y, int *px, int *py)
+{
+	const int cx = *px;
+	const int cy = *py;
+
+	if (op == XFORM_ROTATE_CW || op == XFORM_ROTATE_CCW)
+	{
+		*px = op == XFORM_ROTATE_CW ? h - 1 - cy : cy;
+		*py = op == XFORM_ROTATE_CW ? cx : w - 1 - cx;
+	}
+	else if (op == XFORM_CROP)
+	{
+		*px = cx - x;
+		*py = cy - y;
+	}
+	else
+	{
+		*px = op == XFORM_ROTATE_180 || op == XFORM_FLIP_H ? w - 1 - cx : cx;
+		*py = op == XFORM_ROTATE_180 || op == XFORM_FLIP_V ? h - 1 - cy : cy;
+	}
+}
+
+/* Allocates a bitmap of width x height pixels with all pixels cleared. */
+static struct xbm_dat *new_xbm(int width, int height)
+{
+	struct xbm_dat *xbm = NULL;
+
+	if ((xbm = calloc(sizeof(struct xbm_dat), 1)) == NULL)
+		return NULL;
+
+	xbm->width = width;
+	xbm->height = height;
+	xbm->stride = (size_t) (width + 7) / 8;
+	xbm->len = xbm->stride * height;
+	if ((xbm->data = calloc(xbm->len, 1)) == NULL)
+	{
+		free_mem((char **) &xbm, sizeof(*xbm), WIPE_OBJECT);
+		return NULL;
+	}
+	return xbm;
+}
+
+/* Moves the data of src into xbm and frees src. The former data, tiles,
+   mapping, zoom levels and statistics of xbm are freed. */
+static void replace_xbm_data(struct xbm_dat *xbm, struct xbm_dat *src)
+{
+	free_xbm_data(xbm);
+	*xbm = *src;
+	free_mem((char **) &src, sizeof(*src), WIPE_OBJECT);
+}
+
+/* Mirrors a row of width pixels from src into dst. The bytes are reversed
+   and each byte is mirrored by bit_reverse, then the row is shifted down by
+   the padding bits that were moved to its start. The padding bits of the
+   last byte are ignored. */
+static void flip_row(const unsigned char *src, unsigned char *dst, int width)
+{
+	const size_t stride = (size_t) (width + 7) / 8;
+	const int shift = (int) (stride * 8) - width;
+	const unsigned char tail = (width & 7) ? (1 << (width & 7)) - 1 : 0xff;
+	size_t i = 1;
+
+	dst[0] = bit_reverse[src[stride - 1] & tail];
+	for ( ; i < stride; i++)
+		dst[i] = bit_reverse[src[stride - 1 - i]];
+
+	if (shift > 0)
+	{
+		for (i = 0; i + 1 < stride; i++)
+			dst[i] = (unsigned char) ((dst[i] >> shift) | (dst[i + 1] << (8 - shift)));
+		dst[stride - 1] >>= shift;
+	}
+}
+
+/* Copies width pixels from pixel x on of the row src to the start of dst. */
+static void crop_row(const unsigned char *src, unsigned char *dst, int x, int width)
+{
+	const size_t stride = (size_t) (width + 7) / 8;
+	const int shift = x & 7;
+	const unsigned char tail = (width & 7) ? (1 << (width & 7)) - 1 : 0xff;
+	const size_t last = (size_t) (x + width - 1) >> 3;   /* last source byte */
+	size_t i = 0;
+
+	src += x >> 3;
+	if (shift == 0)
+		memcpy(dst, src, stride);
+	else
+		for ( ; i < stride; i++)
+			dst[i] = (unsigned char) ((src[i] >> shift) | ((x >> 3) + i + 1 <= last ? src[i + 1] << (8 - shift) : 0));
+	dst[stride - 1] &= tail;
+}
+
+/* Inverts a row of width pixels from src into dst, 8 bytes at a time. The
+   padding bits of the last byte stay cleared. */
+static void invert_row(const unsigned char *src, unsigned char *dst, int width)
+{
+	const size_t stride = (size_t) (width + 7) / 8;
+	const unsigned char tail = (width & 7) ? (1 << (width & 7)) - 1 : 0xff;
+	size_t i = 0;
+
+	for ( ; i + 8 <= stride; i += 8)
+	{
+		uint64_t v;
+		memcpy(&v, src + i, 8);
+		v = ~v;
+		memcpy(dst + i, &v, 8);
+	}
+	for ( ; i < stride; i++)
+		dst[i] = (unsigned char) ~src[i];
+	dst[stride - 1] &= tail;
+}
+
+/* Rotates the bitmap src by 90 degrees into dst, which is height x width
+   pixels. The rotation is a transpose of the bit matrix, of the rows in
+   reverse order for clockwise, or into the rows of dst in reverse order for
+   counter-clockwise. The source is walked in blocks of TRANSPOSE_ROWS rows,
+   each byte column of a block is transposed in registers and gives 8 rows
+   of dst. The columns are done in bands of TRANSPOSE_BAND bytes, so that the
+   rows of dst that are written stay in the cache. */
+static bool transpose_xbm(struct xbm_dat *src, struct xbm_dat *dst, bool clockwise)
+{
+	size_t band = 0;
+
+	for ( ; band < src->stride; band += TRANSPOSE_BAND)
+	{
+		const size_t end = band + TRANSPOSE_BAND < src->stride ? band + TRANSPOSE_BAND : src->stride;
+		int y = 0;
+
+		for ( ; y < src->height; y += TRANSPOSE_ROWS)
+		{
+			const unsigned char *rows[TRANSPOSE_ROWS];
+			int i = 0;
+
+			for ( ; i < TRANSPOSE_ROWS && y + i < src->height; i++)
+				if ((rows[i] = xbm_row(src, clockwise ? src->height - 1 - (y + i) : y + i)) == NULL)
+					return false;
+			for ( ; i < TRANSPOSE_ROWS; i++)
+				rows[i] = NULL;
+			transpose_block(rows, band, end, dst, y, !clockwise);
+		}
+	}
+	return true;
+}
+
+#if defined(__SSE2__)
+/* Transposes the bytes band to before end of 16 source rows into 16 pixels of
+   8 rows each of dst, starting at pixel y, and into the rows of dst in
+   reverse order if flip is true. A NULL row is blank. Blocks of 16x16 bytes
+   are loaded from the rows and transposed with 4 rounds of byte
+   interleaving, which gives a vector of the 16 bytes of each column. */
+static void transpose_block(const unsigned char **rows, size_t band, size_t end, struct xbm_dat *dst, int y, bool flip)
+{
+	for ( ; band + 16 <= end; band += 16)
+	{
+		__m128i v[16];
+		__m128i t[16];
+		int round = 0;
+		int i = 0;
+
+		for ( ; i < 16; i++)
+			v[i] = rows[i] != NULL ? _mm_loadu_si128((const __m128i *) (rows[i] + band)) : _mm_setzero_si128();
+
+		for ( ; round < 4; round++)
+		{
+			for (i = 0; i < 8; i++)
+			{
+				t[2 * i] = _mm_unpacklo_epi8(v[i], v[i + 8]);
+				t[2 * i + 1] = _mm_unpackhi_epi8(v[i], v[i + 8]);
+			}
+			memcpy(v, t, sizeof(v));
+		}
+
+		for (i = 0; i < 16; i++)
+			put_transposed(v[i], band + i, dst, y, flip);
+	}
+
+	for ( ; band < end; band++)
+	{
+		unsigned char column[16];
+		int i = 0;
+
+		for ( ; i < 16; i++)
+			column[i] = rows[i] != NULL ? rows[i][band] : 0;
+		put_transposed(_mm_loadu_si128((const __m128i *) column), band, dst, y, flip);
+	}
+}
+
+/* Writes the 16 bytes of a source column, the byte at index byte of 16 rows
+   from pixel y on, into the 8 rows of dst that it becomes, counted from the
+   bottom if flip is true. _mm_movemask_epi8() collects the top bits, which
+   are the 16 pixels of a row of dst, and adding the vector to itself moves
+   the next bit to the top. */
+static void put_transposed(__m128i v, size_t byte, struct xbm_dat *dst, int y, bool flip)
+{
+	const size_t col = (size_t) y / 8;
+	const bool pair = col + 1 < dst->stride;
+	int bit = 7;
+
+	for ( ; bit >= 0; bit--)
+	{
+		size_t row = byte * 8 + bit;
+		const unsigned int mask = (unsigned int) _mm_movemask_epi8(v);
+
+		v = _mm_add_epi8(v, v);
+		if (row >= (size_t) dst->height)
+			continue;
+		row = flip ? dst->height - 1 - row : row;
+		dst->data[row * dst->stride + col] = (unsigned char) mask;
+		if (pair)
+			dst->data[row * dst->stride + col + 1] = (unsigned char) (mask >> 8);
+	}
+}
+#else
+/* Transposes the bytes band to before end of 8 source rows into 8 pixels of
+   8 rows each of dst, starting at pixel y, and into the rows of dst in
+   reverse order if flip is true. A NULL row is blank. The 8 bytes of a
+   column are an 8x8 bit matrix in a 64 bit word, which is transposed by
+   swapping 1, 2 and 4 bit blocks across the diagonal. */
+static void transpose_block(const unsigned char **rows, size_t band, size_t end, struct xbm_dat *dst, int y, bool flip)
+{
+	for ( ; band < end; band++)
+	{
+		uint64_t v = 0;
+		uint64_t t;
+		int i = 0;
+
+		for ( ; i < 8; i++)
+			v |= (uint64_t) (rows[i] != NULL ? rows[i][band] : 0) << (8 * i);
+
+		t = (v ^ (v >> 7)) & 0x00aa00aa00aa00aaULL;
+		v ^= t ^ (t << 7);
+		t = (v ^ (v >> 14)) & 0x0000cccc0000ccccULL;
+		v ^= t ^ (t << 14);
+		t = (v ^ (v >> 28)) & 0x00000000f0f0f0f0ULL;
+		v ^= t ^ (t << 28);
+
+		for (i = 0; i < 8 && (int) band * 8 + i < dst->height; i++)
+		{
+			const int row = flip ? dst->height - 1 - ((int) band * 8 + i) : (int) band * 8 + i;
+			dst->data[(size_t) row * dst->stride + y / 8] = (unsigned char) (v >> (8 * i));
+		}
+	}
+}
+#endif
+
+/* Searches the bitmap for the pattern on the given number of threads, each
+   one takes a band of rows. A position matches if at most threshold pixels
+   of the pattern differ. The pattern rows are cut into words of SEARCH_BITS
+   pixels, at each position the word of the bitmap row is read with a single
+   unaligned load and shift, and the differing pixels are counted with
+   popcount of the XOR. The count of a position stops at the first pattern
+   row that exceeds the threshold. The matches are returned in row order in
+   an array that the caller frees, at most MAX_MATCHES. Returns the number of
+   matches, or 0 with *matches NULL on errors. */
+static size_t search_xbm(struct xbm_dat *xbm, struct xbm_dat *pattern, int threshold, int threads, struct xbm_match **matches)
+{
+	struct search_band bands[MAX_THREADS];
+	pthread_mutex_t lock;
+	const int chunks = (pattern->width + SEARCH_BITS - 1) / SEARCH_BITS;
+	const int positions = xbm->height - pattern->height + 1;
+	uint64_t *words = NULL;
+	uint64_t *masks = NULL;
+	size_t count = 0;
+	bool ok = true;
+	int i = 0;
+	int y = 0;
+
+	*matches = NULL;
+	if (   pattern->width > xbm->width || pattern->height > xbm->height
+	    || (words = calloc((size_t) chunks * pattern->height, sizeof(*words))) == NULL
+	    || (masks = calloc((size_t) chunks, sizeof(*masks))) == NULL)
+	{
+		free(words);
+		return 0;
+	}
+
+	for (i = 0; i < chunks; i++)
+	{
+		const int n = pattern->width - i * SEARCH_BITS < SEARCH_BITS ? pattern->width - i * SEARCH_BITS : SEARCH_BITS;
+		masks[i] = ((uint64_t) 1 << n) - 1;
+	}
+
+	/* A chunk starts at a whole byte of the pattern row, SEARCH_BITS / 8 bytes each. */
+	for ( ; y < pattern->height; y++)
+	{
+		const unsigned char *row = xbm_row(pattern, y);
+		size_t byte = 0;
+
+		if (row == NULL)
+		{
+			free_mem((char **) &words, (size_t) chunks * pattern->height * sizeof(*words), WIPE_BITMAP);
+			free(masks);
+			return 0;
+		}
+		for ( ; byte < pattern->stride; byte++)
+			words[(size_t) y * chunks + byte / (SEARCH_BITS / 8)] |= (uint64_t) row[byte] << (byte % (SEARCH_BITS / 8) * 8);
+		for (i = 0; i < chunks; i++)
+			words[(size_t) y * chunks + i] &= masks[i];
+	}
+
+	threads = threads < positions ? threads : positions;
+	pthread_mutex_init(&lock, NULL);
+	memset(bands, 0, sizeof(bands));
+	for (i = 0; i < threads; i++)
+	{
+		bands[i].xbm = xbm;
+		bands[i].words = words;
+		bands[i].masks = masks;
+		bands[i].width = pattern->width;
+		bands[i].height = pattern->height;
+		bands[i].chunks = chunks;
+		bands[i].threshold = threshold;
+		bands[i].first = (int) ((long long) positions * i / threads);
+		bands[i].last = (int) ((long long) positions * (i + 1) / threads);
+		bands[i].lock = xbm->tiles != NULL ? &lock : NULL;
+		if (i > 0 && pthread_create(&bands[i].thread, NULL, search_band_thread, &bands[i]) != 0)
+		{
+			bands[i].thread = pthread_self();
+			search_band_thread(&bands[i]);
+		}
+	}
+	search_band_thread(&bands[0]);
+	for (i = 1; i < threads; i++)
+		if (!pthread_equal(bands[i].thread, pthread_self()))
+			pthread_join(bands[i].thread, NULL);
+	pthread_mutex_destroy(&lock);
+
+	/* Append the matches of the bands in order. */
+	for (i = 0; i < threads; i++)
+	{
+		ok = ok && bands[i].ok;
+		count += bands[i].count;
+	}
+	count = count < MAX_MATCHES ? count : MAX_MATCHES;
+	if (ok && count > 0 && (*matches = malloc(count * sizeof(**matches))) != NULL)
+	{
+		size_t n = 0;
+
+		for (i = 0; i < threads && n < count; i++)
+		{
+			const size_t take = bands[i].count < count - n ? bands[i].count : count - n;
+
+			if (take > 0)
+				memcpy(*matches + n, bands[i].matches, take * sizeof(**matches));
+			n += take;
+		}
+	}
+	for (i = 0; i < threads; i++)
+		free(bands[i].matches);
+	free_mem((char **) &words, (size_t) chunks * pattern->height * sizeof(*words), WIPE_BITMAP);
+	free(masks);
+	return *matches != NULL ? count : 0;
+}
+
+/* Thread function that searches the positions of a band. */
+static void *search_band_thread(void *arg)
+{
+	struct search_band *band = arg;
+	const size_t stride = band->xbm->stride + sizeof(uint64_t);
+	const unsigned char **rows = NULL;
+	unsigned char *ring = NULL;
+	int y = band->first;
+
+	if (   (ring = calloc((size_t) band->height, stride)) == NULL
+	    || (rows = malloc((size_t) band->height * sizeof(*rows))) == NULL)
+		goto out;
+
+	for ( ; y < band->last; y++)
+	{
+		int r = y == band->first ? 0 : band->height - 1;
+
+		/* Copy the rows that enter the pattern area, all of them at the first row. */
+		for ( ; r < band->height; r++)
+		{
+			const unsigned char *row;
+
+			if (band->lock != NULL)
+				pthread_mutex_lock(band->lock);
+			if ((row = xbm_row(band->xbm, y + r)) != NULL)
+				memcpy(ring + (size_t) ((y + r) % band->height) * stride, row, band->xbm->stride);
+			if (band->lock != NULL)
+				pthread_mutex_unlock(band->lock);
+			if (row == NULL)
+				goto out;
+		}
+		for (r = 0; r < band->height; r++)
+			rows[r] = ring + (size_t) ((y + r) % band->height) * stride;
+
+		if (band->threshold == 0 ? !search_row_exact(band, rows, y) : !search_row(band, rows, y))
+			goto out;
+	}
+	band->ok = true;
+
+out:
+	free_mem((char **) &ring, (size_t) band->height * stride, WIPE_BITMAP);
+	free(rows);
+	return NULL;
+}
+
+/* Counts the differing pixels of the positions in row y. The 8 positions of
+   a byte share the word that is read from each row, it is shifted by 0 to 7
+   pixels. The count stops at the pattern row where all 8 positions exceed
+   the threshold. */
+static bool search_row(struct search_band *band, const unsigned char **rows, int y)
+{
+	const int last_x = band->xbm->width - band->width;
+	const int threshold = band->threshold;
+	const int chunks = band->chunks;
+	int x = 0;
+
+	for ( ; x <= last_x; x += 8)
+	{
+		const uint64_t *word = band->words;
+		const int n = last_x - x < 7 ? last_x - x + 1 : 8;
+		int diff[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+		int best = 0;
+		int r = 0;
+		int s;
+
+		for ( ; r < band->height && best <= threshold; r++)
+		{
+			int i = 0;
+
+			for ( ; i < chunks; i++, word++)
+			{
+				const uint64_t bits = row_word(rows[r], x + i * SEARCH_BITS);
+				const uint64_t mask = band->masks[i];
+
+				for (s = 0; s < 8; s++)
+					diff[s] += __builtin_popcountll(((bits >> s) & mask) ^ *word);
+			}
+			best = diff[0];
+			for (s = 1; s < n; s++)
+				best = diff[s] < best ? diff[s] : best;
+		}
+		for (s = 0; best <= threshold && s < n; s++)
+			if (diff[s] <= threshold && !add_match(band, x + s, y, diff[s]))
+				return false;
+	}
+	return true;
+}
+
+/* Finds the exact matches in row y, SEARCH_BITS + 1 positions at once. For
+   each pattern pixel, the word that is read from its row at the pixel's
+   offset has a bit for each position, which is flipped if the pattern pixel
+   is clear. ANDing these words leaves the positions where all pixels are
+   equal, and the pixels are only gone through until no position is left. */
+static bool search_row_exact(struct search_band *band, const unsigned char **rows, int y)
+{
+	const int last_x = band->xbm->width - band->width;
+	int x = 0;
+
+	for ( ; x <= last_x; x += SEARCH_BITS + 1)
+	{
+		const int n = last_x - x < SEARCH_BITS ? last_x - x + 1 : SEARCH_BITS + 1;
+		uint64_t found = ((uint64_t) 1 << n) - 1;
+		int r = 0;
+
+		for ( ; r < band->height && found != 0; r++)
+		{
+			const uint64_t *word = band->words + (size_t) r * band->chunks;
+			int px = 0;
+
+			for ( ; px < band->width && found != 0; px++)
+			{
+				const uint64_t bit = (word[px / SEARCH_BITS] >> (px % SEARCH_BITS)) & 1;
+				found &= row_word(rows[r], x + px) ^ (bit - 1);
+			}
+		}
+		for ( ; found != 0; found &= found - 1)
+			if (!add_match(band, x + __builtin_ctzll(found), y, 0))
+				return false;
+	}
+	return true;
+}
+
+/* Appends a match to the band. Further matches are dropped once the band
+   holds MAX_MATCHES, as no more are kept in total. */
+static bool add_match(struct search_band *band, int x, int y, int diff)
+{
+	if (band->count == MAX_MATCHES)
+		return true;
+
+	if (band->count == band->cap)
+	{
+		const size_t cap = band->cap > 0 ? band->cap * 2 : 64;
+		struct xbm_match *matches = realloc(band->matches, cap * sizeof(*matches));
+
+		if (matches == NULL)
+			return false;
+		band->matches = matches;
+		band->cap = cap;
+	}
+
+	band->matches[band->count].x = x;
+	band->matches[band->count].y = y;
+	band->matches[band->count].diff = diff;
+	band->count++;
+	return true;
+}
+
+/* Returns the pixels of a row from pixel x on in the low bits of a word. At
+   least 57 pixels are valid. The row must be readable for a word beyond the
+   byte of pixel x. */
+static uint64_t row_word(const unsigned char *row, int x)
+{
+	uint64_t word;
+
+	memcpy(&word, row + (x >> 3), sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	word = __builtin_bswap64(word);
+#endif
+	return word >> (x & 7);
+}
+
+/* Returns the statistics of the set pixels of the bitmap, counting them on
+   the first call. The pixels of a row are counted with popcount on 64 bit
+   words. The columns are counted in one byte per pixel, the bit_spread word
+   of a row byte adds its 8 pixels to 8 byte counters at once. The counters
+   are moved into the column counts every 255 rows, before they overflow.
+   Returns NULL if out of memory or a row can't be decoded. */
+static struct xbm_stats *get_xbm_stats(struct xbm_dat *xbm)
+{
+	const size_t last = xbm->stride - 1;
+	const unsigned char tail = (unsigned char) (0xff >> ((8 - xbm->width % 8) % 8));
+	struct xbm_stats *stats = NULL;
+	uint64_t *sums = NULL;
+	int y = 0;
+
+	if (xbm->stats != NULL)
+		return xbm->stats;
+
+	if (   (stats = calloc(1, sizeof(*stats))) == NULL
+	    || (stats->rows = calloc((size_t) xbm->height, sizeof(int))) == NULL
+	    || (stats->cols = calloc((size_t) xbm->width, sizeof(int))) == NULL
+	    || (sums = calloc(xbm->stride, sizeof(uint64_t))) == NULL)
+		goto out_err;
+
+	for ( ; y < xbm->height; y++)
+	{
+		const unsigned char *row = xbm_row(xbm, y);
+		size_t i = 0;
+		int count = 0;
+
+		if (row == NULL)
+			goto out_err;
+
+		/* The padding bits of the last byte are not counted. */
+		for ( ; i + 8 <= last; i += 8)
+		{
+			uint64_t word;
+
+			memcpy(&word, row + i, sizeof(word));
+			count += __builtin_popcountll(word);
+		}
+		for ( ; i < last; i++)
+			count += __builtin_popcount(row[i]);
+		count += __builtin_popcount(row[last] & tail);
+
+		for (i = 0; i < last; i++)
+			sums[i] += bit_spread[row[i]];
+		sums[last] += bit_spread[row[last] & tail];
+
+		stats->rows[y] = count;
+		stats->count += (size_t) count;
+		if (y % 255 == 254 || y == xbm->height - 1)
+			add_column_sums(sums, xbm->stride, stats->cols, xbm->width);
+	}
+
+	free(sums);
+	bound_xbm_stats(stats, xbm->width, xbm->height);
+	xbm->stats = stats;
+	return stats;
+
+out_err:
+	free(sums);
+	free_xbm_stats(&stats, xbm->width, xbm->height);
+	return NULL;
+}
+
+/* Adds the byte counters of 8 columns each to the column counts and clears
+   them. */
+static void add_column_sums(uint64_t *sums, size_t stride, int *cols, int width)
+{
+	size_t i = 0;
+
+	for ( ; i < stride; i++)
+	{
+		int bit = 0;
+
+		for ( ; bit < 8 && (int) i * 8 + bit < width; bit++)
+			cols[i * 8 + bit] += (int) ((sums[i] >> (8 * bit)) & 0xff);
+		sums[i] = 0;
+	}
+}
+
+/* Sets the bounding box of the set pixels from the row and column counts. */
+static void bound_xbm_stats(struct xbm_stats *stats, int width, int height)
+{
+	stats->left = 0;
+	stats->top = 0;
+	stats->right = width - 1;
+	stats->bottom = height - 1;
+
+	while (stats->left < width && stats->cols[stats->left] == 0)
+		stats->left++;
+	while (stats->right >= 0 && stats->cols[stats->right] == 0)
+		stats->right--;
+	while (stats->top < height && stats->rows[stats->top] == 0)
+		stats->top++;
+	while (stats->bottom >= 0 && stats->rows[stats->bottom] == 0)
+		stats->bottom--;
+}
+
+/* Updates the statistics of a width x height bitmap for the transform
+   instead of counting the pixels again. The rotations and flips reorder the
+   row and column counts, the inversion complements them. Returns false for
+   XFORM_CROP, whose counts can't be derived from the counts of the whole
+   bitmap. */
+static bool xform_xbm_stats(struct xbm_stats *stats, enum xbm_xform op, int width, int height)
+{
+	const bool turn = op == XFORM_ROTATE_CW || op == XFORM_ROTATE_CCW;
+	int *rows = stats->rows;
+	int i = 0;
+
+	if (op == XFORM_CROP)
+		return false;
+
+	if (op == XFORM_INVERT)
+	{
+		for ( ; i < height; i++)
+			stats->rows[i] = width - stats->rows[i];
+		for (i = 0; i < width; i++)
+			stats->cols[i] = height - stats->cols[i];
+		stats->count = (size_t) width * height - stats->count;
+	}
+
+	/* The rows of a rotated bitmap are the former columns and vice versa. */
+	if (turn)
+	{
+		stats->rows = stats->cols;
+		stats->cols = rows;
+		i = width;
+		width = height;
+		height = i;
+	}
+	if (op == XFORM_ROTATE_CW || op == XFORM_ROTATE_180 || op == XFORM_FLIP_H)
+		reverse_counts(stats->cols, width);
+	if (op == XFORM_ROTATE_CCW || op == XFORM_ROTATE_180 || op == XFORM_FLIP_V)
+		reverse_counts(stats->rows, height);
+
+	bound_xbm_stats(stats, width, height);
+	return true;
+}
+
+/* Reverses the order of count numbers. */
+static void reverse_counts(int *counts, int count)
+{
+	int i = 0;
+
+	for ( ; i < count / 2; i++)
+	{
+		const int n = counts[i];
+
+		counts[i] = counts[count - 1 - i];
+		counts[count - 1 - i] = n;
+	}
+}
+
+/* Frees the statistics of a bitmap of width x height pixels and sets the
+   pointer to NULL. The counts are wiped like the bitmap they describe. */
+static void free_xbm_stats(struct xbm_stats **stats, int width, int height)
+{
+	if (*stats != NULL)
+	{
+		free_mem((char **) &(*stats)->rows, (size_t) height * sizeof(int), WIPE_OBJECT);
+		free_mem((char **) &(*stats)->cols, (size_t) width * sizeof(int), WIPE_OBJECT);
+		free_mem((char **) stats, sizeof(**stats), WIPE_OBJECT);
+	}
+}
+
+/* Draws the statistics of the bitmap around the display area of width x
+   height cells at x0, y0, which shows zoom level zoom at the offsets x, y.
+   A bar below each column of cells shows the density of the set pixels in
+   the columns of the bitmap that the cells cover, a bar right of each row
+   of cells the density of the rows. The bars are scaled to the densest one
+   shown, the line below them holds the count of set pixels and the
+   bounding box. Only the counts of the covered rows and columns are summed
+   up, not the pixels. Only stdscr is updated, the caller refreshes the
+   screen. Returns false if the statistics can't be counted. */
+static bool draw_xbm_stats(struct xbm_dat *xbm, int zoom, int x, int y, int x0, int y0, int width, int height)
+{
+	static const wchar_t col_bars[9] = { 0x20, 0x2581, 0x2582, 0x2583, 0x2584, 0x2585, 0x2586, 0x2587, 0x2588 };
+	static const wchar_t row_bars[9] = { 0x20, 0x258f, 0x258e, 0x258d, 0x258c, 0x258b, 0x258a, 0x2589, 0x2588 };
+	static const char ascii_bars[9] = { ' ', '.', ':', '-', '=', '+', '*', '#', '@' };
+	const int cw = mode_width[pad_mode];
+	const int ch = mode_height[pad_mode];
+	struct xbm_stats *stats = get_xbm_stats(xbm);
+	double *density = NULL;
+	double max = 0.0;
+	int i = 0;
+
+	if (stats == NULL || (density = calloc((size_t) (width + height), sizeof(double))) == NULL)
+		return false;
+
+	/* The density of the pixels that each column of cells covers, then
+	   that of each row of cells. Cells beyond the bitmap stay empty. */
+	for ( ; i < width + height; i++)
+	{
+		const bool col = i < width;
+		const int size = col ? xbm->width : xbm->height;
+		const int *counts = col ? stats->cols : stats->rows;
+		const int first = col ? (x + i * cw) << zoom : (y + (i - width) * ch) << zoom;
+		const int end = first + ((col ? cw : ch) << zoom);
+		size_t sum = 0;
+		int n = first;
+
+		for ( ; n < end && n < size; n++)
+			sum += (size_t) counts[n];
+		if (n > first)
+			density[i] = (double) sum / ((double) (n - first) * (col ? xbm->height : xbm->width));
+		max = density[i] > max ? density[i] : max;
+	}
+
+	for (i = 0; i < width + height; i++)
+	{
+		const int level = density[i] > 0.0 ? 1 + (int) (7.0 * density[i] / max) : 0;
+		const int row = i < width ? y0 + height : y0 + i - width;
+		const int col = i < width ? x0 + i : x0 + width;
+
+		if (utf8_locale)
+		{
+			wchar_t glyph[2] = { i < width ? col_bars[level] : row_bars[level], 0 };
+			cchar_t cell;
+
+			setcchar(&cell, glyph, A_NORMAL, 0, NULL);
+			mvadd_wch(row, col, &cell);
+		}
+		else
+		{
+			mvaddch(row, col, ascii_bars[level]);
+		}
+	}
+
+	move(y0 + height + 1, x0);
+	if (stats->count == 0)
+		printw("No pixels set");
+	else
+		printw("%zu of %zu pixels set (%.1f%%), box %d,%d to %d,%d", stats->count, (size_t) xbm->width * xbm->height,
+		       100.0 * stats->count / ((double) xbm->width * xbm->height), stats->left, stats->top, stats->right, stats->bottom);
+	clrtoeol();
+
+	free(density);
+	return true;
+}
+
+/* Loads the file repeatedly with both loaders and prints the timings. Pipes and
+   other files that can't be mapped are read once with the read loader only. */
+static bool time_loaders(const char *filename)
+{
+	static const char *names[] = { "mmap", "read" };
+	enum xbm_loader loader;
+	struct stat sb;
+	bool regular;
+
+	if (stat(filename, &sb) == -1)
+		return false;
+	regular = S_ISREG(sb.st_mode);
+
+	printf("%-6s %6s %10s %10s\n", "loader", "runs", "min ms", "avg ms");
+	for (loader = regular ? LOADER_MMAP : LOADER_READ; loader <= LOADER_READ; loader++)
+	{
+		double min = 0.0;
+		double sum = 0.0;
+		int runs = regular ? TIMING_RUNS : 1;
+		int run = 0;
+
+		if (loader == LOADER_READ && regular && sb.st_size > MAX_READSIZE)
+		{
+			printf("%-6s %6s %10s %10s\n", names[loader], "-", "n/a", "n/a");
+			continue;
+		}
+
+		for ( ; run < runs; run++)
+		{
+			struct xbm_dat *xbm;
+			struct timespec start;
+			double ms;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			xbm = load_xbm_file(filename, loader);
+			ms = elapsed_ms(&start);
+
+			if (xbm == NULL)
+				return false;
+			unload_xbm_file(&xbm);
+			min = run == 0 || ms < min ? ms : min;
+			sum += ms;
+		}
+		printf("%-6s %6d %10.3f %10.3f\n", names[loader], runs, min, sum / runs);
+	}
+
+	/* Opening the cache, after it was written by the first load. */
+	if (use_cache && regular)
+	{
+		struct xbm_dat *xbm = load_xbm_cached(filename, LOADER_MMAP, NULL);
+		double min = 0.0;
+		double sum = 0.0;
+		int run = 0;
+
+		unload_xbm_file(&xbm);
+		for ( ; run < TIMING_RUNS; run++)
+		{
+			struct timespec start;
+			double ms;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			xbm = load_xbm_cache(filename, &sb);
+			ms = elapsed_ms(&start);
+
+			if (xbm == NULL)
+				return false;
+			unload_xbm_file(&xbm);
+			min = run == 0 || ms < min ? ms : min;
+			sum += ms;
+		}
+		printf("%-6s %6d %10.3f %10.3f\n", "cache", TIMING_RUNS, min, sum / TIMING_RUNS);
+	}
+	return true;
+}
+
+/* Runs the tokenizers repeatedly over the bits array of the file and prints
+   their throughput in MB/s of source text. */
+static bool time_tokenizers(const char *filename)
+{
+	static const char *names[] = { HEX_SIMD_NAME, "scalar" };
+	struct xbm_src src;
+	struct xbm_dat xbm;
+	struct hex_tok tok;
+	size_t pos = 0;
+	bool ret = false;
+	int words = 0;
+	int path;
+
+	memset(&xbm, 0, sizeof(xbm));
+	if (!open_xbm_source(filename, LOADER_MMAP, &src))
+		return false;
+	if (!parse_xbm_header(&src, &xbm, &pos, &words))
+		goto out;
+
+	/* Bitmaps beyond the memory budget are only validated and counted. */
+	xbm.stride = (size_t) (xbm.width + 7) / 8;
+	xbm.len = (size_t) xbm.height * xbm.stride;
+	if (xbm.len <= mem_budget && (xbm.data = malloc(xbm.len)) == NULL)
+		goto out;
+
+	printf("%-9s %10s %10s\n", "tokenizer", "min ms", "MB/s");
+	for (path = HEX_SIMD_NAME[0] == '\0' ? 1 : 0; path < 2; path++)
+	{
+		double min = 0.0;
+		int run = 0;
+
+		for ( ; run < TIMING_RUNS; run++)
+		{
+			struct timespec start;
+			double ms;
+			bool ok;
+
+			memset(&tok, 0, sizeof(tok));
+			tok.buf = src.buf;
+			tok.size = src.size;
+			tok.pos = pos;
+			tok.out = xbm.data;
+			tok.len = words ? (size_t) xbm.height * words : xbm.len;
+			tok.words = words;
+			tok.stride = xbm.stride;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			ok = path == 0 ? tokenize_hex(&tok) : tokenize_hex_scalar(&tok);
+			ms = elapsed_ms(&start);
+
+			if (!ok)
+				goto out;
+			min = run == 0 || ms < min ? ms : min;
+		}
+		printf("%-9s %10.3f %10.1f\n", names[path], min,
+		       min > 0.0 ? (tok.pos - pos) / (min * 1000.0) : 0.0);
+	}
+	ret = true;
+
+out:
+	if (xbm.data)
+		free_mem((char **) &xbm.data, xbm.len, WIPE_BITMAP);
+	close_xbm_source(&src);
+	return ret;
+}
+
+/* Parses the bits array of the file repeatedly with 1, 2, 4, ... threads up to
+   the number set with -j and prints how the parse time scales. A single
+   thread runs the sequential tokenizer. */
+static bool time_threads(const char *filename)
+{
+	struct xbm_src src;
+	struct xbm_dat xbm;
+	size_t pos = 0;
+	bool ret = false;
+	double base = 0.0;
+	int threads = 1;
+	int words = 0;
+
+	memset(&xbm, 0, sizeof(xbm));
+	if (!open_xbm_source(filename, LOADER_MMAP, &src))
+		return false;
+	if (!parse_xbm_header(&src, &xbm, &pos, &words))
+		goto out;
+
+	xbm.stride = (size_t) (xbm.width + 7) / 8;
+	xbm.len = (size_t) xbm.height * xbm.stride;
+	if (xbm.len > mem_budget)
+	{
+		/* Bitmaps in tiles are not parsed by multiple threads. */
+		ret = true;
+		goto out;
+	}
+	if ((xbm.data = malloc(xbm.len)) == NULL)
+		goto out;
+
+	printf("%-9s %10s %10s %10s\n", "threads", "min ms", "MB/s", "speedup");
+	while (true)
+	{
+		double min = 0.0;
+		int run = 0;
+
+		for ( ; run < TIMING_RUNS; run++)
+		{
+			struct hex_tok tok;
+			struct timespec start;
+			double ms;
+			bool ok;
+
+			memset(&tok, 0, sizeof(tok));
+			tok.buf = src.buf;
+			tok.size = src.size;
+			tok.pos = pos;
+			tok.out = xbm.data;
+			tok.len = words ? (size_t) xbm.height * words : xbm.len;
+			tok.words = words;
+			tok.stride = xbm.stride;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			ok = threads == 1 ? tokenize_hex(&tok) : tokenize_hex_parallel(&tok, threads, NULL);
+			ms = elapsed_ms(&start);
+
+			if (!ok)
+				goto out;
+			min = run == 0 || ms < min ? ms : min;
+		}
+		base = threads == 1 ? min : base;
+		printf("%-9d %10.3f %10.1f %10.2f\n", threads, min,
+		       min > 0.0 ? (src.size - pos) / (min * 1000.0) : 0.0, min > 0.0 ? base / min : 0.0);
+
+		if (threads == parse_threads)
+			break;
+		threads = 2 * threads < parse_threads ? 2 * threads : parse_threads;
+	}
+	ret = true;
+
+out:
+	if (xbm.data)
+		free_mem((char **) &xbm.data, xbm.len, WIPE_BITMAP);
+	close_xbm_source(&src);
+	return ret;
+}
+
+/* Fills a pad with the top left of the bitmap repeatedly, pixel by pixel, with
+   the row expansion and, in a UTF-8 locale, with half blocks and braille
+   patterns, and prints the pixel rates. Curses runs on a screen that writes
+   to /dev/null, the pad is never shown. */
+static bool time_expansion(const char *filename)
+{
+	struct xbm_dat *xbm = NULL;
+	FILE *out = NULL;
+	FILE *in = NULL;
+	SCREEN *screen = NULL;
+	WINDOW *pad = NULL;
+	bool ret = false;
+	int path = 0;
+
+	if (   (xbm = load_xbm_file(filename, LOADER_MMAP)) == NULL
+	    || (out = fopen("/dev/null", "w")) == NULL
+	    || (in = fopen("/dev/null", "r")) == NULL
+	    || ((screen = newterm(NULL, out, in)) == NULL && (screen = newterm("vt100", out, in)) == NULL)
+	    || (pad = newpad(xbm->height < 1024 ? xbm->height : 1024, xbm->width < 4096 ? xbm->width : 4096)) == NULL)
+		goto out;
+
+	init_pad_table();
+	printf("%-9s %10s %10s\n", "expansion", "min ms", "Mpixel/s");
+	for ( ; path < (utf8_locale ? 2 + MODE_COUNT - 1 : 2); path++)
+	{
+		const enum pad_mode mode = path < 2 ? MODE_CELL : (enum pad_mode) (path - 1);
+		const int cols = getmaxx(pad) * mode_width[mode];
+		const int rows = getmaxy(pad) * mode_height[mode];
+		const double pixels = (double) (cols < xbm->width ? cols : xbm->width) * (rows < xbm->height ? rows : xbm->height);
+		double min = 0.0;
+		int run = 0;
+
+		pad_mode = mode;
+
+		for ( ; run < TIMING_RUNS; run++)
+		{
+			struct timespec start;
+			double ms;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (path == 0)
+				set_pad_pixels(pad, xbm);
+			else
+				set_pad_view(pad, xbm, 0, 0);
+			ms = elapsed_ms(&start);
+			min = run == 0 || ms < min ? ms : min;
+		}
+		printf("%-9s %10.3f %10.1f\n", path == 0 ? "pixel" : path == 1 ? "table" : mode_names[mode], min, min > 0.0 ? pixels / (min * 1000.0) : 0.0);
+	}
+	pad_mode = MODE_CELL;
+	ret = true;
+
+out:
+	if (pad)
+		delwin(pad);
+	if (screen)
+	{
+		endwin();
+		delscreen(screen);
+	}
+	if (in)
+		fclose(in);
+	if (out)
+		fclose(out);
+	unload_xbm_file(&xbm);
+	return ret;
+}
+
+/* Scrolls over the bitmap in steps of 5 cells, down and then right, and
+   prints the bytes sent to the terminal per step. The display area is
+   repainted after each step with the screen cleared, then filled again and
+   left to the line comparison of ncurses, and then moved with scroll_pad()
+   and shift_screen(). The screen has 160x48 cells. stdout is redirected
+   to a temporary file meanwhile, as putp() writes to stdout, and the bytes
+   are counted by the file offset. */
+static bool time_scroll(const char *filename)
+{
+	static const char *names[] = { "repaint", "update", "scroll" };
+	struct xbm_dat *xbm = NULL;
+	FILE *out = NULL;
+	FILE *in = NULL;
+	SCREEN *screen = NULL;
+	WINDOW *pad = NULL;
+	long bytes[3][2] = { { -1, -1 }, { -1, -1 }, { -1, -1 } };
+	int saved = -1;
+	int path = 0;
+
+	fflush(stdout);
+	if (   (xbm = load_xbm_file(filename, LOADER_MMAP)) == NULL
+	    || (out = tmpfile()) == NULL
+	    || (in = fopen("/dev/null", "r")) == NULL
+	    || (saved = dup(STDOUT_FILENO)) == -1
+	    || dup2(fileno(out), STDOUT_FILENO) == -1
+	    || ((screen = newterm(NULL, stdout, in)) == NULL && (screen = newterm("vt100", stdout, in)) == NULL)
+	    || resizeterm(48, 160) == ERR
+	    || (pad = new_view_pad(xbm, 81, 25)) == NULL)
+		goto out;
+
+	init_pad_table();
+	idlok(stdscr, TRUE);
+	for ( ; path < 3; path++)
+	{
+		int x = 0;
+		int y = 0;
+		int dir = 0;
+
+		for ( ; dir < 2; dir++)
+		{
+			const int dx = dir == 1 ? 5 : 0;
+			const int dy = dir == 0 ? 5 : 0;
+			off_t start;
+			int steps = 0;
+
+			set_pad_view(pad, xbm, x, y);
+			prefresh(pad, 0, 0, 12, 40, 12 + getmaxy(pad) - 1, 40 + getmaxx(pad) - 1);
+			fflush(stdout);
+			start = lseek(STDOUT_FILENO, 0, SEEK_END);
+			for ( ; steps < 20 && x + dx + getmaxx(pad) <= xbm->width && y + dy + getmaxy(pad) <= xbm->height; steps++)
+			{
+				x += dx;
+				y += dy;
+				if (path < 2 || !can_shift_screen() || !scroll_pad(pad, xbm, x, y, dx, dy))
+					set_pad_view(pad, xbm, x, y);
+				else
+					shift_screen(12, 40, getmaxy(pad), dx);
+				if (path == 0)
+					clearok(curscr, TRUE);
+				prefresh(pad, 0, 0, 12, 40, 12 + getmaxy(pad) - 1, 40 + getmaxx(pad) - 1);
+			}
+			fflush(stdout);
+			if (steps > 0)
+				bytes[path][dir] = (long) (lseek(STDOUT_FILENO, 0, SEEK_END) - start) / steps;
+		}
+	}
+
+out:
+	if (pad)
+		delwin(pad);
+	if (screen)
+	{
+		endwin();
+		delscreen(screen);
+	}
+	fflush(stdout);
+	if (saved != -1)
+	{
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+	}
+	if (in)
+		fclose(in);
+	if (out)
+		fclose(out);
+	unload_xbm_file(&xbm);
+	if (screen == NULL)
+		return false;
+
+	printf("%-9s %10s %10s\n", "scroll", "down B", "right B");
+	for (path = 0; path < 3; path++)
+	{
+		printf("%-9s", names[path]);
+		if (bytes[path][0] >= 0)
+			printf(" %10ld", bytes[path][0]);
+		else
+			printf(" %10s", "n/a");
+		if (bytes[path][1] >= 0)
+			printf(" %10ld\n", bytes[path][1]);
+		else
+			printf(" %10s\n", "n/a");
+	}
+	return true;
+}
+
+/* Measures the phases of showing a bitmap on the files, or on a synthetic
+   corpus if no files are passed. The corpus holds a bitmap of each kind and
+   size of bench_sizes, written into a temporary directory that is removed
+   afterwards. */
+static bool run_benchmark(char **args, int count)
+{
+	const int sizes = (int) (sizeof(bench_sizes) / sizeof(bench_sizes[0]));
+	const char *tmp = getenv("TMPDIR");
+	char dir[PATH_MAX - 64];   /* leaves room for the file names */
+	char path[PATH_MAX];
+	FILE *out = NULL;
+	FILE *in = NULL;
+	SCREEN *screen = NULL;
+	struct timespec start;
+	size_t total = 0;
+	int i = 0;
+	bool ok = false;
+
+	dir[0] = '\0';
+	if (count == 0)
+	{
+		snprintf(dir, sizeof(dir), "%s/xbmview-XXXXXX", tmp != NULL && *tmp != '\0' ? tmp : "/tmp");
+		if (mkdtemp(dir) == NULL)
+		{
+			fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+			return false;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for ( ; i < BENCH_COUNT * sizes; i++)
+		{
+			snprintf(path, sizeof(path), "%s/%s-%dx%d.xbm", dir, bench_names[i / sizes], bench_sizes[i % sizes][0], bench_sizes[i % sizes][1]);
+			if (!write_bench_file(path, (enum bench_kind) (i / sizes), bench_sizes[i % sizes][0], bench_sizes[i % sizes][1], &total))
+			{
+				fprintf(stderr, "%s: can't write the file\n", path);
+				goto out;
+			}
+		}
+		printf("corpus: %d files, %.1f MB in %s, written in %.0f ms\n", BENCH_COUNT * sizes, total / 1e6, dir, elapsed_ms(&start));
+		count = BENCH_COUNT * sizes;
+	}
+
+	/* Expansion and rendering go to a screen on /dev/null. */
+	fflush(stdout);
+	if (   (out = fopen("/dev/null", "w")) == NULL
+	    || (in = fopen("/dev/null", "r")) == NULL
+	    || ((screen = newterm(NULL, out, in)) == NULL && (screen = newterm("vt100", out, in)) == NULL)
+	    || resizeterm(48, 160) == ERR)
+		goto out;
+	init_pad_table();
+
+	printf("%-22s %-6s %5s %10s %10s %10s %8s %8s\n", "file", "phase", "runs", "min ms", "median ms", "p99 ms", "ns/B", "MB/s");
+	for (i = 0; i < count; i++)
+	{
+		char label[64];
+
+		if (dir[0] != '\0')
+		{
+			snprintf(label, sizeof(label), "%s %dx%d", bench_names[i / sizes], bench_sizes[i % sizes][0], bench_sizes[i % sizes][1]);
+			snprintf(path, sizeof(path), "%s/%s-%dx%d.xbm", dir, bench_names[i / sizes], bench_sizes[i % sizes][0], bench_sizes[i % sizes][1]);
+		}
+		else
+		{
+			const char *slash = strrchr(args[i], '/');
+
+			snprintf(label, sizeof(label), "%s", slash != NULL ? slash + 1 : args[i]);
+			snprintf(path, sizeof(path), "%s", args[i]);
+		}
+		if (!bench_xbm_file(path, label))
+			goto out;
+	}
+	ok = true;
+
+out:
+	if (screen)
+	{
+		endwin();
+		delscreen(screen);
+	}
+	if (in)
+		fclose(in);
+	if (out)
+		fclose(out);
+	for (i = 0; dir[0] != '\0' && i < BENCH_COUNT * sizes; i++)
+	{
+		snprintf(path, sizeof(path), "%s/%s-%dx%d.xbm", dir, bench_names[i / sizes], bench_sizes[i % sizes][0], bench_sizes[i % sizes][1]);
+		unlink(path);
+	}
+	if (dir[0] != '\0')
+		rmdir(dir);
+	return ok;
+}
+
+/* Writes a synthetic bitmap of width x height pixels to path and adds the
+   size of the file to *bytes. BENCH_RANDOM and BENCH_ZERO are written like
+   write_xbm_file() does. BENCH_SPACES has random pixels and a run of 1 to 32
+   spaces, tabs and line breaks after each literal, so the literals are
+   spread over the blocks of the tokenizer at random offsets. The pixels are
+   taken from a fixed seed, so the corpus is the same on every run. */
+static bool write_bench_file(const char *path, enum bench_kind kind, int width, int height, size_t *bytes)
+{
+	static const char blanks[4] = { ' ', '\t', '\n', '\r' };
+	struct xbm_dat *xbm = NULL;
+	uint64_t seed = 0x9e3779b97f4a7c15ull;
+	char spaces[64];
+	FILE *out = NULL;
+	size_t i = 0;
+	bool ok = false;
+
+	if ((xbm = new_xbm(width, height)) == NULL || (out = fopen(path, "w")) == NULL)
+		goto out;
+
+	for ( ; kind != BENCH_ZERO && i < xbm->len; i++)
+		xbm->data[i] = (unsigned char) (next_random(&seed) >> 56);
+	for (i = 0; i < sizeof(spaces); i++)
+		spaces[i] = blanks[next_random(&seed) >> 62];
+
+	if (kind != BENCH_SPACES)
+	{
+		ok = write_xbm_file(xbm, path, out, bytes);
+	}
+	else
+	{
+		long size = fprintf(out, "#define bench_width %d\n#define bench_height %d\nstatic unsigned char bench_bits[] = {\n", width, height);
+
+		for (i = 0; i < xbm->len; i++)
+		{
+			const uint64_t r = next_random(&seed);
+			const int len = 1 + (int) (r >> 59);
+
+			size += fprintf(out, "0x%02x%s", xbm->data[i], i + 1 < xbm->len ? "," : "");
+			size += (long) fwrite(spaces + (r & 31), 1, (size_t) len, out);
+		}
+		size += fprintf(out, "};\n");
+		*bytes += (size_t) size;
+		ok = !ferror(out);
+	}
+
+out:
+	if (out != NULL && fclose(out) != 0)
+		ok = false;
+	unload_xbm_file(&xbm);
+	return ok;
+}
+
+/* Returns the next number of a xorshift64* generator. */
+static uint64_t next_random(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545f4914f6cdd1dull;
+}
+
+/* Measures the phases of showing the file. "parse" loads the file, "expand"
+   fills a pad of the size of a 81x25 display area with the section at the
+   top left, and "render" is the first frame: creating the pad, filling it
+   and sending the whole screen to the terminal. The parse is repeated until
+   BENCH_BYTES of text are parsed, within BENCH_MIN_RUNS and BENCH_MAX_RUNS
+   runs, the other phases BENCH_MAX_RUNS times. The bytes per phase are the
+   size of the file for the parse and the packed bytes of the section for the
+   other phases. */
+static bool bench_xbm_file(const char *filename, const char *label)
+{
+	struct xbm_dat *xbm = NULL;
+	WINDOW *pad = NULL;
+	double *ms = NULL;
+	struct stat sb;
+	size_t section;
+	int runs;
+	int run = 0;
+	int phase = 0;
+	bool ok = false;
+
+	if (stat(filename, &sb) == -1 || (ms = malloc(BENCH_MAX_RUNS * sizeof(double))) == NULL)
+		goto out;
+	runs = sb.st_size > 0 ? (int) (BENCH_BYTES / sb.st_size) : BENCH_MAX_RUNS;
+	runs = runs < BENCH_MIN_RUNS ? BENCH_MIN_RUNS : runs > BENCH_MAX_RUNS ? BENCH_MAX_RUNS : runs;
+
+	for ( ; run < runs; run++)
+	{
+		struct timespec start;
+
+		unload_xbm_file(&xbm);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if ((xbm = load_xbm_file(filename, LOADER_MMAP)) == NULL)
+			goto out;
+		ms[run] = elapsed_ms(&start);
+	}
+	print_bench_times(label, "parse", ms, runs, (double) sb.st_size);
+
+	if ((pad = new_view_pad(xbm, 81, 25)) == NULL)
+		goto out;
+	section = (size_t) getmaxy(pad) * ((getmaxx(pad) + 7) / 8);
+
+	for ( ; phase < 2; phase++)
+	{
+		for (run = 0; run < BENCH_MAX_RUNS; run++)
+		{
+			struct timespec start;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (phase == 0)
+			{
+				set_pad_view(pad, xbm, 0, 0);
+			}
+			else
+			{
+				/* Each frame is sent as if the screen was empty. */
+				delwin(pad);
+				if ((pad = new_view_pad(xbm, 81, 25)) == NULL)
+					goto out;
+				set_pad_view(pad, xbm, 0, 0);
+				clearok(curscr, TRUE);
+				prefresh(pad, 0, 0, 12, 40, 12 + getmaxy(pad) - 1, 40 + getmaxx(pad) - 1);
+			}
+			ms[run] = elapsed_ms(&start);
+		}
+		print_bench_times(label, phase == 0 ? "expand" : "render", ms, BENCH_MAX_RUNS, (double) section);
+	}
+	ok = true;
+
+out:
+	if (pad)
+		delwin(pad);
+	unload_xbm_file(&xbm);
+	free(ms);
+	if (!ok)
+		fprintf(stderr, "%s: benchmark failed\n", filename);
+	return ok;
+}
+
+/* Prints the minimum, median and 99th percentile of the times of the runs of
+   a phase, and the bytes per time of the median. Sorts the times. */
+static void print_bench_times(const char *label, const char *phase, double *ms, int runs, double bytes)
+{
+	double median;
+	double p99;
+
+	qsort(ms, (size_t) runs, sizeof(double), compare_times);
+	median = runs % 2 ? ms[runs / 2] : (ms[runs / 2 - 1] + ms[runs / 2]) / 2.0;
+	p99 = ms[(runs * 99 + 99) / 100 - 1];
+	printf("%-22s %-6s %5d %10.3f %10.3f %10.3f %8.2f %8.1f\n", label, phase, runs, ms[0], median, p99,
+	       median * 1e6 / bytes, median > 0.0 ? bytes / (median * 1000.0) : 0.0);
+}
+
+/* Orders times for qsort(). */
+static int compare_times(const void *a, const void *b)
+{
+	const double x = *(const double *) a;
+	const double y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Builds all zoom levels of the bitmap and prints their sizes and build
+   times. */
+static bool time_zoom(const char *filename)
+{
+	struct xbm_dat *xbm = NULL;
+	struct xbm_dat *level = NULL;
+	int zoom = 1;
+
+	if ((xbm = load_xbm_file(filename, LOADER_MMAP)) == NULL)
+		return false;
+
+	printf("%-9s %10s %10s %10s\n", "zoom", "width", "height", "ms");
+	for ( ; zoom < MAX_ZOOM; zoom++)
+	{
+		struct timespec start;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if ((level = zoom_xbm(xbm, zoom)) == NULL)
+			break;
+		printf("1:%-7d %10d %10d %10.3f\n", 1 << zoom, level->width, level->height, elapsed_ms(&start));
+	}
+
+	unload_xbm_file(&xbm);
+	return true;
+}
+
+/* Measures the transforms on the bitmap. Each one is applied TIMING_RUNS
+   times to the result of the last, the crop keeps the middle half. Bitmaps
+   in tiles beyond the memory budget can't be transformed and are skipped. */
+static bool time_transforms(const char *filename)
+{
+	struct xbm_dat *xbm = NULL;
+	int op = 0;
+
+	if ((xbm = load_xbm_file(filename, LOADER_MMAP)) == NULL)
+		return false;
+	if (xbm->tiles != NULL && xbm->len > mem_budget)
+	{
+		unload_xbm_file(&xbm);
+		return true;
+	}
+
+	printf("%-10s %10s %10s\n", "transform", "min ms", "MB/s");
+	for ( ; op < XFORM_COUNT; op++)
+	{
+		double min = 0.0;
+		size_t len = xbm->len;
+		int run = 0;
+
+		for ( ; run < (op == XFORM_CROP ? 1 : TIMING_RUNS); run++)
+		{
+			struct timespec start;
+			double ms;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (!transform_xbm(xbm, (enum xbm_xform) op, xbm->width / 4, xbm->height / 4, xbm->width / 2, xbm->height / 2))
+			{
+				unload_xbm_file(&xbm);
+				return false;
+			}
+			ms = elapsed_ms(&start);
+			min = run == 0 || ms < min ? ms : min;
+		}
+		printf("%-10s %10.3f %10.1f\n", xform_names[op], min, min > 0.0 ? len / (min * 1000.0) : 0.0);
+	}
+
+	unload_xbm_file(&xbm);
+	return true;
+}
+
+/* Writes the bitmap repeatedly as XBM and PBM file to /dev/null and parses
+   the PBM file from memory, and prints the best times and throughput. The
+   PBM parse is skipped for bitmaps that are kept in tiles. */
+static bool time_writers(const char *filename)
+{
+	struct xbm_dat *xbm = NULL;
+	FILE *null = NULL;
+	char *pbm = NULL;
+	size_t size = 0;
+	int format = 0;
+	bool ok = false;
+
+	if ((xbm = load_xbm_file(filename, LOADER_MMAP)) == NULL)
+		return false;
+	if ((null = fopen("/dev/null", "w")) == NULL)
+		goto out;
+
+	printf("%-10s %10s %10s\n", "format", "min ms", "MB/s");
+	for ( ; format < 3; format++)
+	{
+		double min = 0.0;
+		size_t bytes = 0;
+		int run = 0;
+
+		for ( ; run < TIMING_RUNS; run++)
+		{
+			struct timespec start;
+			struct xbm_dat *parsed = NULL;
+			struct xbm_src src;
+			double ms;
+
+			bytes = 0;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (format == 0)
+				ok = write_xbm_file(xbm, filename, null, &bytes);
+			else if (format == 1)
+				ok = write_pbm_file(xbm, null, &bytes);
+			else
+			{
+				memset(&src, 0, sizeof(src));
+				src.buf = pbm;
+				src.size = size;
+				ok = (parsed = parse_xbm_source(&src)) != NULL;
+				bytes = size;
+				unload_xbm_file(&parsed);
+			}
+			ms = elapsed_ms(&start);
+			if (!ok)
+				goto out;
+			min = run == 0 || ms < min ? ms : min;
+		}
+		printf("%-10s %10.3f %10.1f\n", format == 0 ? "write xbm" : format == 1 ? "write pbm" : "read pbm",
+		       min, min > 0.0 ? bytes / (min * 1000.0) : 0.0);
+
+		/* The PBM file to parse is written to memory once. */
+		if (format == 1)
+		{
+			FILE *mem = NULL;
+
+			if (xbm->tiles != NULL || (mem = open_memstream(&pbm, &size)) == NULL)
+				break;
+			bytes = 0;
+			ok = write_pbm_file(xbm, mem, &bytes);
+			ok = fclose(mem) == 0 && ok;
+			if (!ok)
+				goto out;
+		}
+	}
+	ok = true;
+
+out:
+	if (null != NULL)
+		fclose(null);
+	free(pbm);
+	unload_xbm_file(&xbm);
+	return ok;
+}
+
+/* Cuts a pattern of 32x32 pixels out of the middle of the bitmap and searches
+   for it with 1, 2, 4, ... threads up to the number set with -j, once for
+   exact matches and once with up to 10% differing pixels. Prints the times
+   and the number of matches. */
+static bool time_search(const char *filename)
+{
+	struct xbm_dat *xbm = NULL;
+	struct xbm_dat *pattern = NULL;
+	const int size = 32;
+	int threads = 1;
+	int y = 0;
+	bool ok = false;
+
+	if ((xbm = load_xbm_file(filename, LOADER_MMAP)) == NULL)
+		return false;
+	if (xbm->width < size || xbm->height < size)
+	{
+		unload_xbm_file(&xbm);
+		return true;
+	}
+	if ((pattern = new_xbm(size, size)) == NULL)
+		goto out;
+	for ( ; y < size; y++)
+	{
+		const unsigned char *row = xbm_row(xbm, xbm->height / 2 + y);
+
+		if (row == NULL)
+			goto out;
+		crop_row(row, pattern->data + (size_t) y * pattern->stride, xbm->width / 2, size);
+	}
+
+	printf("%-9s %10s %10s %10s %10s\n", "threads", "exact ms", "matches", "10% ms", "matches");
+	while (true)
+	{
+		struct xbm_match *matches = NULL;
+		struct timespec start;
+		size_t exact;
+		size_t near;
+		double ms;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		exact = search_xbm(xbm, pattern, 0, threads, &matches);
+		ms = elapsed_ms(&start);
+		free(matches);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		near = search_xbm(xbm, pattern, size * size / 10, threads, &matches);
+		free(matches);
+		printf("%-9d %10.1f %10zu %10.1f %10zu\n", threads, ms, exact, elapsed_ms(&start), near);
+
+		if (threads == parse_threads)
+			break;
+		threads = 2 * threads < parse_threads ? 2 * threads : parse_threads;
+	}
+	ok = true;
+
+out:
+	unload_xbm_file(&pattern);
+	unload_xbm_file(&xbm);
+	return ok;
+}
+
+/* Prints the time to count the statistics of the bitmap and the times to
+   update them for the transforms. */
+static bool time_stats(const char *filename)
+{
+	struct xbm_dat *xbm = NULL;
+	struct xbm_stats *stats = NULL;
+	double min = 0.0;
+	int width = 0;
+	int height = 0;
+	int run = 0;
+	int op = 0;
+
+	if ((xbm = load_xbm_file(filename, LOADER_MMAP)) == NULL)
+		return false;
+
+	printf("%-10s %10s %10s\n", "stats", "min ms", "MB/s");
+	for ( ; run < TIMING_RUNS; run++)
+	{
+		struct timespec start;
+		double ms;
+
+		free_xbm_stats(&xbm->stats, xbm->width, xbm->height);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (get_xbm_stats(xbm) == NULL)
+		{
+			unload_xbm_file(&xbm);
+			return false;
+		}
+		ms = elapsed_ms(&start);
+		min = run == 0 || ms < min ? ms : min;
+	}
+	printf("%-10s %10.3f %10.1f\n", "count", min, min > 0.0 ? xbm->len / (min * 1000.0) : 0.0);
+
+	/* The updates are applied to the statistics alone, the size of the
+	   bitmap they describe is tracked along. */
+	stats = xbm->stats;
+	width = xbm->width;
+	height = xbm->height;
+	for ( ; op < XFORM_CROP; op++)
+	{
+		for (run = 0; run < TIMING_RUNS; run++)
+		{
+			struct timespec start;
+			double ms;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			xform_xbm_stats(stats, (enum xbm_xform) op, width, height);
+			ms = elapsed_ms(&start);
+			min = run == 0 || ms < min ? ms : min;
+			if (op == XFORM_ROTATE_CW || op == XFORM_ROTATE_CCW)
+			{
+				const int w = width;
+
+				width = height;
+				height = w;
+			}
+		}
+		printf("%-10s %10.3f %10.1f\n", xform_names[op], min, min > 0.0 ? xbm->len / (min * 1000.0) : 0.0);
+	}
+
+	unload_xbm_file(&xbm);
+	return true;
+}
+
+/* Prints the time that close_xbm_source() takes to free the text of the
+   file read into a buffer, and unload_xbm_file() the decoded bitmap, with
+   each wipe policy. The file is loaded anew for each policy and freed once,
+   like after a real load. Mapped text is unmapped and never wiped, so the
+   text is read as with -r. */
+static bool time_wipe(const char *filename)
+{
+	enum wipe_policy saved[WIPE_CLASSES];
+	bool ok = true;
+	int policy = 0;
+
+	memcpy(saved, wipe_policy, sizeof(saved));
+	printf("%-14s %10s %10s %10s\n", "wipe", "bytes", "ms", "MB/s");
+	for ( ; ok && policy < WIPE_POLICIES; policy++)
+	{
+		struct xbm_src src;
+		struct xbm_dat *xbm = NULL;
+		struct timespec start;
+		size_t sizes[WIPE_OBJECT];
+		double ms[WIPE_OBJECT];
+		int cls = 0;
+
+		wipe_policy[WIPE_TEXT] = wipe_policy[WIPE_BITMAP] = (enum wipe_policy) policy;
+		if (!open_xbm_source(filename, LOADER_READ, &src) || (xbm = load_xbm_file(filename, LOADER_MMAP)) == NULL)
+		{
+			close_xbm_source(&src);
+			ok = false;
+			break;
+		}
+
+		sizes[WIPE_TEXT] = src.cap;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		close_xbm_source(&src);
+		ms[WIPE_TEXT] = elapsed_ms(&start);
+
+		/* Only the decoded tiles of a bitmap in tiles are freed. */
+		sizes[WIPE_BITMAP] = xbm->tiles != NULL ? xbm->tiles->resident : xbm->len;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		unload_xbm_file(&xbm);
+		ms[WIPE_BITMAP] = elapsed_ms(&start);
+
+		for ( ; cls < WIPE_OBJECT; cls++)
+			printf("%-6s %-7s %10zu %10.3f %10.1f%s\n", wipe_classes[cls], wipe_names[policy], sizes[cls], ms[cls],
+			       ms[cls] > 0.0 ? sizes[cls] / (ms[cls] * 1000.0) : 0.0, policy == (int) saved[cls] ? "  default" : "");
+	}
+	memcpy(wipe_policy, saved, sizeof(saved));
+	return ok;
+}
+
+/* Runs the self checks and prints the number of cases and the result of
+   each. The cases are drawn from a fixed seed, so a failure can be
+   reproduced. The files of the checks are written into a temporary
+   directory that is removed afterwards. Fails if a check fails. */
+static bool run_checks()
+{
+	const char *tmp = getenv("TMPDIR");
+	char dir[PATH_MAX - 64];   /* leaves room for the file names */
+	bool ok = true;
+
+	snprintf(dir, sizeof(dir), "%s/xbmview-XXXXXX", tmp != NULL && *tmp != '\0' ? tmp : "/tmp");
+	if (mkdtemp(dir) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+		return false;
+	}
+
+	printf("%-10s %10s %10s %10s\n", "check", "cases", "failed", "result");
+	ok = check_tokenizer() && ok;
+	ok = check_cache(dir) && ok;
+	ok = check_transforms() && ok;
+	ok = check_writers(dir) && ok;
+	ok = check_search() && ok;
+	ok = check_stats() && ok;
+	ok = check_x10(dir) && ok;
+	ok = check_zoom() && ok;
+	ok = check_streams(dir) && ok;
+	ok = check_diff() && ok;
+	ok = check_glyphs() && ok;
+	rmdir(dir);
+	return ok;
+}
+
+/* Prints the result of a self check, returns whether all cases passed. */
+static bool print_check(const char *name, int cases, int failed)
+{
+	printf("%-10s %10d %10d %10s\n", name, cases, failed, failed == 0 ? "ok" : "FAILED");
+	return failed == 0;
+}
+
+/* Decodes random bits arrays with the SIMD, the scalar, the sliced and the
+   parallel tokenizer and compares the bytes and the verdict with a decode
+   by sscanf(). The literals vary in case, leading zeros and separators.
+   Every fourth array is broken by a literal above 0xff, a missing or an
+   extra literal. The last array is larger than PARALLEL_MIN and
+   PROGRESS_SLICE. */
+static bool check_tokenizer()
+{
+	static const char *seps[] = { ",", ", ", ",\n   ", " ,\t", ",\r\n" };
+	static const char *formats[] = { "0x%02x", "0X%02X", "0x%x", "0x%03X" };
+	struct xbm_progress progress;
+	uint64_t seed = 0x9e3779b97f4a7c15ull;
+	int failed = 0;
+	int run = 0;
+
+	memset(&progress, 0, sizeof(progress));
+	pthread_mutex_init(&progress.lock, NULL);
+	for ( ; run < CHECK_RUNS; run++)
+	{
+		const size_t len = run + 1 < CHECK_RUNS ? 1 + next_random(&seed) % 5000 : PROGRESS_SLICE / 4;
+		const int broken = run % 4 == 3 ? run / 4 % 3 + 1 : 0;   /* too large, missing, extra */
+		const size_t bad = next_random(&seed) % len;
+		const size_t count = broken == 2 ? len - 1 : broken == 3 ? len + 1 : len;
+		unsigned char *ref = malloc(len);
+		unsigned char *out = malloc(len);
+		char *text = malloc(16 * (count + 4));
+		size_t size = 0;
+		size_t i = 0;
+		bool expect;
+		int path = 0;
+
+		if (ref == NULL || out == NULL || text == NULL)
+		{
+			free(ref);
+			free(out);
+			free(text);
+			failed++;
+			break;
+		}
+
+		size = (size_t) sprintf(text, "static unsigned char check_bits[] = {\n   ");
+		for ( ; i < count; i++)
+		{
+			const unsigned int val = (unsigned int) (next_random(&seed) >> 56);
+
+			if (broken == 1 && i == bad)
+				size += (size_t) sprintf(text + size, "0x%x", 0x100 + val);
+			else
+				size += (size_t) sprintf(text + size, formats[next_random(&seed) >> 62], val);
+			size += (size_t) sprintf(text + size, "%s", i + 1 < count ? seps[next_random(&seed) % 5] : " };\n");
+		}
+		expect = scan_hex_text(text, size, ref, len);
+
+		for ( ; path < 4; path++)
+		{
+			struct hex_tok tok;
+			bool ok;
+
+			memset(&tok, 0, sizeof(tok));
+			memset(out, 0, len);
+			tok.buf = text;
+			tok.size = size;
+			tok.out = out;
+			tok.len = len;
+			if (path == 0)
+				ok = tokenize_hex(&tok);
+			else if (path == 1)
+				ok = tokenize_hex_scalar(&tok);
+			else if (path == 2)
+				ok = tokenize_hex_slices(&tok, &progress);
+			else
+				ok = tokenize_hex_parallel(&tok, 4, NULL);
+			if (ok != expect || (ok && (text[tok.pos] != '}' || memcmp(out, ref, len) != 0)))
+			{
+				fprintf(stderr, "tokenizer: case %d differs from sscanf() on path %d\n", run, path);
+				failed++;
+				break;
+			}
+		}
+		free(ref);
+		free(out);
+		free(text);
+	}
+	pthread_mutex_destroy(&progress.lock);
+	return print_check("tokenizer", run, failed);
+}
+
+/* Decodes the bits array of the text with sscanf() as the first version of
+   the viewer did, the reference of check_tokenizer(). */
+static bool scan_hex_text(const char *text, size_t size, unsigned char *out, size_t len)
+{
+	size_t count = 0;
+	size_t i = 0;
 
-	if (argc == 1)
+	for ( ; i < size && text[i] != '}'; i++)
 	{
-		xbm_ptr = load_test_bitmap(&xbm_test);
+		if (text[i] == '0' && i + 1 < size && (text[i + 1] == 'x' || text[i + 1] == 'X'))
+		{
+			unsigned int val;
+
+			if (count == len || !scan_field(&text[i], text + size, "%x", &val) || val > 0xff)
+				return false;
+			out[count++] = (unsigned char) val;
+		}
 	}
-	else if (argc == 2)
+	return i < size && count == len;
+}
+
+/* Loads random XBM and PBM files of the same name with the cache enabled
+   and checks that the second load maps the cache and returns the same
+   pixels. Then the XBM file is invalidated in turn by new pixels with the
+   modification time a nanosecond later, by a new size with the same
+   modification time, by a truncated cache file and by a flipped bit in the
+   rows of the cache file. The next load has to parse the file again and
+   the one after it to map the new cache. */
+static bool check_cache(const char *dir)
+{
+	const bool saved = use_cache;
+	uint64_t seed = 0x2545f4914f6cdd1dull;
+	char paths[4][PATH_MAX];   /* the files and their caches */
+	int failed = 0;
+	int run = 0;
+
+	snprintf(paths[0], sizeof(paths[0]), "%s/check.xbm", dir);
+	snprintf(paths[1], sizeof(paths[1]), "%s/check.pbm", dir);
+	snprintf(paths[2], sizeof(paths[2]), "%s/check.xbm.xbmc", dir);
+	snprintf(paths[3], sizeof(paths[3]), "%s/check.pbm.xbmc", dir);
+	use_cache = true;
+	for ( ; run < CHECK_RUNS; run++)
 	{
-		if ((xbm_ptr = xbm_user = load_xbm_file(argv[1])) == NULL)
-			exit(EXIT_FAILURE);
+		const int width = 1 + (int) (next_random(&seed) % 300);
+		const int height = 1 + (int) (next_random(&seed) % 200);
+		struct xbm_dat *xbm = new_xbm(width, height);
+		struct xbm_dat *pbm = new_xbm(width, height);
+		struct xbm_dat *next = new_xbm(width + (run % 4 == 1 ? 8 : 0), height);
+		struct xbm_dat *expect = run % 4 >= 2 ? xbm : next;
+		struct xbm_dat *loaded[6] = { NULL };
+		struct timespec times[2];
+		struct stat sb;
+		bool ok = false;
+		int i = 0;
+
+		if (xbm == NULL || pbm == NULL || next == NULL)
+			goto next;
+		random_xbm(xbm, &seed);
+		random_xbm(pbm, &seed);
+		random_xbm(next, &seed);
+		if (   !write_check_file(paths[0], xbm) || !write_check_file(paths[1], pbm) || stat(paths[0], &sb) == -1
+		    || (loaded[0] = load_xbm_cached(paths[0], LOADER_MMAP, NULL)) == NULL
+		    || (loaded[1] = load_xbm_cached(paths[0], LOADER_MMAP, NULL)) == NULL
+		    || (loaded[2] = load_xbm_cached(paths[1], LOADER_MMAP, NULL)) == NULL
+		    || (loaded[3] = load_xbm_cached(paths[1], LOADER_MMAP, NULL)) == NULL)
+			goto next;
+
+		/* The cache is unmapped before it is truncated, reading the mapping
+		   past the new end would fault. */
+		if (   !same_xbm(loaded[0], xbm) || loaded[0]->map != NULL
+		    || !same_xbm(loaded[1], xbm) || loaded[1]->map == NULL
+		    || !same_xbm(loaded[2], pbm) || loaded[2]->map != NULL
+		    || !same_xbm(loaded[3], pbm) || loaded[3]->map == NULL)
+			goto next;
+		for ( ; i < 4; i++)
+			unload_xbm_file(&loaded[i]);
+
+		if (run % 4 == 2)
+		{
+			if (truncate(paths[2], (off_t) (sizeof(struct xbmc_header) + xbm->len / 2)) == -1)
+				goto next;
+		}
+		else if (run % 4 == 3)
+		{
+			const long at = (long) (sizeof(struct xbmc_header) + next_random(&seed) % xbm->len);
+			FILE *fp = fopen(paths[2], "r+b");
+			int c;
+
+			if (fp == NULL)
+				goto next;
+			c = fseek(fp, at, SEEK_SET) == 0 ? fgetc(fp) : EOF;
+			ok = c != EOF && fseek(fp, at, SEEK_SET) == 0 && fputc(c ^ (1 << (at & 7)), fp) != EOF;
+			ok = fclose(fp) == 0 && ok;
+			if (!ok)
+				goto next;
+		}
+		else
+		{
+			/* The time is set a nanosecond later, or a second later where
+			   the file system has no finer timestamps. */
+			times[0] = times[1] = sb.st_mtim;
+			if (run % 4 == 0)
+				times[1].tv_nsec = (times[1].tv_nsec + 1) % 1000000000;
+			if (!write_check_file(paths[0], next) || utimensat(AT_FDCWD, paths[0], times, 0) == -1)
+				goto next;
+			if (run % 4 == 0 && stat(paths[0], &sb) == 0 && sb.st_mtim.tv_nsec != times[1].tv_nsec)
+			{
+				times[1].tv_sec++;
+				if (utimensat(AT_FDCWD, paths[0], times, 0) == -1)
+					goto next;
+			}
+		}
+		if (   (loaded[4] = load_xbm_cached(paths[0], LOADER_MMAP, NULL)) == NULL
+		    || (loaded[5] = load_xbm_cached(paths[0], LOADER_MMAP, NULL)) == NULL)
+			goto next;
+
+		ok =    same_xbm(loaded[4], expect) && loaded[4]->map == NULL
+		     && same_xbm(loaded[5], expect) && loaded[5]->map != NULL;
+
+	next:
+		if (!ok)
+		{
+			fprintf(stderr, "cache: case %d failed\n", run);
+			failed++;
+		}
+		for (i = 0; i < 6; i++)
+			if (loaded[i] != NULL)
+				unload_xbm_file(&loaded[i]);
+		if (xbm != NULL)
+			unload_xbm_file(&xbm);
+		if (pbm != NULL)
+			unload_xbm_file(&pbm);
+		if (next != NULL)
+			unload_xbm_file(&next);
+		for (i = 0; i < 4; i++)
+			unlink(paths[i]);
 	}
-	else
+	use_cache = saved;
+	return print_check("cache", run, failed);
+}
+
+/* Applies each transform to random bitmaps and compares the result with
+   the pixels moved one by one, the crop to a random section. Applying the
+   rotations by 90 degrees three more times, and the other transforms but
+   the crop once more, has to give back the bitmap. The sizes cover partial
+   and several blocks and bands of the transpose. */
+static bool check_transforms()
+{
+	uint64_t seed = 0xd1b54a32d192ed03ull;
+	int failed = 0;
+	int run = 0;
+
+	for ( ; run < CHECK_RUNS; run++)
 	{
-		fprintf(stderr,
-		"Yet another X BitMap (XBM) viewer.\n"
-		"Usage: %s [file.xbm]\n", argv[0]);
-		exit(EXIT_FAILURE);
+		const int width = 1 + (int) (next_random(&seed) % 1100);
+		const int height = 1 + (int) (next_random(&seed) % 150);
+		struct xbm_dat *src = new_xbm(width, height);
+		bool ok = src != NULL;
+		int op = 0;
+
+		if (ok)
+			random_xbm(src, &seed);
+		for ( ; ok && op < XFORM_COUNT; op++)
+		{
+			const int x = (int) (next_random(&seed) % (uint64_t) width);
+			const int y = (int) (next_random(&seed) % (uint64_t) height);
+			const int w = 1 + (int) (next_random(&seed) % (uint64_t) (width - x));
+			const int h = 1 + (int) (next_random(&seed) % (uint64_t) (height - y));
+			const int repeat = op == XFORM_ROTATE_CW || op == XFORM_ROTATE_CCW ? 3 : op == XFORM_CROP ? 0 : 1;
+			struct xbm_dat *xbm = new_xbm(width, height);
+			struct xbm_dat *ref = xform_pixels(src, (enum xbm_xform) op, x, y, w, h);
+			int i = 0;
+
+			if (xbm != NULL)
+				memcpy(xbm->data, src->data, src->len);
+			ok =    xbm != NULL && ref != NULL
+			     && transform_xbm(xbm, (enum xbm_xform) op, x, y, w, h) && same_xbm(xbm, ref);
+			for ( ; ok && i < repeat; i++)
+				ok = transform_xbm(xbm, (enum xbm_xform) op, x, y, w, h);
+			if (ok && repeat > 0)
+				ok = same_xbm(xbm, src);
+			if (!ok)
+				fprintf(stderr, "transform: case %d failed to %s %dx%d\n", run, xform_names[op], width, height);
+			if (xbm != NULL)
+				unload_xbm_file(&xbm);
+			if (ref != NULL)
+				unload_xbm_file(&ref);
+		}
+		if (!ok)
+			failed++;
+		if (src != NULL)
+			unload_xbm_file(&src);
 	}
+	return print_check("transform", run, failed);
+}
 
-	if (init_ui() == true)
+/* Writes random bitmaps as XBM and PBM files and reads them back. The
+   unused bits at the end of the rows are set before writing, the files
+   have to come back with them cleared. The last bitmap is larger than the
+   buffer of the writers. */
+static bool check_writers(const char *dir)
+{
+	uint64_t seed = 0x94d049bb133111ebull;
+	char paths[2][PATH_MAX];
+	int failed = 0;
+	int run = 0;
+
+	snprintf(paths[0], sizeof(paths[0]), "%s/check.xbm", dir);
+	snprintf(paths[1], sizeof(paths[1]), "%s/check.pbm", dir);
+	for ( ; run < CHECK_RUNS; run++)
 	{
-		mvaddstr(0, 0, "For large bitmaps, use the arrow keys to scroll in the direction you wish.\nPress 'q' to quit.");
-		refresh();
-		render_xbm_file(xbm_ptr);
-	}
+		const int width = run + 1 < CHECK_RUNS ? 1 + (int) (next_random(&seed) % 700) : 3001;
+		const int height = run + 1 < CHECK_RUNS ? 1 + (int) (next_random(&seed) % 100) : 1000;
+		const unsigned char tail = (width & 7) ? (1 << (width & 7)) - 1 : 0xff;
+		struct xbm_dat *xbm = new_xbm(width, height);
+		struct xbm_dat *ref = new_xbm(width, height);
+		bool ok = xbm != NULL && ref != NULL;
+		int i = 0;
 
-	deinit_ui();
-	if (xbm_user != NULL)
-		unload_xbm_file(&xbm_user);
-	exit(EXIT_SUCCESS);
+		if (ok)
+		{
+			size_t pos = xbm->stride - 1;
+
+			random_xbm(ref, &seed);
+			memcpy(xbm->data, ref->data, ref->len);
+			for ( ; pos < xbm->len; pos += xbm->stride)
+				xbm->data[pos] |= (unsigned char) ~tail;
+		}
+		for ( ; ok && i < 2; i++)
+		{
+			struct xbm_dat *loaded = NULL;
+
+			ok = write_check_file(paths[i], xbm) && (loaded = load_xbm_file(paths[i], LOADER_MMAP)) != NULL && same_xbm(loaded, ref);
+			if (!ok)
+				fprintf(stderr, "writer: case %d of %dx%d failed as %s\n", run, width, height, i == 0 ? "xbm" : "pbm");
+			if (loaded != NULL)
+				unload_xbm_file(&loaded);
+			unlink(paths[i]);
+		}
+		if (!ok)
+			failed++;
+		if (xbm != NULL)
+			unload_xbm_file(&xbm);
+		if (ref != NULL)
+			unload_xbm_file(&ref);
+	}
+	return print_check("writer", run, failed);
 }
 
-/* Draws the XBM bitmap on the screen. The display area could be smaller than
-   the XBM bitmap. The user can move over the bitmap using the arrow keys. */
-static bool render_xbm_file(const struct xbm_dat *xbm)
+/* Searches random bitmaps for a pattern cut out of them with a few pixels
+   changed, on 1 to 4 threads with a threshold of 0 to 3 pixels, and
+   compares the matches and their differing pixels with a scan of every
+   position pixel by pixel. Every third bitmap has an eighth of the pixels
+   set, so the pattern matches at many positions. The patterns are up to
+   70 pixels wide, more than a word of SEARCH_BITS pixels. */
+static bool check_search()
 {
-	const int x0 = COLS / 2 - COLS / 4;
-	const int y0 = LINES / 2 - LINES / 4;
-	const int x1   = x0 + COLS / 2;
-	const int y1   = y0 + LINES / 2;
-	const int width = x1 - x0 + 1;
-	const int height = y1 - y0 + 1;
-	const int step = 5;
-	int x = 0;
-	int y = 0;
-	int key = 0;
-	WINDOW *pad = NULL;
-	bool ret = true;
-	
-	/* Create a ncurses pad window. This allows to display a specified section of the bitmap. */
-	if ((pad = newpad(xbm->height, xbm->width)) == NULL)
-		return false;
-
-	/* Set the pad display data to the bitmap data. */
-	set_pad_data(pad, xbm->data, xbm->width, xbm->height);
+	uint64_t seed = 0xbf58476d1ce4e5b9ull;
+	int failed = 0;
+	int run = 0;
 
-	/* Drawing loop */
-	while (true)
+	for ( ; run < CHECK_RUNS; run++)
 	{
-		/* Update the pad data on the screen and wait for user input. */
-		if (prefresh(pad, y, x, y0, x0, y1, x1) == ERR || (key = getch()) == ERR)
+		const int width = 1 + (int) (next_random(&seed) % 300);
+		const int height = 1 + (int) (next_random(&seed) % 120);
+		const int pw = 1 + (int) (next_random(&seed) % (uint64_t) (width < 70 ? width : 70));
+		const int ph = 1 + (int) (next_random(&seed) % (uint64_t) (height < 8 ? height : 8));
+		const int threshold = (int) (next_random(&seed) % 4);
+		struct xbm_dat *xbm = new_xbm(width, height);
+		struct xbm_dat *pattern = new_xbm(pw, ph);
+		struct xbm_match *matches = NULL;
+		size_t count = 0;
+		size_t n = 0;
+		bool ok = xbm != NULL && pattern != NULL;
+		int x = 0;
+		int y = 0;
+
+		if (ok)
 		{
-			ret = false;
-			break;
+			const int px = (int) (next_random(&seed) % (uint64_t) (width - pw + 1));
+			const int py = (int) (next_random(&seed) % (uint64_t) (height - ph + 1));
+			int flips = (int) (next_random(&seed) % 3);
+			size_t i = 0;
+
+			random_xbm(xbm, &seed);
+			for ( ; run % 3 == 0 && i < xbm->len; i++)
+				xbm->data[i] &= (unsigned char) (next_random(&seed) >> 56) & (unsigned char) (next_random(&seed) >> 56);
+			for (y = 0; y < ph; y++)
+				crop_row(xbm->data + (size_t) (py + y) * xbm->stride, pattern->data + (size_t) y * pattern->stride, px, pw);
+			for ( ; flips > 0; flips--)
+			{
+				const int fx = (int) (next_random(&seed) % (uint64_t) pw);
+
+				pattern->data[(size_t) (next_random(&seed) % (uint64_t) ph) * pattern->stride + fx / 8] ^= (unsigned char) (1 << (fx & 7));
+			}
+			count = search_xbm(xbm, pattern, threshold, 1 + run % 4, &matches);
 		}
 
-		/* Specifying the bitmap section that should be displayed in the pad window by
-		   calculating the start offsets. */
-		if (key == 'Q' || key == 'q')
+		/* The positions in row order, as search_xbm() returns them. */
+		for (y = 0; ok && y + ph <= height; y++)
 		{
-			break;
+			for (x = 0; ok && x + pw <= width; x++)
+			{
+				int diff = 0;
+				int i = 0;
+
+				for ( ; i < pw * ph; i++)
+				{
+					const int sx = x + i % pw;
+					const int sy = y + i / pw;
+
+					diff +=   (xbm->data[(size_t) sy * xbm->stride + sx / 8] >> (sx & 7) & 1)
+					        ^ (pattern->data[(size_t) (i / pw) * pattern->stride + (i % pw) / 8] >> (i % pw & 7) & 1);
+				}
+				if (diff > threshold)
+					continue;
+				ok = n < count && matches[n].x == x && matches[n].y == y && matches[n].diff == diff;
+				n++;
+			}
 		}
-		else if (key == KEY_RIGHT)
+		if (!ok || n != count)
 		{
-			if (xbm->width > width && x < xbm->width - width)
-				x = x + step < xbm->width - width ? x + step : x + 1;
+			fprintf(stderr, "search: case %d of %dx%d in %dx%d failed\n", run, pw, ph, width, height);
+			failed++;
 		}
-		else if (key == KEY_LEFT)
+		free(matches);
+		if (xbm != NULL)
+			unload_xbm_file(&xbm);
+		if (pattern != NULL)
+			unload_xbm_file(&pattern);
+	}
+	return print_check("search", run, failed);
+}
+
+/* Counts the statistics of empty, sparse, full and random bitmaps up to
+   600 rows, more than the 255 rows that the column counters hold, and
+   compares them with counts pixel by pixel. Then applies three random transforms. The
+   statistics carried over by the transforms other than the crop have to
+   match the transformed bitmap, as the ones counted again after a crop. */
+static bool check_stats()
+{
+	uint64_t seed = 0x6a09e667f3bcc909ull;
+	int failed = 0;
+	int run = 0;
+
+	for ( ; run < CHECK_RUNS; run++)
+	{
+		const int width = 1 + (int) (next_random(&seed) % 400);
+		const int height = 1 + (int) (next_random(&seed) % 600);
+		struct xbm_dat *xbm = new_xbm(width, height);
+		bool ok = xbm != NULL;
+		int step = 0;
+
+		if (ok && run % 4 != 0)
 		{
-			if (x > 0)
-				x = x >= step ? x - step : x - 1;
+			size_t i = 0;
+
+			random_xbm(xbm, &seed);
+			for ( ; run % 4 == 1 && i < xbm->len; i++)
+				xbm->data[i] &= (unsigned char) (next_random(&seed) >> 56) & (unsigned char) (next_random(&seed) >> 56);
+			for (i = 0; run % 4 == 2 && i < xbm->len; i++)
+				xbm->data[i] = (i + 1) % xbm->stride != 0 || (width & 7) == 0 ? 0xff : (unsigned char) ((1 << (width & 7)) - 1);
 		}
-		else if (key == KEY_DOWN)
+		ok = ok && same_xbm_stats(xbm, get_xbm_stats(xbm));
+		for ( ; ok && step < 3; step++)
 		{
-			if (xbm->height > height && y < xbm->height - height)
-				y = y + step < xbm->height - height ? y + step : y + 1;
+			const enum xbm_xform op = (enum xbm_xform) (next_random(&seed) % XFORM_COUNT);
+			const int x = (int) (next_random(&seed) % (uint64_t) xbm->width);
+			const int y = (int) (next_random(&seed) % (uint64_t) xbm->height);
+			const int w = 1 + (int) (next_random(&seed) % (uint64_t) (xbm->width - x));
+			const int h = 1 + (int) (next_random(&seed) % (uint64_t) (xbm->height - y));
+
+			ok =    transform_xbm(xbm, op, x, y, w, h)
+			     && (op == XFORM_CROP || xbm->stats != NULL)
+			     && same_xbm_stats(xbm, get_xbm_stats(xbm));
 		}
-		else if (key == KEY_UP)
+		if (!ok)
 		{
-			if (y > 0)
-				y = y >= step ? y - step : y - 1;
+			fprintf(stderr, "stats: case %d of %dx%d failed\n", run, width, height);
+			failed++;
 		}
+		if (xbm != NULL)
+			unload_xbm_file(&xbm);
 	}
-	
-	if (pad != NULL)
+	return print_check("stats", run, failed);
+}
+
+/* Whether the statistics match the pixels of the bitmap counted one by one.
+   An empty bitmap has to have an empty bounding box. */
+static bool same_xbm_stats(struct xbm_dat *xbm, struct xbm_stats *stats)
+{
+	int left = xbm->width;
+	int top = xbm->height;
+	int right = -1;
+	int bottom = -1;
+	size_t count = 0;
+	int x = 0;
+	int y = 0;
+
+	if (stats == NULL)
+		return false;
+	for ( ; x < xbm->width; x++)
 	{
-		delwin(pad);
-		pad = NULL;
+		int col = 0;
+
+		for (y = 0; y < xbm->height; y++)
+			col += xbm->data[(size_t) y * xbm->stride + x / 8] >> (x & 7) & 1;
+		if (col != stats->cols[x])
+			return false;
+		left = col > 0 && x < left ? x : left;
+		right = col > 0 ? x : right;
+		count += (size_t) col;
 	}
+	for (y = 0; y < xbm->height; y++)
+	{
+		int row = 0;
 
-	return ret;
+		for (x = 0; x < xbm->width; x++)
+			row += xbm->data[(size_t) y * xbm->stride + x / 8] >> (x & 7) & 1;
+		if (row != stats->rows[y])
+			return false;
+		top = row > 0 && y < top ? y : top;
+		bottom = row > 0 ? y : bottom;
+	}
+	if (count == 0)
+		return stats->count == 0 && stats->right < stats->left && stats->bottom < stats->top;
+	return    stats->count == count && stats->left == left && stats->top == top
+	       && stats->right == right && stats->bottom == bottom;
 }
 
-/* Fill the padding window with the XBM object data. */
-static void set_pad_data(WINDOW *pad, const unsigned char *bits, int width, int height)
+/* Writes random X10 bitmaps, with the array declared as short, and reads
+   them with the loader, in tiles and with the parallel tokenizer. The rows
+   have to hold the low byte of each literal before the high byte, without
+   the high byte of the last literal if the row has an odd number of
+   bytes. Every fourth bitmap has a literal above 0xffff and must fail. */
+static bool check_x10(const char *dir)
 {
-	int y = 0;
-	for ( ; y < height; y++)
+	const size_t saved = mem_budget;
+	uint64_t seed = 0x3c6ef372fe94f82bull;
+	char path[PATH_MAX];
+	int failed = 0;
+	int run = 0;
+
+	snprintf(path, sizeof(path), "%s/check.xbm", dir);
+	for ( ; run < CHECK_RUNS; run++)
 	{
-		int x = 0;
-		do
+		const int width = 1 + (int) (next_random(&seed) % 1000);
+		const int height = 1 + (int) (next_random(&seed) % 300);
+		const int words = (width + 15) / 16;
+		const size_t bad = run % 4 == 3 ? next_random(&seed) % ((size_t) words * height) : (size_t) -1;
+		struct xbm_dat *ref = new_xbm(width, height);
+		struct xbm_dat *loaded[2] = { NULL, NULL };
+		struct hex_tok tok;
+		unsigned char *out = NULL;
+		char *text = NULL;
+		size_t size = 0;
+		FILE *fp = NULL;
+		bool ok = false;
+		int mode = 0;
+		int y = 0;
+
+		if (ref == NULL || (out = malloc(ref->len)) == NULL || (fp = open_memstream(&text, &size)) == NULL)
+			goto next;
+
+		fprintf(fp, "#define check_width %d\n#define check_height %d\nstatic short check_bits[] = {", width, height);
+		for ( ; y < height; y++)
 		{
 			int i = 0;
-			for ( ; i < 8 && x < width; i++, x++)
-				mvwaddch(pad, y, x, (*bits & (1 << i)) ? ACS_CKBOARD : 0x20);
-			bits++;
-		} while (x < width);
+
+			for ( ; i < words; i++)
+			{
+				const size_t n = (size_t) y * words + i;
+				const unsigned int val = (unsigned int) (next_random(&seed) >> 48);
+				const size_t at = (size_t) y * ref->stride + 2 * (size_t) i;
+
+				fprintf(fp, "%s", n % 8 == 0 ? "\n   " : " ");
+				fprintf(fp, n == bad ? "0x1%04x" : n % 3 == 0 ? "0X%04X" : "0x%x", val);
+				fprintf(fp, "%s", n + 1 < (size_t) words * height ? "," : "};\n");
+				ref->data[at] = (unsigned char) val;
+				if (at + 1 < (size_t) (y + 1) * ref->stride)
+					ref->data[at + 1] = (unsigned char) (val >> 8);
+			}
+		}
+		if (fclose(fp) != 0 || (fp = fopen(path, "w")) == NULL)
+			goto next;
+		ok = fwrite(text, 1, size, fp) == size;
+		ok = fclose(fp) == 0 && ok;
+
+		/* Once into memory and once into tiles of a few rows. */
+		for ( ; ok && mode < 2; mode++)
+		{
+			mem_budget = mode == 0 ? saved : ref->len / 2;
+			loaded[mode] = load_xbm_file(path, LOADER_MMAP);
+			ok = bad == (size_t) -1 ? loaded[mode] != NULL && same_xbm(loaded[mode], ref) : loaded[mode] == NULL;
+			ok = ok && (loaded[mode] == NULL || (loaded[mode]->tiles != NULL) == (mode == 1));
+		}
+
+		memset(&tok, 0, sizeof(tok));
+		tok.buf = text;
+		tok.size = size;
+		tok.out = out;
+		tok.len = (size_t) words * height;
+		tok.words = words;
+		tok.stride = ref->stride;
+		ok = ok && tokenize_hex_parallel(&tok, 4, NULL) == (bad == (size_t) -1);
+		ok = ok && (bad != (size_t) -1 || memcmp(out, ref->data, ref->len) == 0);
+
+	next:
+		mem_budget = saved;
+		if (!ok)
+		{
+			fprintf(stderr, "x10: case %d of %dx%d failed\n", run, width, height);
+			failed++;
+		}
+		for (mode = 0; mode < 2; mode++)
+			if (loaded[mode] != NULL)
+				unload_xbm_file(&loaded[mode]);
+		if (ref != NULL)
+			unload_xbm_file(&ref);
+		free(out);
+		free(text);
+		unlink(path);
 	}
+	return print_check("x10", run, failed);
 }
 
-/* Reads a XBM bitmap file and returns an object containing it's data and attributes. */
-static struct xbm_dat* load_xbm_file(const char *filename)
+/* Builds three zoom levels of random bitmaps and compares each level with a
+   box filter of the level before, pixel by pixel. A pixel is set if 3 or 4
+   of the 2x2 pixels it replaces are set, and if 2 are set where x + y is
+   even. The pixels beyond an odd width or height count as clear. Every
+   third bitmap is a 50% checkerboard, where each full block has 2 pixels
+   set. */
+static bool check_zoom()
 {
-	FILE *fp = NULL;
-	char *fbuf = NULL;
-	struct xbm_dat *xbm = NULL;
-	struct stat sb;
-	int countbytes = 0;
-	long fsize = 0;
-	int i = 0;
-	int n = 0;
+	uint64_t seed = 0xbb67ae8584caa73bull;
+	int failed = 0;
+	int run = 0;
 
-	/* Read the complete XBM bitmap file into memory. */
-	if (   filename == NULL
-	    || strlen(filename) <= 4
-		|| strcasecmp(filename + strlen(filename) - 4, ".xbm")
-		|| stat(filename, &sb) == -1
-		|| S_ISREG(sb.st_mode) == 0
-		|| (fp = fopen(filename, "rb")) == NULL
-	    || fseek(fp, 0L, SEEK_END) == -1
-		|| (fsize = ftell(fp)) <= 0
-		|| fseek(fp, 0L, SEEK_SET) == -1
-		|| fsize > MAX_FSIZE
-		|| (fbuf = calloc((size_t) fsize + 1, 1)) == NULL
-	    || fread(fbuf, 1, (size_t) fsize, fp) != (size_t) fsize
-		|| (xbm = calloc(sizeof(struct xbm_dat), 1)) == NULL)
+	for ( ; run < CHECK_RUNS; run++)
 	{
-		goto out_err;
+		const int width = 1 + (int) (next_random(&seed) % 300);
+		const int height = 1 + (int) (next_random(&seed) % 200);
+		struct xbm_dat *xbm = new_xbm(width, height);
+		bool ok = xbm != NULL;
+		int level = 1;
+		int x = 0;
+		int y = 0;
+
+		if (ok && run % 3 != 0)
+			random_xbm(xbm, &seed);
+		for ( ; ok && run % 3 == 0 && y < height; y++)
+			for (x = 0; x < width; x++)
+				if ((x + y) % 2 == 0)
+					xbm->data[(size_t) y * xbm->stride + x / 8] |= (unsigned char) (1 << (x & 7));
+
+		for ( ; ok && level <= 3; level++)
+		{
+			struct xbm_dat *src = zoom_xbm(xbm, level - 1);
+			struct xbm_dat *half = NULL;
+			struct xbm_dat *ref = NULL;
+
+			if (src->width == 1 && src->height == 1)
+				break;
+			ok =    (half = zoom_xbm(xbm, level)) != NULL
+			     && (ref = new_xbm((src->width + 1) / 2, (src->height + 1) / 2)) != NULL;
+			for (y = 0; ok && y < ref->height; y++)
+			{
+				for (x = 0; x < ref->width; x++)
+				{
+					int count = 0;
+					int i = 0;
+
+					for ( ; i < 4; i++)
+					{
+						const int sx = 2 * x + (i & 1);
+						const int sy = 2 * y + (i >> 1);
+
+						if (sx < src->width && sy < src->height)
+							count += src->data[(size_t) sy * src->stride + sx / 8] >> (sx & 7) & 1;
+					}
+					if (count >= 3 || (count == 2 && (x + y) % 2 == 0))
+						ref->data[(size_t) y * ref->stride + x / 8] |= (unsigned char) (1 << (x & 7));
+				}
+			}
+			ok = ok && same_xbm(half, ref);
+			if (ref != NULL)
+				unload_xbm_file(&ref);
+		}
+		if (!ok)
+		{
+			fprintf(stderr, "zoom: case %d of %dx%d failed\n", run, width, height);
+			failed++;
+		}
+		if (xbm != NULL)
+			unload_xbm_file(&xbm);
 	}
+	return print_check("zoom", run, failed);
+}
 
-	/* Search the width and height attributes of the bitmap. */
-	for (i = 0, n = (int) fsize; i < n; i++)
+/* Writes random bitmaps as XBM files and as gzip files of the same text,
+   every third in two gzip members, and compares the bitmaps that the
+   stream of the -s mode, the gzip loader and the gzip loader beyond the
+   memory budget, which spills into a file, decode with load_xbm_file() of
+   the XBM file. Every fourth gzip file is cut in half and must fail. */
+static bool check_streams(const char *dir)
+{
+	const size_t saved = mem_budget;
+	uint64_t seed = 0xa54ff53a5f1d36f1ull;
+	char paths[2][PATH_MAX];   /* the XBM file and its gzip file */
+	int failed = 0;
+	int run = 0;
+
+	snprintf(paths[0], sizeof(paths[0]), "%s/check.xbm", dir);
+	snprintf(paths[1], sizeof(paths[1]), "%s/check.xbm.gz", dir);
+	for ( ; run < CHECK_RUNS; run++)
 	{
-		if ((   fbuf[i] == 'w' && i + 5 < n && !strncmp(&fbuf[i], "width", 5)
-		     && sscanf(&fbuf[i + 5], "%d", &xbm->width) != 1) ||
-			(   fbuf[i] == 'h' && i + 6 < n && !strncmp(&fbuf[i], "height", 6)
-			 && sscanf(&fbuf[i + 6], "%d", &xbm->height) != 1))
+		const int width = 1 + (int) (next_random(&seed) % 1000);
+		const int height = 1 + (int) (next_random(&seed) % 300);
+		struct xbm_dat *xbm = new_xbm(width, height);
+		struct xbm_dat *ref = NULL;
+		struct xbm_dat *loaded[2] = { NULL, NULL };
+		struct xbm_stream st;
+		char *text = NULL;
+		size_t size = 0;
+		size_t bytes = 0;
+		FILE *fp = NULL;
+		gzFile gz = NULL;
+		struct stat sb;
+		bool ok = false;
+		int i = 0;
+
+		memset(&st, 0, sizeof(st));
+		st.fd = -1;
+		if (xbm == NULL || (fp = open_memstream(&text, &size)) == NULL)
+			goto next;
+		random_xbm(xbm, &seed);
+		ok = write_xbm_file(xbm, "check", fp, &bytes);
+		ok = fclose(fp) == 0 && ok;
+		if (!ok || (fp = fopen(paths[0], "w")) == NULL)
+			goto next;
+		ok = fwrite(text, 1, size, fp) == size;
+		ok = fclose(fp) == 0 && ok;
+
+		/* The second member is appended, zlib reads them as one text. */
+		for ( ; ok && i < (run % 3 == 2 ? 2 : 1); i++)
 		{
-			goto out_err;
+			const size_t half = run % 3 == 2 ? size / 2 : size;
+			const size_t from = i == 0 ? 0 : half;
+			const size_t n = i == 0 ? half : size - half;
+
+			ok =    (gz = gzopen(paths[1], i == 0 ? "wb1" : "ab1")) != NULL
+			     && gzwrite(gz, text + from, (unsigned int) n) == (int) n;
+			ok = gz != NULL && gzclose(gz) == Z_OK && ok;
 		}
-		else if (fbuf[i] == 'b' && i + 4 < n && !strncmp(&fbuf[i], "bits", 4))
-			break;
+		if (   !ok || stat(paths[1], &sb) == -1
+		    || (run % 4 == 3 && truncate(paths[1], sb.st_size / 2) == -1)
+		    || (ref = load_xbm_file(paths[0], LOADER_MMAP)) == NULL
+		    || !same_xbm(ref, xbm))
+		{
+			ok = false;
+			goto next;
+		}
+
+		ok = open_xbm_stream(paths[0], &st);
+		while (ok && !st.done && step_xbm_stream(&st, -1))
+			;
+		ok = ok && st.done && !st.spill && same_xbm(st.xbm, ref);
+
+		/* Once into memory and once beyond the budget into a spill file. */
+		for (i = 0; ok && i < 2; i++)
+		{
+			mem_budget = i == 0 ? saved : ref->len / 2;
+			loaded[i] = load_xbm_file(paths[1], LOADER_MMAP);
+			ok = run % 4 == 3 ? loaded[i] == NULL : loaded[i] != NULL && same_xbm(loaded[i], ref) && (loaded[i]->map != NULL) == (i == 1);
+			mem_budget = saved;
+		}
+
+	next:
+		if (!ok)
+		{
+			fprintf(stderr, "streams: case %d of %dx%d failed\n", run, width, height);
+			failed++;
+		}
+		close_xbm_stream(&st);
+		if (st.xbm != NULL)
+			unload_xbm_file(&st.xbm);
+		for (i = 0; i < 2; i++)
+			if (loaded[i] != NULL)
+				unload_xbm_file(&loaded[i]);
+		if (ref != NULL)
+			unload_xbm_file(&ref);
+		if (xbm != NULL)
+			unload_xbm_file(&xbm);
+		free(text);
+		unlink(paths[0]);
+		unlink(paths[1]);
 	}
+	return print_check("streams", run, failed);
+}
 
-	if (i == n || xbm->width < MIN_WIDTH || xbm->width > MAX_WIDTH || xbm->height < MIN_HEIGHT || xbm->height > MAX_HEIGHT)
-		goto out_err;
+/* Changes random pixels of a copy of a random bitmap, sometimes none and
+   sometimes the same one twice, and compares the rows that diff_xbm_rows()
+   marks and counts with the rows that differ pixel by pixel. */
+static bool check_diff()
+{
+	uint64_t seed = 0x510e527fade682d1ull;
+	int failed = 0;
+	int run = 0;
 
-	/* Calculate the number of bytes that are necessary to store this XBM data. */
-	xbm->len = xbm->height * ((xbm->width + 7) / 8);
+	for ( ; run < CHECK_RUNS; run++)
+	{
+		const int width = 1 + (int) (next_random(&seed) % 500);
+		const int height = 1 + (int) (next_random(&seed) % 300);
+		const int flips = (int) (next_random(&seed) % 8);
+		struct xbm_dat *xbm = new_xbm(width, height);
+		struct xbm_dat *other = new_xbm(width, height);
+		unsigned char *changed = calloc((size_t) height, 1);
+		bool ok = xbm != NULL && other != NULL && changed != NULL;
+		int count = 0;
+		int i = 0;
+		int y = 0;
 
-	if ((xbm->data = malloc(xbm->len)) == NULL)
-		goto out_err;
+		if (ok)
+		{
+			random_xbm(xbm, &seed);
+			memcpy(other->data, xbm->data, xbm->len);
+		}
+		for ( ; ok && i < flips; i++)
+		{
+			const int x = (int) (next_random(&seed) % (uint64_t) width);
 
-	/* Convert the C array holding the bitmap data to raw byte values. */
-	for ( ; i < n && fbuf[i] != '}'; i++)
+			y = i > 0 && run % 5 == 0 ? y : (int) (next_random(&seed) % (uint64_t) height);
+			other->data[(size_t) y * other->stride + x / 8] ^= (unsigned char) (1 << (x & 7));
+		}
+		ok = ok && (count = diff_xbm_rows(xbm, other, changed)) >= 0;
+		for (y = 0; ok && y < height; y++)
+		{
+			bool differs = false;
+			int x = 0;
+
+			for ( ; x < width; x++)
+				differs = differs || (   (xbm->data[(size_t) y * xbm->stride + x / 8] >> (x & 7) & 1)
+				                      != (other->data[(size_t) y * other->stride + x / 8] >> (x & 7) & 1));
+			ok = changed[y] == differs;
+			count -= differs;
+		}
+		if (!ok || count != 0)
+		{
+			fprintf(stderr, "diff: case %d of %dx%d failed\n", run, width, height);
+			failed++;
+		}
+		if (xbm != NULL)
+			unload_xbm_file(&xbm);
+		if (other != NULL)
+			unload_xbm_file(&other);
+		free(changed);
+	}
+	return print_check("diff", run, failed);
+}
+
+/* Writes random bitmaps as text in the half block and the braille mode and
+   compares the output with the glyphs made pixel by pixel. A half block
+   cell shows the top pixel in its upper and the bottom pixel in its lower
+   half, a braille cell has the dots 1, 2, 3 and 7 for the left and 4, 5, 6
+   and 8 for the right pixels from top to bottom. The unused bits at the
+   end of the rows are random and must not show. The widths cover more than
+   one EXPAND_CHUNK of cells. */
+static bool check_glyphs()
+{
+	static const unsigned int halves[4] = { 0x20, 0x2580, 0x2584, 0x2588 };
+	static const int dots[4][2] = { { 0, 3 }, { 1, 4 }, { 2, 5 }, { 6, 7 } };
+	const enum pad_mode saved = pad_mode;
+	const enum dump_format format = dump_format;
+	uint64_t seed = 0x9b05688c2b3e6c1full;
+	int failed = 0;
+	int run = 0;
+
+	init_glyph_bits();
+	dump_format = DUMP_TEXT;
+	for ( ; run < CHECK_RUNS; run++)
 	{
-		if (fbuf[i] == '0' && i + 1 < n && (fbuf[i + 1] == 'x' || fbuf[i + 1] == 'X'))
+		const int width = 1 + (int) (next_random(&seed) % 1100);
+		const int height = 1 + (int) (next_random(&seed) % 20);
+		struct xbm_dat *xbm = new_xbm(width, height);
+		char *text[2] = { NULL, NULL };
+		size_t size[2] = { 0, 0 };
+		FILE *fp[2] = { NULL, NULL };
+		bool ok = xbm != NULL;
+		size_t i = 0;
+		int mode = MODE_HALF;
+
+		for ( ; ok && i < xbm->len; i++)
+			xbm->data[i] = (unsigned char) (next_random(&seed) >> 56);
+
+		for ( ; ok && mode <= MODE_BRAILLE; mode++)
 		{
-			unsigned int val;
-			if (countbytes == xbm->len || sscanf(&fbuf[i], "%x", &val) != 1 || val > 0xff)
-				goto out_err;
-			xbm->data[countbytes++] = (unsigned char) val;
+			const int cw = mode_width[mode];
+			const int ch = mode_height[mode];
+			size_t bytes = 0;
+			int y = 0;
+
+			pad_mode = (enum pad_mode) mode;
+			ok =    (fp[0] = open_memstream(&text[0], &size[0])) != NULL
+			     && (fp[1] = open_memstream(&text[1], &size[1])) != NULL
+			     && dump_xbm_file(xbm, "check", fp[0], &bytes);
+			for ( ; ok && y < height; y += ch)
+			{
+				int x = 0;
+
+				for ( ; x < width; x += cw)
+				{
+					unsigned int code = 0;
+					int r = 0;
+
+					for ( ; r < ch; r++)
+					{
+						int c = 0;
+
+						for ( ; c < cw; c++)
+							if (   y + r < height && x + c < width
+							    && (xbm->data[(size_t) (y + r) * xbm->stride + (x + c) / 8] >> ((x + c) & 7) & 1))
+								code |= mode == MODE_HALF ? 1u << r : 1u << dots[r][c];
+					}
+					code = mode == MODE_HALF ? halves[code] : 0x2800 + code;
+					if (code < 0x80)
+						fputc((int) code, fp[1]);
+					else
+						fprintf(fp[1], "%c%c%c", 0xe0 | code >> 12, 0x80 | (code >> 6 & 0x3f), 0x80 | (code & 0x3f));
+				}
+				fputc('\n', fp[1]);
+			}
+			for (i = 0; i < 2; i++)
+			{
+				if (fp[i] != NULL)
+					ok = fclose(fp[i]) == 0 && ok;
+				fp[i] = NULL;
+			}
+			ok = ok && size[0] == size[1] && memcmp(text[0], text[1], size[0]) == 0;
+			for (i = 0; i < 2; i++)
+			{
+				free(text[i]);
+				text[i] = NULL;
+			}
+		}
+		if (!ok)
+		{
+			fprintf(stderr, "glyphs: case %d of %dx%d failed\n", run, width, height);
+			failed++;
 		}
+		if (xbm != NULL)
+			unload_xbm_file(&xbm);
 	}
-	
-	if (i == n || countbytes != xbm->len)
-		goto out_err;
-	
-	/* Success. Return XBM object. */
-	free_mem(&fbuf, (size_t) fsize + 1);
-	fclose(fp);
-	fp = NULL;
-	return xbm;
+	pad_mode = saved;
+	dump_format = format;
+	return print_check("glyphs", run, failed);
+}
 
-out_err:
-	/* Error handling. */
-	if (xbm)
+/* Applies the transform pixel by pixel, the reference of check_transforms().
+   x, y, width and height are the section that XFORM_CROP keeps. */
+static struct xbm_dat *xform_pixels(struct xbm_dat *xbm, enum xbm_xform op, int x, int y, int width, int height)
+{
+	const bool turn = op == XFORM_ROTATE_CW || op == XFORM_ROTATE_CCW;
+	const int w = xbm->width;
+	const int h = xbm->height;
+	struct xbm_dat *out = NULL;
+	int sy = 0;
+
+	if ((out = new_xbm(op == XFORM_CROP ? width : turn ? h : w, op == XFORM_CROP ? height : turn ? w : h)) == NULL)
+		return NULL;
+
+	for ( ; sy < h; sy++)
 	{
-		if (xbm->data)
-			free_mem((char **) &xbm->data, xbm->len);
-		free_mem((char **) &xbm, sizeof(*xbm));
+		int sx = 0;
+
+		for ( ; sx < w; sx++)
+		{
+			int bit = xbm->data[(size_t) sy * xbm->stride + sx / 8] >> (sx & 7) & 1;
+			int dx = sx;
+			int dy = sy;
+
+			if (op == XFORM_ROTATE_CW)
+			{
+				dx = h - 1 - sy;
+				dy = sx;
+			}
+			else if (op == XFORM_ROTATE_CCW)
+			{
+				dx = sy;
+				dy = w - 1 - sx;
+			}
+			else if (op == XFORM_ROTATE_180)
+			{
+				dx = w - 1 - sx;
+				dy = h - 1 - sy;
+			}
+			else if (op == XFORM_FLIP_H)
+				dx = w - 1 - sx;
+			else if (op == XFORM_FLIP_V)
+				dy = h - 1 - sy;
+			else if (op == XFORM_INVERT)
+				bit ^= 1;
+			else
+			{
+				dx = sx - x;
+				dy = sy - y;
+				if (dx < 0 || dx >= width || dy < 0 || dy >= height)
+					continue;
+			}
+			if (bit)
+				out->data[(size_t) dy * out->stride + dx / 8] |= (unsigned char) (1 << (dx & 7));
+		}
 	}
-	if (fbuf)
-		free_mem(&fbuf, (size_t) fsize + 1);
-	if (fp)
+	return out;
+}
+
+/* Fills the bitmap with random pixels. The unused bits at the end of each
+   row are left clear, as the writers and the transforms leave them. */
+static void random_xbm(struct xbm_dat *xbm, uint64_t *seed)
+{
+	const unsigned char tail = (xbm->width & 7) ? (1 << (xbm->width & 7)) - 1 : 0xff;
+	size_t i = 0;
+
+	for ( ; i < xbm->len; i++)
+		xbm->data[i] = (unsigned char) (next_random(seed) >> 56);
+	for (i = xbm->stride - 1; i < xbm->len; i += xbm->stride)
+		xbm->data[i] &= tail;
+}
+
+/* Whether both bitmaps have the same size and the same rows, including the
+   unused bits. */
+static bool same_xbm(struct xbm_dat *a, struct xbm_dat *b)
+{
+	int y = 0;
+
+	if (a->width != b->width || a->height != b->height || a->stride != b->stride)
+		return false;
+	for ( ; y < a->height; y++)
 	{
-		fclose(fp);
-		fp = NULL;
+		const unsigned char *row = xbm_row(a, y);
+		const unsigned char *other = xbm_row(b, y);
+
+		if (row == NULL || other == NULL || memcmp(row, other, a->stride) != 0)
+			return false;
 	}
-	return NULL;
+	return true;
+}
+
+/* Writes the bitmap into a XBM or PBM file, by the suffix of the path. */
+static bool write_check_file(const char *path, struct xbm_dat *xbm)
+{
+	enum xbm_kind kind = KIND_XBM;
+	size_t bytes = 0;
+	FILE *out = NULL;
+	bool ok;
+
+	if (!xbm_file_kind(path, &kind, NULL) || (out = fopen(path, "w")) == NULL)
+		return false;
+	ok = kind == KIND_PBM ? write_pbm_file(xbm, out, &bytes) : write_xbm_file(xbm, path, out, &bytes);
+	return fclose(out) == 0 && ok;
+}
+
+/* Milliseconds passed since start. */
+static double elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
 }
 
 /* Free memory uses by the XBM object. */
 static void unload_xbm_file(struct xbm_dat **xbm)
 {
-	if (xbm)
+	if (xbm && *xbm)
 	{
-		free_mem((char **) &(*xbm)->data, (*xbm)->len);
-		free_mem((char **) xbm, sizeof(**xbm));
+		free_xbm_data(*xbm);
+		free_mem((char **) xbm, sizeof(**xbm), WIPE_OBJECT);
 	}
 }
 
-/* Initializes the ncurses mode. */
+/* Frees the data, tiles and zoom levels of the XBM object, but not the
+   object itself. */
+static void free_xbm_data(struct xbm_dat *xbm)
+{
+	if (xbm->map)
+		munmap(xbm->map, xbm->map_size);
+	else if (xbm->data)
+		free_mem((char **) &xbm->data, xbm->len, WIPE_BITMAP);
+	free_xbm_tiles(xbm);
+	free_xbm_stats(&xbm->stats, xbm->width, xbm->height);
+	unload_xbm_file(&xbm->half);
+}
+
+/* Initializes the ncurses mode. If the bitmap is piped in on stdin, the keys
+   are read from the terminal instead. */
 static bool init_ui()
 {
-	return !(initscr()                 == NULL    /* init curses */
+	FILE *tty = NULL;
+
+	if (!isatty(STDIN_FILENO) && ((tty = fopen("/dev/tty", "r")) == NULL || newterm(NULL, stdout, tty) == NULL))
+		return false;
+
+	if (   (tty == NULL && initscr() == NULL)   /* init curses */
 	    || cbreak()                    == ERR     /* disable line buffering */
 	    || noecho()                    == ERR     /* do our own echoing */
 	    || nonl()                      == ERR     /* don't translate return key into newline */
 	    || intrflush(stdscr, FALSE)    == ERR     /* prevent flush when interrupt key is pressed */
 	    || keypad(stdscr, TRUE)        == ERR     /* return single value for function keys */
-	);
+	    || idlok(stdscr, TRUE)         == ERR     /* scroll with insert/delete line */
+	)
+		return false;
+
+	key_fd = tty != NULL ? fileno(tty) : STDIN_FILENO;
+	init_pad_table();
+	return true;
 }
 
 /* Deinitialize ncurses mode. */ 
@@ -294,21 +7459,75 @@ static void deinit_ui()
 
 /* Helper function that sanitizes and frees memory of the block
    pointed to by ptr. Not really necessary but careful clean-up
-   avoids artifacts in memory and increases security. */
-static void free_mem(char **ptr, size_t size)
+   avoids artifacts in memory and increases security. The block is
+   cleared as the policy of its class says. */
+static void free_mem(char **ptr, size_t size, enum wipe_class cls)
 {
 	if (ptr != NULL && size > 0)
 	{
-		memset(*ptr, 0, size);
+		if (*ptr != NULL && wipe_policy[cls] == WIPE_STREAM && size >= WIPE_STREAM_MIN)
+			stream_zero((unsigned char *) *ptr, size);
+		else if (*ptr != NULL && wipe_policy[cls] != WIPE_NONE)
+			explicit_bzero(*ptr, size);
 		free(*ptr);
 		*ptr = NULL;
 	}
 }
 
+/* Clears the block with non-temporal stores, so wiping a large buffer does
+   not evict the data that is still in use from the cache. The unaligned
+   head and tail are cleared with explicit_bzero(). */
+static void stream_zero(unsigned char *ptr, size_t size)
+{
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	size_t head = (16 - ((uintptr_t) ptr & 15)) & 15;
+	size_t i;
+
+	head = head < size ? head : size;
+	explicit_bzero(ptr, head);
+	for (i = head; i + 16 <= size; i += 16)
+		_mm_stream_si128((__m128i *) (ptr + i), zero);
+	explicit_bzero(ptr + i, size - i);
+	_mm_sfence();
+#else
+	explicit_bzero(ptr, size);
+#endif
+}
+
+/* Sets the wipe policy given as "policy" for all classes or as
+   "class=policy" for one. Returns false if the argument is invalid. */
+static bool set_wipe_policy(const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	const char *name = eq != NULL ? eq + 1 : arg;
+	int cls = 0;
+	int policy = 0;
+
+	while (policy < WIPE_POLICIES && strcmp(name, wipe_names[policy]))
+		policy++;
+	if (policy == WIPE_POLICIES)
+		return false;
+
+	if (eq == NULL)
+	{
+		for ( ; cls < WIPE_CLASSES; cls++)
+			wipe_policy[cls] = (enum wipe_policy) policy;
+		return true;
+	}
+
+	while (cls < WIPE_CLASSES && (strlen(wipe_classes[cls]) != (size_t) (eq - arg) || strncmp(arg, wipe_classes[cls], (size_t) (eq - arg))))
+		cls++;
+	if (cls == WIPE_CLASSES)
+		return false;
+	wipe_policy[cls] = (enum wipe_policy) policy;
+	return true;
+}
+
 /* If no xbm-file is specified show this test bitmap. */
 static struct xbm_dat *load_test_bitmap(struct xbm_dat *test)
 {
-	static unsigned char bits[] = {
+	static const unsigned char bits[] = {
 		0xFF, 0x7F, 0xFF, 0x7F, 0xFF, 0x7F, 0xFF, 0x7F, 0xFF, 0x7F, 0xFF, 0x7F,
 		0xFF, 0x7F, 0xFF, 0x7F, 0xFF, 0x7F, 0xFF, 0x7F, 0xFF, 0x7F, 0xFF, 0x7F,
 		0xFF, 0x7F, 0xFF, 0x7F, 0xFF, 0x7F, 0xFF, 0x7F, 0xFF, 0x7F, 0xFF, 0x7F,
@@ -482,10 +7701,20 @@ static struct xbm_dat *load_test_bitmap(struct xbm_dat *test)
 		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 	};
 
+	/* The data is copied, as the transforms replace it. */
+	if ((test->data = malloc(sizeof(bits))) == NULL)
+		return NULL;
+	memcpy(test->data, bits, sizeof(bits));
+
 	test->width = 256;
 	test->height = 64;
 	test->len = 2048;
-	test->data = bits;
+	test->stride = 32;
+	test->tiles = NULL;
+	test->map = NULL;
+	test->map_size = 0;
+	test->half = NULL;
+	test->stats = NULL;
 
 	return test;
 }